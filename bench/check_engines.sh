@@ -0,0 +1,41 @@
+#!/bin/sh
+# Checks that the block engine and the JIT run every workload exactly like
+# the interpreter. Each workload runs on the three engines, the JIT
+# compiling every block the first time it is entered, and a window of the
+# trace far into the run is compared along with what the run printed.
+#
+# usage: bench/check_engines.sh <simulator> [simulator options]
+#   e.g. bench/check_engines.sh ./RiscV --mem-size=64M
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <simulator> [simulator options]" >&2
+    exit 1
+fi
+sim=$1
+shift
+
+dir=$(dirname "$0")
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+window=range:8000000-8002000
+failed=0
+for workload in dhrystone coremark memcpy division sort; do
+    for engine in interp block jit; do
+        "$sim" --engine=$engine --jit-threshold=1 --trace=$window "$@" "$dir/$workload.hex" "$out/$engine.txt" > "$out/$engine.log" 2>&1
+    done
+    if [ ! -s "$out/interp.txt" ]; then
+        echo "FAIL $workload: no trace in the window"
+        failed=1
+        continue
+    fi
+    for engine in block jit; do
+        if cmp -s "$out/interp.txt" "$out/$engine.txt" && cmp -s "$out/interp.log" "$out/$engine.log"; then
+            echo "ok   $workload $engine"
+        else
+            echo "FAIL $workload $engine"
+            failed=1
+        fi
+    done
+done
+exit $failed
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Checks that a restored checkpoint carries on exactly like the run it was
+# taken from. Every workload is run once without stopping and once saved
+# after 3000000 instructions and restored, on each engine, and a window of
+# the trace well past the checkpoint is compared between the two.
+#
+# usage: bench/check_restore.sh <simulator> [simulator options]
+#   e.g. bench/check_restore.sh ./RiscV --jit-threshold=1
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <simulator> [simulator options]" >&2
+    exit 1
+fi
+sim=$1
+shift
+
+dir=$(dirname "$0")
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+at=3000000
+window=range:8000000-8002000
+failed=0
+for workload in dhrystone coremark memcpy division sort; do
+    for engine in interp block jit; do
+        "$sim" --engine=$engine --trace=$window "$@" "$dir/$workload.hex" "$out/straight.txt" > "$out/straight.log" 2>&1
+        "$sim" --engine=$engine --trace=off --checkpoint="$out/cp.bin" --checkpoint-at=$at "$@" \
+            "$dir/$workload.hex" /dev/null > /dev/null 2>&1
+        "$sim" --engine=$engine --trace=$window "$@" --restore="$out/cp.bin" "$out/restored.txt" > "$out/restored.log" 2>&1
+        if [ ! -s "$out/straight.txt" ]; then
+            echo "FAIL $workload $engine: no trace in the window"
+            failed=1
+        elif cmp -s "$out/straight.txt" "$out/restored.txt" && cmp -s "$out/straight.log" "$out/restored.log"; then
+            echo "ok   $workload $engine"
+        else
+            echo "FAIL $workload $engine"
+            failed=1
+        fi
+        rm -f "$out/cp.bin"
+    done
+done
+exit $failed
@@ -0,0 +1,194 @@
+# CoreMark-style integer workload: linked list walks, a small matrix
+# multiply, a state machine driven through a jump table and a CRC16 over
+# the results of every round. Leaves the CRC in a0.
+
+    .equ ROUNDS, 2000
+    .equ NODES, 64
+    .equ N, 8              # matrix size
+
+    .text
+_start:
+    li sp, 0x81000000
+    li s0, 0x80100000      # list nodes (next, value) at +0, matrices at +0x1000, +0x1100, +0x1200
+    li s1, 0               # crc
+    li s2, ROUNDS
+
+    # the list goes through the nodes in a scrambled order
+    li t0, 0
+    li t5, NODES
+init_list:
+    li t1, 37
+    mul t1, t0, t1
+    andi t1, t1, NODES - 1 # value is a scrambled index
+    slli t2, t0, 3
+    add t2, s0, t2
+    addi t3, t2, 8
+    addi t4, t0, 1
+    bne t4, t5, 1f
+    li t3, 0               # last node ends the list
+1:
+    sw t3, 0(t2)
+    sw t1, 4(t2)
+    addi t0, t0, 1
+    blt t0, t5, init_list
+
+    # matrices a and b
+    li t0, 0
+    li t5, N * N
+    li t6, 0x1000
+    add t6, s0, t6
+init_matrix:
+    slli t1, t0, 2
+    add t1, t6, t1
+    addi t2, t0, -29
+    sw t2, 0(t1)
+    xori t3, t0, 0x15
+    sw t3, 0x100(t1)
+    addi t0, t0, 1
+    blt t0, t5, init_matrix
+
+round:
+    mv a0, s2
+    jal ra, list_walk
+    mv a1, s1
+    jal ra, crc16
+    mv s1, a0
+    jal ra, matrix_multiply
+    mv a1, s1
+    jal ra, crc16
+    mv s1, a0
+    mv a0, s2
+    jal ra, state_machine
+    mv a1, s1
+    jal ra, crc16
+    mv s1, a0
+    addi s2, s2, -1
+    bnez s2, round
+    mv a0, s1
+    ebreak
+
+# walks the list summing values, the nodes below the key get bumped.
+# a0 = key, returns the sum
+list_walk:
+    andi a1, a0, NODES - 1
+    mv t0, s0
+    li a0, 0
+1:
+    lw t1, 4(t0)
+    add a0, a0, t1
+    bgeu t1, a1, 2f
+    addi t1, t1, 1
+    andi t1, t1, NODES - 1
+    sw t1, 4(t0)
+2:
+    lw t0, 0(t0)
+    bnez t0, 1b
+    ret
+
+# c = a * b for the N x N matrices, returns the trace of c
+matrix_multiply:
+    li t6, 0x1000
+    add t6, s0, t6         # a, b at +0x100, c at +0x200
+    li a0, 0
+    li t0, 0               # row
+1:
+    li t1, 0               # column
+2:
+    li t2, 0               # k
+    li t3, 0               # sum
+3:
+    slli t4, t0, 3
+    add t4, t4, t2
+    slli t4, t4, 2
+    add t4, t6, t4
+    lw t4, 0(t4)
+    slli t5, t2, 3
+    add t5, t5, t1
+    slli t5, t5, 2
+    add t5, t6, t5
+    lw t5, 0x100(t5)
+    mul t4, t4, t5
+    add t3, t3, t4
+    addi t2, t2, 1
+    li t4, N
+    blt t2, t4, 3b
+    slli t4, t0, 3
+    add t4, t4, t1
+    slli t4, t4, 2
+    add t4, t6, t4
+    sw t3, 0x200(t4)
+    bne t0, t1, 4f
+    add a0, a0, t3
+4:
+    addi t1, t1, 1
+    li t4, N
+    blt t1, t4, 2b
+    addi t0, t0, 1
+    blt t0, t4, 1b
+    ret
+
+# runs 64 input symbols made from a0 through a 4 state machine, the
+# state handlers are picked through a jump table. Returns the final
+# state times the number of transitions.
+state_machine:
+    la a2, state_table
+    li a3, 0               # state
+    li a4, 0               # transitions
+    li a5, 64
+    mv a1, a0
+1:
+    li t0, 1103515245
+    mul a1, a1, t0
+    addi a1, a1, 1234
+    srli t0, a1, 16
+    andi t0, t0, 7         # symbol
+    slli t1, a3, 2
+    add t1, a2, t1
+    lw t1, 0(t1)
+    jalr zero, 0(t1)
+state_idle:
+    beqz t0, next_state
+    li a3, 1
+    j transition
+state_number:
+    li t2, 5
+    bltu t0, t2, next_state
+    li a3, 2
+    j transition
+state_float:
+    andi t2, t0, 1
+    beqz t2, next_state
+    li a3, 3
+    j transition
+state_exponent:
+    li t2, 6
+    bne t0, t2, next_state
+    li a3, 0
+transition:
+    addi a4, a4, 1
+next_state:
+    addi a5, a5, -1
+    bnez a5, 1b
+    mul a0, a3, a4
+    ret
+
+# crc16 (0xA001 polynomial) of the low half of a0, on top of the crc in a1
+crc16:
+    li t0, 16
+    li t2, 0xA001
+1:
+    xor t1, a0, a1
+    andi t1, t1, 1
+    srli a1, a1, 1
+    beqz t1, 2f
+    xor a1, a1, t2
+2:
+    srli a0, a0, 1
+    addi t0, t0, -1
+    bnez t0, 1b
+    mv a0, a1
+    ret
+
+    .p2align 2
+state_table:
+    .word state_idle, state_number, state_float, state_exponent
@@ -0,0 +1,104 @@
+# Dhrystone-style integer workload: record copies, string copy and
+# compare, small procedure calls and integer arithmetic. Leaves a
+# checksum in a0.
+
+    .equ ITERATIONS, 50000
+
+    .text
+_start:
+    li sp, 0x81000000
+    li s0, 0x80100000      # record a at +0, record b at +32, strings at +64 and +128
+
+    # string 1: 31 letters and the terminator
+    li t0, 0
+    li t2, 26
+    li t4, 31
+init_string:
+    remu t1, t0, t2
+    addi t1, t1, 65
+    add t3, s0, t0
+    sb t1, 64(t3)
+    addi t0, t0, 1
+    blt t0, t4, init_string
+    sb zero, 95(s0)
+
+    li s1, 0               # checksum
+    li s2, ITERATIONS
+main_loop:
+    mv a0, s0
+    addi a1, s0, 32
+    jal ra, record_copy
+    mv a0, s2
+    jal ra, arith
+    add s1, s1, a0
+    addi a0, s0, 128
+    addi a1, s0, 64
+    jal ra, string_copy
+    addi a0, s0, 128
+    addi a1, s0, 64
+    jal ra, string_compare
+    add s1, s1, a0
+    lw t0, 36(s0)
+    add s1, s1, t0
+    sw s1, 4(s0)           # record a changes every iteration
+    addi s2, s2, -1
+    bnez s2, main_loop
+    mv a0, s1
+    ebreak
+
+# copies the 8 word record at a0 to a1
+record_copy:
+    lw t0, 0(a0)
+    lw t1, 4(a0)
+    lw t2, 8(a0)
+    lw t3, 12(a0)
+    sw t0, 0(a1)
+    sw t1, 4(a1)
+    sw t2, 8(a1)
+    sw t3, 12(a1)
+    lw t0, 16(a0)
+    lw t1, 20(a0)
+    lw t2, 24(a0)
+    lw t3, 28(a0)
+    sw t0, 16(a1)
+    sw t1, 20(a1)
+    sw t2, 24(a1)
+    sw t3, 28(a1)
+    ret
+
+# mixes a0 with shifts, adds and a data dependent branch
+arith:
+    slli t0, a0, 2
+    add t0, t0, a0
+    andi t1, a0, 7
+    bnez t1, 1f
+    xori t0, t0, 0x55
+1:
+    srai t1, t0, 3
+    sub a0, t0, t1
+    slt t2, a0, zero
+    add a0, a0, t2
+    ret
+
+# copies the string at a1 to a0
+string_copy:
+    lbu t0, 0(a1)
+    sb t0, 0(a0)
+    addi a0, a0, 1
+    addi a1, a1, 1
+    bnez t0, string_copy
+    ret
+
+# a0 = 0 when the strings at a0 and a1 are equal
+string_compare:
+    lbu t0, 0(a0)
+    lbu t1, 0(a1)
+    bne t0, t1, 1f
+    addi a0, a0, 1
+    addi a1, a1, 1
+    bnez t0, string_compare
+    li a0, 0
+    ret
+1:
+    sub a0, t0, t1
+    ret
@@ -0,0 +1,59 @@
+# division-heavy workload: gcd with remu, base 10 conversion with
+# divu/remu and signed div/rem on mixed signs. Leaves a checksum in a0.
+
+    .equ COUNT, 160000
+
+    .text
+_start:
+    li sp, 0x81000000
+    li s0, 0x80100000      # digits of the last conversion
+    li s1, 0               # checksum
+    li s2, 1               # i
+    li s3, COUNT
+    li s4, 10
+    li s5, 1000003
+    li s6, COUNT / 2
+
+loop:
+    # gcd(i * 7919, 1000003 - i)
+    li t0, 7919
+    mul a0, s2, t0
+    sub a1, s5, s2
+gcd:
+    remu t0, a0, a1
+    mv a0, a1
+    mv a1, t0
+    bnez a1, gcd
+    add s1, s1, a0
+
+    # decimal digits of i * 2654435761, least significant first
+    li t0, -1640531535
+    mul a0, s2, t0
+    mv t2, s0
+digits:
+    remu t1, a0, s4
+    divu a0, a0, s4
+    sb t1, 0(t2)
+    addi t2, t2, 1
+    bnez a0, digits
+    sub t2, t2, s0
+    add s1, s1, t2
+    lbu t1, 0(s0)
+    add s1, s1, t1
+
+    # signed division, the sign of the dividend flips every iteration
+    andi t0, s2, 1
+    neg t1, s1
+    beqz t0, 1f
+    mv t1, s1
+1:
+    sub t3, s2, s6         # divisor crosses zero
+    div t4, t1, t3
+    rem t5, t1, t3
+    xor s1, s1, t4
+    add s1, s1, t5
+
+    addi s2, s2, 1
+    bleu s2, s3, loop
+    mv a0, s1
+    ebreak
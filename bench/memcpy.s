@@ -0,0 +1,94 @@
+# memcpy/memset-heavy workload: the loop shapes compiled C uses for
+# word and byte copies, word and byte fills and strlen, over 64 KiB
+# buffers. Leaves a checksum of the buffers in a0.
+
+    .equ ROUNDS, 24
+    .equ SIZE, 0x10000
+
+    .text
+_start:
+    li sp, 0x81000000
+    li s0, 0x80100000      # source buffer
+    li s1, 0x80200000      # destination buffer
+    li s2, ROUNDS
+    li s3, 0               # checksum
+
+round:
+    # word fill of the source with a pattern that changes every round
+    mv a0, s0
+    li a1, SIZE / 4
+    li t1, 0x01010101
+    mul a2, s2, t1
+word_fill:
+    sw a2, 0(a0)
+    addi a2, a2, 7
+    addi a0, a0, 4
+    addi a1, a1, -1
+    bnez a1, word_fill
+
+    # word copy to the destination
+    mv a0, s1
+    mv a1, s0
+    li a2, SIZE / 4
+word_copy:
+    lw t0, 0(a1)
+    sw t0, 0(a0)
+    addi a1, a1, 4
+    addi a0, a0, 4
+    addi a2, a2, -1
+    bnez a2, word_copy
+
+    # byte fill of the second half of the source
+    li a0, SIZE / 2
+    add a0, s0, a0
+    li t1, SIZE
+    add a2, s0, t1
+    andi a1, s2, 0x7F
+    ori a1, a1, 1          # never zero, strlen runs over it below
+byte_fill:
+    sb a1, 0(a0)
+    addi a0, a0, 1
+    bne a0, a2, byte_fill
+
+    # byte copy of the whole source over the destination
+    mv a0, s1
+    mv a1, s0
+    li a2, SIZE
+byte_copy:
+    lb t0, 0(a1)
+    sb t0, 0(a0)
+    addi a1, a1, 1
+    addi a0, a0, 1
+    addi a2, a2, -1
+    bnez a2, byte_copy
+
+    # strlen of the filled half, terminated right before the end
+    li t1, SIZE - 1
+    add t1, s1, t1
+    sb zero, 0(t1)
+    li a0, SIZE / 2
+    add a0, s1, a0
+    mv t2, a0
+strlen:
+    lbu t0, 0(a0)
+    addi a0, a0, 1
+    bnez t0, strlen
+    sub t2, a0, t2
+    add s3, s3, t2
+
+    # a few words of both halves go into the checksum
+    lw t0, 0(s1)
+    add s3, s3, t0
+    li t1, SIZE / 2 - 4
+    add t1, s1, t1
+    lw t0, 0(t1)
+    add s3, s3, t0
+    li t1, SIZE / 2
+    add t1, s1, t1
+    lw t0, 0(t1)
+    add s3, s3, t0
+
+    addi s2, s2, -1
+    bnez s2, round
+    mv a0, s3
+    ebreak
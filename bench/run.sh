@@ -0,0 +1,105 @@
+#!/bin/sh
+# Benchmark harness for the simulator itself. Runs every workload of the
+# suite a few times with tracing off and with the full trace, and reports
+# the instructions retired, the median wall time with its spread and the
+# MIPS. Traced runs write to /dev/null, so they measure the trace
+# formatting and not the disk. Every result is also appended to a CSV
+# file, tagged with the commit, so runs of different commits can be
+# compared with -b.
+#
+# usage: bench/run.sh [-n runs] [-o results.csv] [-b baseline.csv] [-t percent]
+#                     [-w workloads] [-m trace modes] <simulator> [simulator options]
+#   -n runs      runs of every workload, the median is reported (5 by default)
+#   -o file      CSV file the results are appended to (bench_results.csv)
+#   -b file      earlier results to compare with, the harness exits with 1
+#                when a workload lost more than -t percent of its MIPS
+#   -t percent   allowed slowdown against the baseline (10 by default)
+#   -w list      comma separated workloads (all of them by default)
+#   -m list      comma separated trace modes, off and/or full (both by default)
+#
+#   e.g. bench/run.sh -n 7 ./riscv-sim --engine=jit
+
+dir=$(dirname "$0")
+runs=5
+results=bench_results.csv
+baseline=
+threshold=10
+workloads="dhrystone,coremark,memcpy,division,sort"
+modes="off,full"
+
+while getopts "n:o:b:t:w:m:" opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        o) results=$OPTARG ;;
+        b) baseline=$OPTARG ;;
+        t) threshold=$OPTARG ;;
+        w) workloads=$OPTARG ;;
+        m) modes=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+    echo "usage: $0 [-n runs] [-o results.csv] [-b baseline.csv] [-t percent] [-w workloads] [-m modes] <simulator> [simulator options]" >&2
+    exit 1
+fi
+sim=$1
+shift
+options="$*"
+commit=$(git -C "$dir" rev-parse --short HEAD 2>/dev/null || echo unknown)
+date=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+if [ ! -s "$results" ]; then
+    echo "commit,date,workload,trace,options,runs,instructions,median_s,min_s,max_s,spread_pct,mips" > "$results"
+fi
+
+printf "%-10s %-5s %12s %9s %8s %9s\n" workload trace instructions median spread MIPS
+failed=0
+for workload in $(echo "$workloads" | tr ',' ' '); do
+    for mode in $(echo "$modes" | tr ',' ' '); do
+        : > "$tmp/times"
+        instret=
+        run=0
+        while [ "$run" -lt "$runs" ]; do
+            start=$(date +%s.%N)
+            if ! "$sim" --trace="$mode" --stats "$@" "$dir/$workload.hex" /dev/null 2> "$tmp/stats"; then
+                echo "$workload (trace $mode) failed:" >&2
+                cat "$tmp/stats" >&2
+                exit 1
+            fi
+            end=$(date +%s.%N)
+            echo "$start $end" | awk '{ printf "%.6f\n", $2 - $1 }' >> "$tmp/times"
+            instret=$(awk '/^instructions retired:/ { print $3 }' "$tmp/stats")
+            run=$((run + 1))
+        done
+
+        # median, min, max and the spread between them relative to the median
+        line=$(sort -n "$tmp/times" | awk -v instret="$instret" '
+            { t[NR] = $1 }
+            END {
+                median = (NR % 2) ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+                printf "%.6f,%.6f,%.6f,%.1f,%.1f", median, t[1], t[NR], 100 * (t[NR] - t[1]) / median, instret / median / 1e6
+            }')
+        echo "$commit,$date,$workload,$mode,\"$options\",$runs,$instret,$line" >> "$results"
+        echo "$workload $mode $instret $line" | tr ',' ' ' |
+            awk '{ printf "%-10s %-5s %12d %8.4fs %7.1f%% %9.1f\n", $1, $2, $3, $4, $7, $8 }'
+
+        if [ -n "$baseline" ]; then
+            # the latest baseline row with the same workload, trace mode and options
+            old=$(awk -F, -v w="$workload" -v m="$mode" -v o="\"$options\"" '$3 == w && $4 == m && $5 == o { mips = $12 } END { print mips }' "$baseline")
+            new=$(echo "$line" | cut -d, -f5)
+            if [ -n "$old" ]; then
+                if ! echo "$old $new $threshold" | awk '{
+                        change = 100 * ($2 - $1) / $1
+                        printf "           vs baseline %9.1f MIPS: %+.1f%%%s\n", $1, change, (change < -$3) ? "  SLOWER" : ""
+                        exit (change < -$3) }'; then
+                    failed=1
+                fi
+            fi
+        fi
+    done
+done
+
+exit $failed
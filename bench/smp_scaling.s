@@ -0,0 +1,40 @@
+# SMP scaling workload: the harts split 256 chunks of integer work between
+# them, grabbing the next chunk with amoadd.w until none are left. Every
+# chunk adds its partial sum into a shared total, hart 0 waits for all the
+# chunks to finish and leaves the total in a1 (0x53800000).
+#
+# a0 holds the hart id at reset. Shared words at 0x80100000: next chunk,
+# finished chunks, total.
+
+    .text
+_start:
+    lui s0, 0x80100
+    li s1, 256             # chunks
+    li s2, 65536           # iterations per chunk
+    li s3, 1
+grab:
+    amoadd.w t1, s3, (s0)
+    bge t1, s1, finished
+    mul t2, t1, s2         # first i of the chunk
+    add t3, t2, s2
+    li t4, 0
+work:
+    mul t5, t2, t2
+    srli t6, t2, 3
+    xor t5, t5, t6
+    add t4, t4, t5
+    addi t2, t2, 1
+    blt t2, t3, work
+    addi t5, s0, 8
+    amoadd.w zero, t4, (t5)
+    addi t5, s0, 4
+    amoadd.w zero, s3, (t5)
+    j grab
+finished:
+    bnez a0, stop          # only hart 0 waits for the others
+wait:
+    lw t1, 4(s0)
+    bne t1, s1, wait
+    lw a1, 8(s0)
+stop:
+    ebreak
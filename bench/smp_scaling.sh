@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs smp_scaling.hex free running with 1, 2, 4, ... harts and prints the
+# best wall time out of three runs and the speedup over a single hart.
+#
+# usage: bench/smp_scaling.sh <simulator> [max harts] [simulator options]
+#   e.g. bench/smp_scaling.sh ./RiscV 8 --engine=jit
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <simulator> [max harts] [simulator options]" >&2
+    exit 1
+fi
+sim=$1
+shift
+max_harts=$(nproc)
+if [ $# -gt 0 ]; then
+    max_harts=$1
+    shift
+fi
+
+dir=$(dirname "$0")
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+printf "%5s  %9s  %7s\n" harts seconds speedup
+base=
+harts=1
+while [ "$harts" -le "$max_harts" ]; do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s.%N)
+        if ! "$sim" --trace=off --harts="$harts" --quantum=0 "$@" "$dir/smp_scaling.hex" "$out/trace.txt"; then
+            echo "run with $harts harts failed" >&2
+            exit 1
+        fi
+        end=$(date +%s.%N)
+        best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 != "" && $3 < t) t = $3; printf "%.4f", t }')
+    done
+    [ -z "$base" ] && base=$best
+    echo "$harts $best $base" | awk '{ printf "%5d  %9.4f  %6.2fx\n", $1, $2, $3 / $2 }'
+    harts=$((harts * 2))
+done
@@ -0,0 +1,103 @@
+# branchy sort workload: recursive quicksort of pseudo-random arrays,
+# each one checked afterwards. Leaves 0 in a0 when every array came out
+# sorted, a1 holds a checksum of the sorted arrays.
+
+    .equ ROUNDS, 40
+    .equ LENGTH, 4096
+
+    .text
+_start:
+    li sp, 0x81000000
+    li s0, 0x80100000      # the array
+    li s1, ROUNDS
+    li s2, 12345           # random seed
+    li s3, 0               # unsorted arrays seen
+    li s4, 0               # checksum
+
+round:
+    # fill with a linear congruential generator
+    mv t0, s0
+    li t1, LENGTH
+    li t2, 1664525
+    li t3, 1013904223
+fill:
+    mul s2, s2, t2
+    add s2, s2, t3
+    srai t4, s2, 8         # signed values, both halves of the range
+    sw t4, 0(t0)
+    addi t0, t0, 4
+    addi t1, t1, -1
+    bnez t1, fill
+
+    mv a0, s0
+    li t0, (LENGTH - 1) * 4
+    add a1, s0, t0
+    jal ra, quicksort
+
+    # check the order and sum a few elements
+    mv t0, s0
+    li t1, LENGTH - 1
+check:
+    lw t2, 0(t0)
+    lw t3, 4(t0)
+    ble t2, t3, 1f
+    addi s3, s3, 1
+1:
+    addi t0, t0, 4
+    addi t1, t1, -1
+    bnez t1, check
+    lw t2, 0(s0)
+    add s4, s4, t2
+    li t1, LENGTH * 2
+    add t1, s0, t1
+    lw t2, 0(t1)
+    add s4, s4, t2
+
+    addi s1, s1, -1
+    bnez s1, round
+    mv a0, s3
+    mv a1, s4
+    ebreak
+
+# sorts the words from a0 to a1 (both included), Lomuto partition with
+# the last element as the pivot
+quicksort:
+    bgeu a0, a1, 3f
+    addi sp, sp, -16
+    sw ra, 12(sp)
+    sw s0, 8(sp)
+    sw s1, 4(sp)
+    sw s2, 0(sp)
+    mv s0, a0
+    mv s1, a1
+    lw t0, 0(a1)           # pivot
+    mv s2, a0              # store position
+    mv t1, a0
+1:
+    bgeu t1, a1, 2f
+    lw t2, 0(t1)
+    bge t2, t0, 4f
+    lw t3, 0(s2)
+    sw t2, 0(s2)
+    sw t3, 0(t1)
+    addi s2, s2, 4
+4:
+    addi t1, t1, 4
+    j 1b
+2:
+    lw t3, 0(s2)
+    sw t0, 0(s2)
+    sw t3, 0(a1)
+    mv a0, s0
+    addi a1, s2, -4
+    jal ra, quicksort
+    addi a0, s2, 4
+    mv a1, s1
+    jal ra, quicksort
+    lw ra, 12(sp)
+    lw s0, 8(sp)
+    lw s1, 4(sp)
+    lw s2, 0(sp)
+    addi sp, sp, 16
+3:
+    ret
@@ -1,13 +1,466 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h> 
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+
+#include "riscv_sim.h"
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+// operation ids for the pre-decoded form, one per instruction we execute
+enum {
+    OP_NOP,      // unknown encodings that only advance the pc
+    OP_CLEAR_RD, // unknown Load/R-Type encodings, they write zero into rd
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_SLLI, OP_SRLI, OP_SRAI, OP_ADDI, OP_ANDI, OP_SLTI, OP_SLTIU, OP_ORI, OP_XORI,
+    OP_AUIPC,
+    OP_SB, OP_SH, OP_SW,
+    OP_SLL, OP_SRL, OP_SLT, OP_SLTU, OP_ADD, OP_AND, OP_OR, OP_XOR, OP_SRA, OP_SUB,
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    OP_LUI,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_JALR, OP_JAL,
+    OP_EBREAK,
+    // A-Extension and fence.i, only the interpreter runs these
+    OP_LR_W, OP_SC_W,
+    OP_AMOSWAP_W, OP_AMOADD_W, OP_AMOXOR_W, OP_AMOAND_W, OP_AMOOR_W,
+    OP_AMOMIN_W, OP_AMOMAX_W, OP_AMOMINU_W, OP_AMOMAXU_W,
+    OP_FENCE_I,
+    OP_COUNT
+};
+
+// --- Trace pipeline ---
+// the simulator only fills fixed-size records into a single-producer /
+// single-consumer ring, a writer thread turns them into text
+#define TRACE_RING_SIZE (1u << 16) // records, must be a power of two
+#define TRACE_OUT_BUFFER_SIZE (1u << 20)
+#define TRACE_MAX_LINE 192
+
+// what one executed instruction left behind, the meaning of the value
+// fields depends on the instruction (see the handlers)
+typedef struct {
+    uint32_t pc;
+    uint32_t raw;
+    uint32_t rs1_val;
+    uint32_t rs2_val;
+    uint32_t result;
+    uint32_t address;
+} trace_record;
+
+// what the writer thread turns the records into
+enum {
+    TRACE_TEXT,  // one line per instruction, the default
+    TRACE_BINARY // compact records, turned into text later with --render=
+};
+
+typedef struct trace_encoder trace_encoder;
+
+typedef struct {
+    trace_record *ring;
+    FILE *output_file;
+    trace_encoder *encoder; // binary traces only
+    char *out;              // the writer fills it before each fwrite
+    pthread_t thread;
+    // head is only written by the simulator, tail only by the writer,
+    // each on its own cache line
+    _Alignas(64) atomic_uint head;
+    uint32_t cached_tail; // last tail the simulator saw
+    _Alignas(64) atomic_uint tail;
+    atomic_int done;
+} trace_writer;
+
+typedef struct decoded_instr decoded_instr;
+typedef struct exec_context exec_context;
+typedef struct block_cache block_cache;
+typedef struct smp_state smp_state;
+typedef struct profile profile;
+typedef struct timing_model timing_model;
+typedef struct pipeline_model pipeline_model;
+typedef struct device_bus device_bus;
+typedef int (*instr_handler)(const decoded_instr *d, exec_context *ctx);
+
+// pairs of instructions the untraced interpreter runs as one operation,
+// a cached word that starts one keeps its kind in fused
+enum {
+    FUSE_NONE = 0,
+    FUSE_LUI_ADDI,   // lui rd + addi rd, rd: a 32-bit constant
+    FUSE_AUIPC_JALR, // auipc t + jalr rd, t: a far call or jump
+    FUSE_AUIPC_LW,   // auipc t + lw rd, t: a pc-relative load
+    FUSE_SLLI_SRLI,  // slli rd + srli rd, rd: a zero extension
+    FUSE_MULH_MUL,   // mulh[u] + mul on the same operands
+    FUSE_DIV_REM,    // div[u] + rem[u] on the same operands
+    FUSE_COUNT
+};
+
+// loops the untraced interpreter runs all at once on host memory
+enum {
+    IDIOM_NONE = 0,
+    IDIOM_COPY, // a load and a store of the same size, memcpy
+    IDIOM_FILL, // a store of a register the loop doesn't change, memset
+    IDIOM_SCAN, // a byte load until it is zero, strlen
+    IDIOM_COUNT
+};
+
+// an instruction after decode: only the fields its handler needs,
+// with the one immediate it uses already sign extended
+struct decoded_instr {
+    instr_handler handler; // untraced build, NULL marks an empty cache entry
+    instr_handler traced;  // same operation with trace emission
+    uint32_t raw;
+    int32_t imm;
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t fused; // FUSE_* pair this word starts, handler then runs both
+};
+
+// --- Guest memory ---
+// the whole 32-bit guest space is reserved up front, the host only backs
+// the pages that actually get touched. page_flags keeps the permissions of
+// every 4 KiB page, an access to a page without them is a memory fault.
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1u << PAGE_SHIFT)
+#define PAGE_COUNT (1u << (32 - PAGE_SHIFT))
+#define GUEST_SPACE_SIZE ((size_t)1 << 32)
+
+// device pages have PAGE_DEVICE instead of the read/write bits, so every
+// RAM fast path turns them down and only the cold path sees them
+enum { PAGE_R = 1, PAGE_W = 2, PAGE_X = 4, PAGE_DEVICE = 8 };
+
+// why a run stopped before ebreak
+enum { FAULT_NONE = 0, FAULT_FETCH, FAULT_LOAD, FAULT_STORE };
+
+// LR reservations are word aligned, so an odd address means there is none
+#define RESERVATION_NONE 1u
+
+// a hart: its architectural state plus everything a handler touches
+// while executing one instruction
+struct exec_context {
+    uint32_t registers[32];
+    uint32_t pc;
+    uint8_t *memory;     // host address of guest address 0
+    uint8_t *page_flags; // PAGE_* bits of every guest page, 0 = unmapped
+    trace_writer *trace;
+    uint32_t mem_offset; // start of RAM, the part with decode caching
+    uint32_t mem_size;
+    decoded_instr *decode_cache; // one entry per RAM word, keyed by pc
+    block_cache *blocks; // translated blocks, NULL unless the block engine runs
+    uint64_t instret; // instructions retired so far
+    int fault;        // FAULT_* that stopped the run
+    uint32_t fault_address;
+    uint32_t reservation;       // address of the last lr.w, RESERVATION_NONE after sc.w
+    uint32_t reservation_value; // what lr.w read there
+    profile *profile; // --profile counters, NULL when it is off
+    timing_model *timing; // caches and branch predictor, NULL when they are off
+    pipeline_model *pipeline; // five-stage pipeline, NULL when it is off
+    smp_state *smp;   // shared by the harts of a machine, NULL with a single hart
+    device_bus *devices; // memory-mapped devices, shared too, NULL when there are none
+    int hart_id;
+    uint64_t quantum_left; // instructions left in the current turn
+    uint64_t fused[FUSE_COUNT]; // pairs that ran as one, by FUSE_* kind
+    uint64_t idiom_budget;        // instructions loop idioms may still retire in this run
+    uint64_t idioms[IDIOM_COUNT]; // loops run all at once, by IDIOM_* kind
+    uint64_t idiom_insns;         // instructions those loops retired
+};
+
+// --- Profiler types ---
+// dense counters for every RAM word plus a calling context tree, built
+// from the calls and returns the hart makes
+#define PROFILE_MAX_NODES (1u << 20)
+#define PROFILE_MAX_DEPTH 1024
+
+// how a jump looks to the calling convention: linking into ra or t0 is a
+// call, jalr x0 through ra or t0 a return
+enum { JUMP_PLAIN, JUMP_CALL, JUMP_RETURN };
+
+// one calling context, a function together with the calls that led to it
+typedef struct {
+    uint32_t pc;           // entry of the function, the call target
+    uint32_t parent;
+    uint32_t first_child;  // 0 = none, node 0 is the root and never a child
+    uint32_t next_sibling;
+    uint64_t self;         // instructions retired while it was innermost
+} profile_node;
+
+struct profile {
+    uint64_t *counts;      // times each RAM word executed, indexed like the decode cache
+    uint64_t *taken;       // times it sent the pc anywhere but the next word
+    size_t counts_size;    // bytes mapped for each of the two arrays
+    uint64_t outside;      // instructions executed outside RAM
+    profile_node *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint32_t current;      // context running now
+    uint32_t depth;
+    uint32_t lost_depth;   // calls past the tree limits, their returns pop nothing
+    uint64_t last_switch;  // instret when current became innermost
+};
+
+// --- Timing model types ---
+// caches and a branch predictor that turn the retired instructions into
+// an estimate of the cycles an in-order core would need: one cycle per
+// instruction plus the misses and mispredictions on top
+
+enum { REPLACE_LRU, REPLACE_FIFO, REPLACE_RANDOM };
+enum { PREDICT_STATIC, PREDICT_BIMODAL, PREDICT_GSHARE };
+
+// the control transfer the model still has to see the outcome of
+enum { PENDING_NONE, PENDING_BRANCH, PENDING_INDIRECT };
+
+typedef struct {
+    uint32_t size;       // bytes, 0 = no such cache
+    uint32_t ways;
+    uint32_t line;       // bytes per line
+    int policy;          // REPLACE_*
+    uint32_t hit_cycles; // what a hit adds, the L1 ones hide in the pipeline
+} cache_config;
+
+typedef struct {
+    cache_config l1i;
+    cache_config l1d;
+    cache_config l2;            // shared by both L1 caches, size 0 = none
+    int predictor;              // PREDICT_*
+    uint32_t predictor_entries; // 2-bit counters of bimodal and gshare
+    uint32_t btb_entries;       // jalr targets
+    uint32_t ras_entries;       // return addresses, 0 = no stack
+    uint32_t memory_cycles;     // a miss in the last cache level
+    uint32_t mispredict_cycles; // pipeline refill after a wrong prediction
+} timing_config;
+
+// a small in-order core: 32 KiB L1s, a 256 KiB L2, gshare with a 512
+// entry BTB and a 16 entry return stack
+#define TIMING_DEFAULT_CONFIG {                                          \
+    {32u << 10, 4, 64, REPLACE_LRU, 0}, {32u << 10, 8, 64, REPLACE_LRU, 0}, \
+    {256u << 10, 8, 64, REPLACE_LRU, 12}, PREDICT_GSHARE, 4096, 512, 16, 100, 3 \
+}
+
+typedef struct cache_model {
+    uint32_t *tags;        // line number + 1 for each way of each set, 0 = empty
+    uint64_t *stamps;      // last use (LRU) or fill (FIFO) of each way
+    uint32_t ways;
+    uint32_t set_mask;
+    uint32_t line_shift;
+    int policy;
+    uint32_t hit_cycles;
+    struct cache_model *next; // level below, NULL = memory
+    uint64_t clock;
+    uint32_t random;
+    uint64_t accesses;
+    uint64_t misses;
+} cache_model;
+
+struct timing_model {
+    timing_config config;
+    cache_model l1i;
+    cache_model l1d;
+    cache_model l2;
+    uint32_t fetch_line;   // last L1I line fetched from, +1 so 0 means none
+    uint32_t data_line;    // same for L1D
+    uint8_t *counters;     // 2-bit saturating, 2 and 3 predict taken
+    uint32_t counter_mask;
+    uint32_t history;      // global branch outcomes for gshare
+    uint32_t *btb_pc;
+    uint32_t *btb_target;
+    uint32_t *ras;         // circular, the oldest entries get overwritten
+    uint32_t ras_top;
+    uint32_t ras_count;
+    int pending;           // PENDING_*
+    uint32_t pending_pc;
+    uint32_t predicted_pc;
+    uint32_t counter;      // counter the pending branch was predicted with
+    uint64_t cycles;       // beyond the one per instruction
+    uint64_t instructions;
+    uint64_t branches;
+    uint64_t branch_misses;
+    uint64_t indirect;
+    uint64_t indirect_misses;
+};
+
+// --- Pipeline model types ---
+// a classic five-stage in-order pipeline: full forwarding, branches and
+// jalr resolved in EX, jal in ID, everything predicted not taken, and an
+// EX stage that mul/div keep busy for several cycles
+
+enum { STAGE_IF, STAGE_ID, STAGE_EX, STAGE_MEM, STAGE_WB, STAGE_COUNT };
+
+// why an instruction left WB later than one cycle after the one before
+enum { STALL_LOAD_USE, STALL_MULDIV, STALL_FLUSH, STALL_COUNT };
+
+#define PIPELINE_WINDOW 8 // recent instructions, enough to cover every stage
+
+typedef struct {
+    uint32_t pc;
+    uint32_t raw;
+    uint8_t op;
+    uint64_t stage[STAGE_COUNT]; // cycle it entered each stage
+} pipeline_slot;
+
+struct pipeline_model {
+    uint32_t mul_cycles;
+    uint32_t div_cycles;
+    uint32_t mem_offset;
+    uint32_t mem_size;
+    uint64_t ready[32];      // first cycle an EX can take each register from forwarding
+    uint8_t producer[32];    // STALL_* cause of waiting for it
+    pipeline_slot window[PIPELINE_WINDOW];
+    uint64_t instructions;   // the newest one is in window[(instructions - 1) % PIPELINE_WINDOW]
+    uint64_t *stalls;        // STALL_COUNT cycle counters for every RAM word
+    size_t stalls_size;
+    uint64_t outside[STALL_COUNT]; // stalls of code outside RAM
+    uint64_t total[STALL_COUNT];
+    FILE *trace;             // --pipeline-trace, NULL when off
+    uint64_t traced_until;   // first cycle not in the trace yet
+};
+
+// --- Block engine types ---
+#define BLOCK_MAX_LENGTH 64
+#define BLOCK_ARENA_SIZE (4u << 20)
+#define JIT_CODE_SIZE (16u << 20)
+
+// extra operation after the last instruction of a block that just runs out
+#define BLOCK_OP_FALLTHROUGH OP_COUNT
+
+// one instruction of a translated block, label is the address of the
+// code that executes it inside run_blocks
+typedef struct {
+    const void *label;
+    int32_t imm;
+    uint8_t op; // operation after translation, AUIPC shows up as LUI
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+} block_insn;
+
+// what native code of a JIT compiled block gets, and how it reports back
+typedef struct jit_frame {
+    uint32_t *registers;
+    uint8_t *memory;
+    exec_context *ctx;
+    uint32_t next_pc; // written on indirect and code-written exits
+    uint32_t done;    // instructions retired before a code-written exit
+} jit_frame;
+
+typedef uint32_t (*jit_block_fn)(jit_frame *frame);
+
+// a straight-line run of instructions ending at a branch, jump, ebreak
+// or after BLOCK_MAX_LENGTH instructions
+typedef struct block {
+    uint32_t start_pc;
+    uint32_t end_pc;         // pc right after the last instruction
+    uint32_t length;
+    uint64_t exec_count;     // times the block was entered
+    uint64_t folded;         // part of exec_count already in the profile counts
+    uint64_t taken_count;    // profiled exits through next[0]
+    uint8_t exit_kind;       // JUMP_* of the last instruction
+    uint8_t idiom;           // 1 when the block is a whole loop idiom
+    uint32_t next_pc[2];     // [0] branch/jump target, [1] fall-through
+    struct block *next[2];   // the same successors once chained
+    jit_block_fn native;     // JIT compiled version, NULL until it gets hot
+    block_insn insns[];
+} block;
+
+struct block_cache {
+    block **map;           // block starting at each memory word
+    uint8_t *code_words;   // 1 for every word inside some block
+    uint32_t code_lo;      // word range holding blocks, what a flush clears
+    uint32_t code_hi;
+    uint8_t *arena;        // blocks are bump allocated, a flush drops them all
+    size_t arena_used;
+    uint64_t translated;   // statistics
+    uint64_t flushes;
+    uint64_t insns_in_blocks;
+    // JIT tier, jit_code stays NULL when it is disabled
+    uint8_t *jit_code;     // executable buffer, bump allocated like the arena
+    size_t jit_used;
+    uint64_t jit_threshold; // block entries before it gets compiled
+    uint64_t jit_compiled;
+    uint64_t jit_insns;    // instructions retired in native code
+};
 
 // function prototypes
 int32_t sign_extension(uint32_t value, int bits);
-void hex_file_to_memory(FILE *openfile, uint8_t *mem_array, uint32_t offset);
+void hex_file_to_memory(const char *text, size_t length, uint8_t *mem_array, uint8_t *page_flags, uint32_t offset);
+int elf_file_to_memory(const uint8_t *file, size_t length, uint8_t *mem_array, uint8_t *page_flags, uint32_t *entry);
+int load_image_data(const uint8_t *data, size_t length, int format, uint8_t *mem_array, uint8_t *page_flags, uint32_t offset, uint32_t *entry);
+int load_image(const char *path, int format, uint8_t *mem_array, uint8_t *page_flags, uint32_t offset, uint32_t *entry);
+int checkpoint_save(const char *path, const exec_context *ctx);
+int checkpoint_restore(const char *path, exec_context *ctx);
+uint8_t *guest_memory_create(void);
+void guest_memory_clear(uint8_t *memory);
+void guest_memory_destroy(uint8_t *memory);
+void map_pages(uint8_t *page_flags, uint32_t start, uint32_t size, uint8_t perms);
 uint32_t read_word_from_mem(const uint8_t *mem_array, uint32_t array_pos_idx);
-int instruction_read(uint32_t instruction, uint32_t *registers, uint32_t *pc, const char **registers_label, uint8_t *memory, FILE *output_file, const uint32_t mem_offset);
+void decode_instruction(uint32_t instruction, decoded_instr *d);
+static inline int invalidate_decoded(exec_context *ctx, uint32_t mem_index, uint32_t size);
+static void drop_decoded(exec_context *ctx);
+static void invalidate_decoded_range(exec_context *ctx, uint32_t address, uint32_t size);
+static void fuse_decoded(exec_context *ctx, decoded_instr *d, uint32_t pc);
+void print_fusion_stats(const exec_context *ctx, FILE *out);
+static int loop_idiom_decoded(exec_context *ctx, decoded_instr *d, uint32_t pc);
+void print_idiom_stats(const exec_context *ctx, FILE *out);
+static inline int page_allows(const uint8_t *page_flags, uint32_t address, uint32_t size, uint8_t perm);
+static int memory_fault(exec_context *ctx, int fault, uint32_t address);
+uint32_t device_read(exec_context *ctx, uint32_t address, uint32_t size);
+int device_write(exec_context *ctx, uint32_t address, uint32_t size, uint32_t value);
+device_bus *device_bus_create(const char *uart_in, const char *uart_out, uint32_t tohost);
+void device_bus_destroy(device_bus *bus);
+void device_bus_reset(device_bus *bus);
+void device_bus_map(const device_bus *bus, uint8_t *page_flags);
+void device_flush(device_bus *bus);
+int trace_writer_start(trace_writer *tw, FILE *output_file, int format);
+void trace_writer_finish(trace_writer *tw);
+size_t render_trace_record(const trace_record *r, char *out);
+int render_binary_trace(const char *trace_path, const char *output_path, uint64_t start, uint64_t end, uint32_t pc_low, uint32_t pc_high);
+static int run_core_traced(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc);
+static int run_core_fast(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc);
+static int run_core_observed(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc);
+static int run_core_exact(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc);
+int parse_cache_option(const char *value, int optional, cache_config *config);
+int parse_predictor_option(const char *value, timing_config *config);
+timing_model *timing_create(const timing_config *config);
+void timing_destroy(timing_model *t);
+void timing_reset(timing_model *t);
+void timing_report(exec_context *ctx, FILE *out);
+pipeline_model *pipeline_create(uint32_t mem_offset, uint32_t mem_size, uint32_t mul_cycles, uint32_t div_cycles);
+void pipeline_destroy(pipeline_model *pl);
+void pipeline_reset(pipeline_model *pl);
+static void pipeline_trace_cycles(pipeline_model *pl, uint64_t until);
+void pipeline_report(pipeline_model *pl, FILE *out);
+profile *profile_create(uint32_t mem_size);
+void profile_destroy(profile *prof);
+void profile_reset(profile *prof);
+void profile_start(exec_context *ctx);
+void profile_fold_blocks(exec_context *ctx);
+static void profile_partial_block(exec_context *ctx, const block *b, uint32_t done);
+int profile_write(exec_context *ctx, const char *prefix);
+block_cache *block_cache_create(uint32_t mem_size);
+void block_cache_destroy(block_cache *bc);
+void print_block_stats(const exec_context *ctx, FILE *out);
+void block_cache_flush(exec_context *ctx);
+void block_cache_reset(exec_context *ctx);
+int run_blocks(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc);
+
+// ABI names for the registers, useful for debbug
+static const char *const registers_label[32] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+    "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"
+};
 
 // extends a smaller number to 32 bits, keeping the sign
 int32_t sign_extension(uint32_t value, int bits) {
@@ -17,32 +470,269 @@ int32_t sign_extension(uint32_t value, int bits) {
     return (int32_t)value;
 }
 
-// reads a hex file and loads it into our memory array
-void hex_file_to_memory(FILE *openfile, uint8_t *mem_array, uint32_t offset) {
-    char line_buffer[256];
-    uint32_t actual_hex_pos = 0;
-    int32_t next_mem_pos = -1;
+// M-Extension arithmetic, shared by every execution engine so the
+// corner cases (divide by zero, INT32_MIN / -1) live in one place
+static inline uint32_t rv_mulh(uint32_t a, uint32_t b) {
+    return (uint32_t)(((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32);
+}
+
+static inline uint32_t rv_mulhsu(uint32_t a, uint32_t b) {
+    return (uint32_t)(((int64_t)(int32_t)a * (uint64_t)b) >> 32);
+}
+
+static inline uint32_t rv_mulhu(uint32_t a, uint32_t b) {
+    return (uint32_t)(((uint64_t)a * (uint64_t)b) >> 32);
+}
+
+static inline uint32_t rv_div(uint32_t a, uint32_t b) {
+    if (b == 0) {
+        return 0xFFFFFFFF;
+    }
+    if ((int32_t)a == INT32_MIN && (int32_t)b == -1) {
+        return a;
+    }
+    return (uint32_t)((int32_t)a / (int32_t)b);
+}
+
+static inline uint32_t rv_divu(uint32_t a, uint32_t b) {
+    return (b == 0) ? 0xFFFFFFFF : a / b;
+}
+
+static inline uint32_t rv_rem(uint32_t a, uint32_t b) {
+    if (b == 0) {
+        return a;
+    }
+    if ((int32_t)a == INT32_MIN && (int32_t)b == -1) {
+        return 0;
+    }
+    return (uint32_t)((int32_t)a % (int32_t)b);
+}
+
+static inline uint32_t rv_remu(uint32_t a, uint32_t b) {
+    return (b == 0) ? a : a % b;
+}
+
+// A-Extension: the value an AMO leaves in memory, given the old one
+static inline uint32_t amo_result(int op, uint32_t old, uint32_t operand) {
+    switch (op) {
+        case OP_AMOSWAP_W: return operand;
+        case OP_AMOADD_W: return old + operand;
+        case OP_AMOXOR_W: return old ^ operand;
+        case OP_AMOAND_W: return old & operand;
+        case OP_AMOOR_W: return old | operand;
+        case OP_AMOMIN_W: return ((int32_t)old < (int32_t)operand) ? old : operand;
+        case OP_AMOMAX_W: return ((int32_t)old > (int32_t)operand) ? old : operand;
+        case OP_AMOMINU_W: return (old < operand) ? old : operand;
+        default: return (old > operand) ? old : operand; // OP_AMOMAXU_W
+    }
+}
+
+// runs the AMO on a guest word and returns the old value. Other harts may
+// be touching the same word, so it is one host atomic, or a CAS loop for
+// min/max which the host has no instruction for. aq/rl are always honored
+// since every host atomic here is sequentially consistent.
+static inline uint32_t rv_amo(int op, _Atomic uint32_t *word, uint32_t operand) {
+    switch (op) {
+        case OP_AMOSWAP_W: return atomic_exchange(word, operand);
+        case OP_AMOADD_W: return atomic_fetch_add(word, operand);
+        case OP_AMOXOR_W: return atomic_fetch_xor(word, operand);
+        case OP_AMOAND_W: return atomic_fetch_and(word, operand);
+        case OP_AMOOR_W: return atomic_fetch_or(word, operand);
+        default: {
+            uint32_t old = atomic_load_explicit(word, memory_order_relaxed);
+            while (!atomic_compare_exchange_weak(word, &old, amo_result(op, old, operand))) {
+            }
+            return old;
+        }
+    }
+}
+
+// --- Image loading ---
+// the input file is mapped and parsed in place, no line buffers involved
+
+// what kind of file the program comes in
+enum { IMAGE_AUTO, IMAGE_HEX, IMAGE_ELF, IMAGE_BIN };
+
+// value of every hex digit, 0xFF for anything else
+static const uint8_t hex_digit_value[256] = {
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7,
+    ['8'] = 8, ['9'] = 9, ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+// the table above leaves non digits at 0, this marks which bytes are digits
+static const uint8_t is_hex_digit[256] = {
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1,
+    ['8'] = 1, ['9'] = 1, ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1,
+};
+
+// steps over the 0x or 0X in front of a number, which the old sscanf
+// loop's %x accepted too
+static const uint8_t *skip_hex_prefix(const uint8_t *p, const uint8_t *end) {
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && is_hex_digit[p[2]]) {
+        return p + 2;
+    }
+    return p;
+}
+
+// parses the hex text and writes it into our memory array. '@' sets the
+// address of the following bytes, bytes before the first '@' go to offset,
+// and pages the file touches get mapped on the way. Numbers may start
+// with 0x like they could with the old sscanf loop, anything else that
+// isn't hex ends the rest of its line.
+void hex_file_to_memory(const char *text, size_t length, uint8_t *mem_array, uint8_t *page_flags, uint32_t offset) {
+    const uint8_t *p = (const uint8_t *)text;
+    const uint8_t *end = p + length;
+    uint32_t next_mem_pos = offset;
+    uint32_t mapped_page = UINT32_MAX;
 
-    while (fgets(line_buffer, sizeof(line_buffer), openfile) != NULL) {
-        if (line_buffer[0] == '\n' || line_buffer[0] == '\0') {
+    while (p < end) {
+        uint8_t c = *p;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            p++;
+            continue;
+        }
+        if (c == '@') {
+            uint32_t address = 0;
+            for (p = skip_hex_prefix(p + 1, end); p < end && is_hex_digit[*p]; p++) {
+                address = (address << 4) | hex_digit_value[*p];
+            }
+            next_mem_pos = address;
+            continue;
+        }
+        if (!is_hex_digit[c]) {
+            while (p < end && *p != '\n') {
+                p++;
+            }
             continue;
         }
 
-        // '@' indicates a new memory address
-        if (line_buffer[0] == '@') {
-            sscanf(line_buffer, "@%x", &actual_hex_pos);
-            next_mem_pos = actual_hex_pos - offset;
-        } else {
-            char *ptr = line_buffer;
-            int chars_consumed;
-            uint32_t byte_value;
-            while (sscanf(ptr, "%x%n", &byte_value, &chars_consumed) > 0) {
-                mem_array[next_mem_pos] = (uint8_t)byte_value;
-                next_mem_pos++;
-                ptr += chars_consumed;
+        // the common "XX " case is two lookups, longer tokens keep their low byte
+        uint32_t byte_value = 0;
+        for (p = skip_hex_prefix(p, end); p < end && is_hex_digit[*p]; p++) {
+            byte_value = (byte_value << 4) | hex_digit_value[*p];
+        }
+        if ((next_mem_pos >> PAGE_SHIFT) != mapped_page) {
+            mapped_page = next_mem_pos >> PAGE_SHIFT;
+            if (page_flags[mapped_page] == 0) {
+                page_flags[mapped_page] = PAGE_R | PAGE_W | PAGE_X;
+            }
+        }
+        mem_array[next_mem_pos] = (uint8_t)byte_value;
+        next_mem_pos++;
+    }
+}
+
+// loads the PT_LOAD segments of a little-endian RV32 executable, each page
+// getting the permissions of the segments in it. Returns 0 on success.
+int elf_file_to_memory(const uint8_t *file, size_t length, uint8_t *mem_array, uint8_t *page_flags, uint32_t *entry) {
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *)file;
+    if (length < sizeof(Elf32_Ehdr) || eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+        eh->e_machine != EM_RISCV || eh->e_type != ET_EXEC || eh->e_phentsize != sizeof(Elf32_Phdr) ||
+        eh->e_phoff > length || (size_t)eh->e_phnum * sizeof(Elf32_Phdr) > length - eh->e_phoff) {
+        fprintf(stderr, "Not a 32-bit little-endian RISC-V executable\n");
+        return -1;
+    }
+    const Elf32_Phdr *ph = (const Elf32_Phdr *)(file + eh->e_phoff);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < eh->e_phnum; i++) {
+            if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) {
+                continue;
+            }
+            uint32_t first = ph[i].p_vaddr >> PAGE_SHIFT;
+            uint32_t last = (ph[i].p_vaddr + ph[i].p_memsz - 1) >> PAGE_SHIFT;
+            if (pass == 0) {
+                // segments replace whatever RAM mapping was there
+                if (ph[i].p_filesz > ph[i].p_memsz || ph[i].p_offset > length || ph[i].p_filesz > length - ph[i].p_offset ||
+                    last < first) {
+                    fprintf(stderr, "Bad ELF segment %d\n", i);
+                    return -1;
+                }
+                map_pages(page_flags, ph[i].p_vaddr, ph[i].p_memsz, 0);
+                continue;
+            }
+            uint8_t perms = ((ph[i].p_flags & PF_R) ? PAGE_R : 0) | ((ph[i].p_flags & PF_W) ? PAGE_W : 0) | ((ph[i].p_flags & PF_X) ? PAGE_X : 0);
+            for (uint32_t page = first; page <= last; page++) {
+                page_flags[page] |= perms;
+            }
+            memcpy(mem_array + ph[i].p_vaddr, file + ph[i].p_offset, ph[i].p_filesz);
+            memset(mem_array + ph[i].p_vaddr + ph[i].p_filesz, 0, ph[i].p_memsz - ph[i].p_filesz);
+        }
+    }
+    *entry = eh->e_entry;
+    return 0;
+}
+
+// puts a program image that is already in host memory into the guest, pc
+// starts at the ELF entry point, or at offset for HEX and raw images.
+// IMAGE_AUTO only tells ELF files from hex text. Returns 0 on success.
+int load_image_data(const uint8_t *data, size_t length, int format, uint8_t *mem_array, uint8_t *page_flags, uint32_t offset, uint32_t *entry) {
+    if (format == IMAGE_AUTO) {
+        format = (length >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0) ? IMAGE_ELF : IMAGE_HEX;
+    }
+
+    *entry = offset;
+    switch (format) {
+        case IMAGE_HEX:
+            hex_file_to_memory((const char *)data, length, mem_array, page_flags, offset);
+            return 0;
+        case IMAGE_ELF:
+            return elf_file_to_memory(data, length, mem_array, page_flags, entry);
+        case IMAGE_BIN:
+            // a flat copy of memory starting at offset
+            if (length > GUEST_SPACE_SIZE - offset) {
+                fprintf(stderr, "Binary image doesn't fit in the guest space\n");
+                return -1;
+            }
+            if (length > 0) {
+                map_pages(page_flags, offset, (uint32_t)length, PAGE_R | PAGE_W | PAGE_X);
+                memcpy(mem_array + offset, data, length);
             }
+            return 0;
+    }
+    return -1;
+}
+
+// maps the program file and loads it, a .bin name means a raw image when
+// the format is IMAGE_AUTO. Returns 0 on success.
+int load_image(const char *path, int format, uint8_t *mem_array, uint8_t *page_flags, uint32_t offset, uint32_t *entry) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error reading input file");
+        close(fd);
+        return -1;
+    }
+    size_t length = (size_t)st.st_size;
+    const uint8_t *file = NULL;
+    if (length > 0) {
+        void *mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            perror("Error mapping input file");
+            close(fd);
+            return -1;
         }
+        file = (const uint8_t *)mapped;
+    }
+    close(fd);
+
+    size_t path_length = strlen(path);
+    if (format == IMAGE_AUTO && !(length >= SELFMAG && memcmp(file, ELFMAG, SELFMAG) == 0) &&
+        path_length >= 4 && strcmp(path + path_length - 4, ".bin") == 0) {
+        format = IMAGE_BIN;
     }
+    int result = load_image_data(file, length, format, mem_array, page_flags, offset, entry);
+
+    if (file != NULL) {
+        munmap((void *)file, length);
+    }
+    return result;
 }
 
 // reads a 4-byte word from memory (little-endian)
@@ -54,435 +744,5906 @@ uint32_t read_word_from_mem(const uint8_t *mem_array, uint32_t array_pos_idx) {
     return (byte0 | (byte1 << 8) | (byte2 << 16) | (byte3 << 24));
 }
 
-// this is the core function, decodes and executes one instruction
-int instruction_read(uint32_t instruction, uint32_t *registers, uint32_t *pc, const char **registers_label, uint8_t *memory, FILE *output_file, const uint32_t mem_offset) {
-    // breaking down the instruction word into fields
-    uint32_t opcode = instruction & 0x7F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t funct7 = (instruction >> 25) & 0x7F;
-    uint32_t rd = (instruction >> 7) & 0x1F;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    uint32_t rs2 = (instruction >> 20) & 0x1F;
-
-    // immediates for each instruction type, need to calculate them all
-    int32_t imm_itype = sign_extension((instruction >> 20), 12);
-    int32_t imm_stype = sign_extension(((instruction >> 25) << 5) | ((instruction >> 7) & 0x1F), 12);
-    // B-type immediate is weird, need to shuffle bits
-    int32_t imm_btype = sign_extension((((instruction >> 31) & 0x1) << 12) | (((instruction >> 7) & 0x1) << 11) | (((instruction >> 25) & 0x3F) << 5) | (((instruction >> 8) & 0xF) << 1), 13);
-    uint32_t imm_utype = instruction & 0xFFFFF000;
-    // J-type immediate is also weird, more bit shuffling
-    int32_t imm_jtype = sign_extension((((instruction >> 31) & 0x1) << 20) | (((instruction >> 12) & 0xFF) << 12) | (((instruction >> 20) & 0x1) << 11) | (((instruction >> 21) & 0x3FF) << 1), 21);
-
-    // get values from source registers
-    uint32_t rs1_val = registers[rs1];
-    uint32_t rs2_val = registers[rs2];
-    int32_t rs1_signed = (int32_t)rs1_val;
-    int32_t rs2_signed = (int32_t)rs2_val;
-    
-    int keep_run = 1;
-    uint32_t current_pc = *pc;
-    *pc += 4; // PC standard increment, branches will override this
+// reserves the 4 GiB guest space. MAP_NORESERVE keeps the host from
+// accounting for it, pages only cost memory once they get written.
+uint8_t *guest_memory_create(void) {
+    void *memory = mmap(NULL, GUEST_SPACE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (memory == MAP_FAILED) ? NULL : (uint8_t *)memory;
+}
 
-    switch (opcode) {
+// drops every page of the guest space, all of it reads as zero again
+void guest_memory_clear(uint8_t *memory) {
+    mmap(memory, GUEST_SPACE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
 
-            // Load-Type
-        case 0b0000011: { 
-            uint32_t address = rs1_val + imm_itype;
-            uint32_t mem_index = address - mem_offset;
-            uint32_t value = 0;
-            switch(funct3){
-                case 0b000: // LB
-                    value = (uint32_t)sign_extension(memory[mem_index], 8);
-                    fprintf(output_file, "0x%08x:lb     %s,0x%03x(%s)  %s=mem[0x%08x]=0x%08x\n", current_pc, registers_label[rd], imm_itype & 0xFFF, registers_label[rs1], registers_label[rd], address, value);
-                    break;
-                case 0b001: // LH
-                    value = (uint32_t)sign_extension(memory[mem_index] | (memory[mem_index+1] << 8), 16);
-                    fprintf(output_file, "0x%08x:lh     %s,0x%03x(%s)  %s=mem[0x%08x]=0x%08x\n", current_pc, registers_label[rd], imm_itype & 0xFFF, registers_label[rs1], registers_label[rd], address, value);
-                    break;
-                case 0b010: // LW
-                    value = read_word_from_mem(memory, mem_index);
-                    fprintf(output_file, "0x%08x:lw     %s,0x%03x(%s)  %s=mem[0x%08x]=0x%08x\n", current_pc, registers_label[rd], imm_itype & 0xFFF, registers_label[rs1], registers_label[rd], address, value);
-                    break;
-                case 0b100: // LBU
-                    value = memory[mem_index];
-                    fprintf(output_file, "0x%08x:lbu    %s,0x%03x(%s)  %s=mem[0x%08x]=0x%08x\n", current_pc, registers_label[rd], imm_itype & 0xFFF, registers_label[rs1], registers_label[rd], address, value);
-                    break;
-                case 0b101: // LHU
-                    value = memory[mem_index] | (memory[mem_index+1] << 8);
-                    fprintf(output_file, "0x%08x:lhu    %s,0x%03x(%s)  %s=mem[0x%08x]=0x%08x\n", current_pc, registers_label[rd], imm_itype & 0xFFF, registers_label[rs1], registers_label[rd], address, value);
-                    break;
-            }
-            if (rd != 0) {
-                registers[rd] = value;
-            }
-            break;
-        }
+void guest_memory_destroy(uint8_t *memory) {
+    munmap(memory, GUEST_SPACE_SIZE);
+}
 
-            // I-Type (ALU immediate)
-        case 0b0010011: { 
-            uint32_t result = 0;
-            switch(funct3){
-                case 0b001: { // SLLI
-                    uint32_t shamt = (instruction >> 20) & 0x1F;
-                    result = rs1_val << shamt;
-                    fprintf(output_file, "0x%08x:slli   %s,%s,%d      %s=0x%08x<<%d=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], shamt, registers_label[rd], rs1_val, shamt, result);
-                    break;
-                }
-                case 0b101: { // SRLI / SRAI
-                    uint32_t shamt = (instruction >> 20) & 0x1F;
-                    if (funct7 == 0b0000000) { // SRLI
-                        result = rs1_val >> shamt;
-                        fprintf(output_file, "0x%08x:srli   %s,%s,%d      %s=0x%08x>>%d=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], shamt, registers_label[rd], rs1_val, shamt, result);
-                    } else { // SRAI
-                        result = (uint32_t)(rs1_signed >> shamt);
-                        fprintf(output_file, "0x%08x:srai   %s,%s,%d      %s=0x%08x>>>%d=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], shamt, registers_label[rd], rs1_val, shamt, result);
-                    }
-                    break;
-                }
-                case 0b000: // ADDI
-                    result = rs1_val + imm_itype;
-                    fprintf(output_file, "0x%08x:addi   %s,%s,0x%03x   %s=0x%08x+0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], imm_itype & 0xFFF, registers_label[rd], rs1_val, (uint32_t)imm_itype, result);
-                    break;
-                case 0b111: // ANDI
-                    result = rs1_val & imm_itype;
-                    fprintf(output_file, "0x%08x:andi   %s,%s,0x%03x   %s=0x%08x&0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], imm_itype & 0xFFF, registers_label[rd], rs1_val, (uint32_t)imm_itype, result);
-                    break;
-                case 0b010: // SLTI
-                    result = (rs1_signed < imm_itype) ? 1 : 0;
-                    fprintf(output_file, "0x%08x:slti   %s,%s,0x%03x   %s=(0x%08x<0x%08x)=%d\n", current_pc, registers_label[rd], registers_label[rs1], imm_itype & 0xFFF, registers_label[rd], rs1_val, (uint32_t)imm_itype, result);
-                    break;
-                case 0b011: // SLTIU
-                    result = (rs1_val < (uint32_t)imm_itype) ? 1 : 0;
-                    fprintf(output_file, "0x%08x:sltiu  %s,%s,0x%03x   %s=(0x%08x<0x%08x)=%d\n", current_pc, registers_label[rd], registers_label[rs1], imm_itype & 0xFFF, registers_label[rd], rs1_val, (uint32_t)imm_itype, result);
-                    break;
-                case 0b110: // ORI
-                    result = rs1_val | imm_itype;
-                    fprintf(output_file, "0x%08x:ori    %s,%s,0x%03x   %s=0x%08x|0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], imm_itype & 0xFFF, registers_label[rd], rs1_val, (uint32_t)imm_itype, result);
-                    break;
-                case 0b100: // XORI
-                    result = rs1_val ^ imm_itype;
-                    fprintf(output_file, "0x%08x:xori   %s,%s,0x%03x   %s=0x%08x^0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], imm_itype & 0xFFF, registers_label[rd], rs1_val, (uint32_t)imm_itype, result);
-                    break;
-            }
-            if (rd != 0) {
-                registers[rd] = result;
-            }
+// gives every page overlapping [start, start + size) the perms
+void map_pages(uint8_t *page_flags, uint32_t start, uint32_t size, uint8_t perms) {
+    if (size == 0) {
+        return;
+    }
+    uint32_t first = start >> PAGE_SHIFT;
+    uint32_t last = (uint32_t)(start + size - 1) >> PAGE_SHIFT;
+    for (uint32_t page = first; ; page = (page + 1) & (PAGE_COUNT - 1)) {
+        page_flags[page] = perms;
+        if (page == last) {
             break;
         }
-            // AUIPC
-        case 0b0010111: 
-            if (rd != 0) {
-                registers[rd] = current_pc + imm_utype;
-            }
-            fprintf(output_file, "0x%08x:auipc  %s,0x%05x     %s=0x%08x+0x%08x=0x%08x\n", current_pc, registers_label[rd], imm_utype >> 12, registers_label[rd], current_pc, imm_utype, registers[rd]);
-            break;
-        
-            // Store-Type
-        case 0b0100011: { 
-            uint32_t address = rs1_val + imm_stype;
-            uint32_t mem_index = address - mem_offset;
-            switch(funct3){
-                case 0b000: // SB
-                    memory[mem_index] = rs2_val & 0xFF;
-                    fprintf(output_file, "0x%08x:sb     %s,0x%03x(%s) mem[0x%08x]=0x%02x\n", current_pc, registers_label[rs2], imm_stype & 0xFFF, registers_label[rs1], address, rs2_val & 0xFF);
-                    break;
-                case 0b001: // SH
-                    memory[mem_index] = rs2_val & 0xFF;
-                    memory[mem_index+1] = (rs2_val >> 8) & 0xFF;
-                    fprintf(output_file, "0x%08x:sh     %s,0x%03x(%s) mem[0x%08x]=0x%04x\n", current_pc, registers_label[rs2], imm_stype & 0xFFF, registers_label[rs1], address, rs2_val & 0xFFFF);
-                    break;
-                case 0b010: // SW
-                    memory[mem_index] = rs2_val & 0xFF;
-                    memory[mem_index+1] = (rs2_val >> 8) & 0xFF;
-                    memory[mem_index+2] = (rs2_val >> 16) & 0xFF;
-                    memory[mem_index+3] = (rs2_val >> 24) & 0xFF;
-                    fprintf(output_file, "0x%08x:sw     %s,0x%03x(%s) mem[0x%08x]=0x%08x\n", current_pc, registers_label[rs2], imm_stype & 0xFFF, registers_label[rs1], address, rs2_val);
-                    break;
-            }
-            break;
+    }
+}
+
+// 1 when every byte of the access lies in pages with perm. Accesses never
+// span more than two pages, so checking both ends is enough.
+static inline int page_allows(const uint8_t *page_flags, uint32_t address, uint32_t size, uint8_t perm) {
+    uint32_t last = address + size - 1;
+    return (page_flags[address >> PAGE_SHIFT] & page_flags[last >> PAGE_SHIFT] & perm) != 0;
+}
+
+// records why the run stops, the pc stays on the faulting instruction
+static int memory_fault(exec_context *ctx, int fault, uint32_t address) {
+    ctx->fault = fault;
+    ctx->fault_address = address;
+    return 0;
+}
+
+// drops the cached decode of every word touched by a store, so code
+// written at runtime gets decoded again the next time it is fetched.
+// Translated blocks covering those words are flushed too, returns 1 when
+// that happened so a running block knows it has to stop.
+static inline int invalidate_decoded(exec_context *ctx, uint32_t mem_index, uint32_t size) {
+    uint32_t last = mem_index + size - 1;
+    int hit_block = 0;
+    if (mem_index < ctx->mem_size) {
+        ctx->decode_cache[mem_index >> 2].handler = NULL;
+        hit_block |= ctx->blocks != NULL && ctx->blocks->code_words[mem_index >> 2];
+        // a pair fused with the word before runs this one too
+        if (mem_index >= 4 && ctx->decode_cache[(mem_index >> 2) - 1].fused != FUSE_NONE) {
+            ctx->decode_cache[(mem_index >> 2) - 1].handler = NULL;
         }
-        
-            // R-Type
-        case 0b0110011: {
-            uint32_t result = 0;
-            // The R-Type instructions are grouped by funct7 first.
-            if (funct7 == 0b0000000) {
-                switch(funct3){
-                    case 0b001: { // SLL
-                        uint32_t shamt = rs2_val & 0x1F;
-                        result = rs1_val << shamt;
-                        fprintf(output_file, "0x%08x:sll    %s,%s,%s     %s=0x%08x<<%d=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, shamt, result); 
-                        break;
-                    }
-                    case 0b101: { // SRL
-                        uint32_t shamt = rs2_val & 0x1F;
-                        result = rs1_val >> shamt; 
-                        fprintf(output_file, "0x%08x:srl    %s,%s,%s     %s=0x%08x>>%d=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, shamt, result); 
-                        break;
-                    }
-                    case 0b010: // SLT
-                        result = (rs1_signed < rs2_signed) ? 1 : 0; 
-                        fprintf(output_file, "0x%08x:slt    %s,%s,%s     %s=(0x%08x<0x%08x)=%d\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result); 
-                        break;
-                    case 0b011: // SLTU
-                        result = (rs1_val < rs2_val) ? 1 : 0; 
-                        fprintf(output_file, "0x%08x:sltu   %s,%s,%s     %s=(0x%08x<0x%08x)=%d\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result); 
-                        break;
-                    case 0b000: // ADD
-                        result = rs1_val + rs2_val;
-                        fprintf(output_file, "0x%08x:add    %s,%s,%s     %s=0x%08x+0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result); 
-                        break;
-                    case 0b111: // AND
-                        result = rs1_val & rs2_val; 
-                        fprintf(output_file, "0x%08x:and    %s,%s,%s     %s=0x%08x&0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result); 
-                        break;
-                    case 0b110: // OR
-                        result = rs1_val | rs2_val; 
-                        fprintf(output_file, "0x%08x:or     %s,%s,%s     %s=0x%08x|0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result); 
-                        break;
-                    case 0b100: // XOR
-                        result = rs1_val ^ rs2_val; 
-                        fprintf(output_file, "0x%08x:xor    %s,%s,%s     %s=0x%08x^0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result); 
-                        break;
-                }
-            } else if (funct7 == 0b0100000) {
-                 switch(funct3){
-                    case 0b101: { // SRA
-                        uint32_t shamt = rs2_val & 0x1F;
-                        result = (uint32_t)(rs1_signed >> shamt); 
-                        fprintf(output_file, "0x%08x:sra    %s,%s,%s     %s=0x%08x>>>%d=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, shamt, result); 
-                        break;
-                    }
-                    case 0b000: // SUB
-                        result = rs1_val - rs2_val; 
-                        fprintf(output_file, "0x%08x:sub    %s,%s,%s     %s=0x%08x-0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result); 
-                        break;
-                 }
-
-                 // M-Extension
-            } else if (funct7 == 0b0000001) { 
-                 switch(funct3){
-                    case 0b000: // MUL
-                        result = rs1_val * rs2_val;
-                        fprintf(output_file, "0x%08x:mul    %s,%s,%s     %s=0x%08x*0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                    case 0b001: { // MULH
-                        int64_t product = (int64_t)rs1_signed * (int64_t)rs2_signed;
-                        result = (uint32_t)(product >> 32);
-                        fprintf(output_file, "0x%08x:mulh   %s,%s,%s     %s=upper(0x%08x*0x%08x)=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                    }
-                    case 0b010: { // MULHSU
-                        int64_t product = (int64_t)rs1_signed * (uint64_t)rs2_val;
-                        result = (uint32_t)(product >> 32);
-                        fprintf(output_file, "0x%08x:mulhsu %s,%s,%s     %s=upper(0x%08x(s)*0x%08x(u))=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                    }
-                    case 0b011: { // MULHU
-                        uint64_t product = (uint64_t)rs1_val * (uint64_t)rs2_val;
-                        result = (uint32_t)(product >> 32);
-                        fprintf(output_file, "0x%08x:mulhu  %s,%s,%s     %s=upper(0x%08x*0x%08x)=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                    }
-                    case 0b100: // DIV
-                        if (rs2_signed == 0){
-                            result = 0xFFFFFFFF; 
-                        } 
-                        else if (rs1_signed == INT32_MIN && rs2_signed == -1){
-                             result = (uint32_t)rs1_signed; 
-                        } 
-                        else{ 
-                            result = (uint32_t)(rs1_signed / rs2_signed); 
-                        }
-                        fprintf(output_file, "0x%08x:div    %s,%s,%s     %s=0x%08x/0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                    case 0b101: // DIVU
-                        if (rs2_val == 0){
-                            result = 0xFFFFFFFF; 
-                        } 
-                        else { 
-                            result = rs1_val / rs2_val; 
-                        }
-                        fprintf(output_file, "0x%08x:divu   %s,%s,%s     %s=0x%08x/0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                    case 0b110: // REM
-                        if (rs2_signed == 0) {
-                            result = rs1_val; 
-                        } 
-                        else if(rs1_signed == INT32_MIN && rs2_signed == -1) {
-                             result = 0; 
-                        } 
-                        else { 
-                            result = (uint32_t)(rs1_signed % rs2_signed); 
-                        }
-                        fprintf(output_file, "0x%08x:rem    %s,%s,%s     %s=0x%08x%%0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                    case 0b111: // REMU
-                        if (rs2_val == 0) {
-                            result = rs1_val; 
-                        } 
-                        else {
-                            result = rs1_val % rs2_val; 
-                        }
-                        fprintf(output_file, "0x%08x:remu   %s,%s,%s     %s=0x%08x%%0x%08x=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], registers_label[rs2], registers_label[rd], rs1_val, rs2_val, result);
-                        break;
-                }
-            }
-            if (rd != 0) {
-                registers[rd] = result;
-            }
-            break;
+    }
+    if (last < ctx->mem_size) {
+        ctx->decode_cache[last >> 2].handler = NULL;
+        hit_block |= ctx->blocks != NULL && ctx->blocks->code_words[last >> 2];
+    }
+    if (hit_block) {
+        block_cache_flush(ctx);
+    }
+    return hit_block;
+}
+
+// the same for size bytes at a guest address, for stores done in bulk.
+// Only entries that hold something get written, so a range that was
+// never code doesn't pull in decode cache pages.
+static void invalidate_decoded_range(exec_context *ctx, uint32_t address, uint32_t size) {
+    uint64_t start = (address > ctx->mem_offset) ? address : ctx->mem_offset;
+    uint64_t end = (uint64_t)address + size;
+    if (end > (uint64_t)ctx->mem_offset + ctx->mem_size) {
+        end = (uint64_t)ctx->mem_offset + ctx->mem_size;
+    }
+    if (start >= end) {
+        return;
+    }
+    uint32_t first = (uint32_t)(start - ctx->mem_offset) >> 2;
+    uint32_t last = (uint32_t)(end - 1 - ctx->mem_offset) >> 2;
+    int hit_block = 0;
+    // a pair fused with the word before runs the first one too
+    if (first > 0 && ctx->decode_cache[first - 1].fused != FUSE_NONE) {
+        ctx->decode_cache[first - 1].handler = NULL;
+    }
+    for (uint32_t i = first; i <= last; i++) {
+        if (ctx->decode_cache[i].handler != NULL) {
+            ctx->decode_cache[i].handler = NULL;
         }
+        hit_block |= ctx->blocks != NULL && ctx->blocks->code_words[i];
+    }
+    if (hit_block) {
+        block_cache_flush(ctx);
+    }
+}
 
-        case 0b0110111: // LUI
-            if (rd != 0) {
-                registers[rd] = imm_utype;
-            }
-            fprintf(output_file, "0x%08x:lui    %s,0x%05x     %s=0x%08x\n", current_pc, registers_label[rd], imm_utype >> 12, registers_label[rd], registers[rd]);
-            break;
+// forgets every decoded and translated instruction of the hart, the
+// decode cache pages go back to the host and read as empty entries
+static void drop_decoded(exec_context *ctx) {
+    madvise(ctx->decode_cache, (size_t)(ctx->mem_size / 4) * sizeof(decoded_instr), MADV_DONTNEED);
+    if (ctx->blocks != NULL) {
+        block_cache_flush(ctx);
+    }
+}
 
-            // B-Type
-        case 0b1100011: { 
-            const char* condition_str_ptr = "";
-            int branch_taken = 0;
-            switch (funct3) {
-                case 0b000: // BEQ
-                    if (rs1_val == rs2_val) {
-                        branch_taken = 1; 
-                        }
-                    condition_str_ptr = "==";
-                    fprintf(output_file, "0x%08x:beq    %s,%s,0x%03x  (0x%08x%s0x%08x)=%d->pc=0x%08x\n", current_pc, registers_label[rs1], registers_label[rs2], imm_btype, rs1_val, condition_str_ptr, rs2_val, branch_taken, branch_taken ? (current_pc + imm_btype) : (*pc));
-                    break;
-                case 0b001: // BNE
-                    if (rs1_val != rs2_val) { 
-                        branch_taken = 1; 
-                    }
-                    condition_str_ptr = "!=";
-                    fprintf(output_file, "0x%08x:bne    %s,%s,0x%03x  (0x%08x%s0x%08x)=%d->pc=0x%08x\n", current_pc, registers_label[rs1], registers_label[rs2], imm_btype, rs1_val, condition_str_ptr, rs2_val, branch_taken, branch_taken ? (current_pc + imm_btype) : (*pc));
-                    break;
-                case 0b100: // BLT
-                    if (rs1_signed < rs2_signed) { 
-                        branch_taken = 1; 
-                    }
-                    condition_str_ptr = "<";
-                    fprintf(output_file, "0x%08x:blt    %s,%s,0x%03x  (0x%08x%s0x%08x)=%d->pc=0x%08x\n", current_pc, registers_label[rs1], registers_label[rs2], imm_btype, rs1_val, condition_str_ptr, rs2_val, branch_taken, branch_taken ? (current_pc + imm_btype) : (*pc));
-                    break;
-                case 0b101: // BGE
-                    if (rs1_signed >= rs2_signed) { 
-                        branch_taken = 1; 
-                    }
-                    condition_str_ptr = ">=";
-                    fprintf(output_file, "0x%08x:bge    %s,%s,0x%03x  (0x%08x%s0x%08x)=%d->pc=0x%08x\n", current_pc, registers_label[rs1], registers_label[rs2], imm_btype, rs1_val, condition_str_ptr, rs2_val, branch_taken, branch_taken ? (current_pc + imm_btype) : (*pc));
-                    break;
-                case 0b110: // BLTU
-                    if (rs1_val < rs2_val) { 
-                        branch_taken = 1; 
-                    }
-                    condition_str_ptr = "<";
-                    fprintf(output_file, "0x%08x:bltu   %s,%s,0x%03x  (0x%08x%s0x%08x)=%d->pc=0x%08x\n", current_pc, registers_label[rs1], registers_label[rs2], imm_btype, rs1_val, condition_str_ptr, rs2_val, branch_taken, branch_taken ? (current_pc + imm_btype) : (*pc));
-                    break;
-                case 0b111: // BGEU
-                    if (rs1_val >= rs2_val) { 
-                        branch_taken = 1; 
-                    }
-                    condition_str_ptr = ">=";
-                    fprintf(output_file, "0x%08x:bgeu   %s,%s,0x%03x  (0x%08x%s0x%08x)=%d->pc=0x%08x\n", current_pc, registers_label[rs1], registers_label[rs2], imm_btype, rs1_val, condition_str_ptr, rs2_val, branch_taken, branch_taken ? (current_pc + imm_btype) : (*pc));
-                    break;
-            }
-            if (branch_taken) {
-                *pc = current_pc + imm_btype;
-            }
-            break;
+static inline int jump_kind(int op, int rd, int rs1) {
+    int links = (rd == 1 || rd == 5);
+    if (op == OP_JAL) {
+        return links ? JUMP_CALL : JUMP_PLAIN;
+    }
+    if (op == OP_JALR) {
+        if (links) {
+            return JUMP_CALL;
+        }
+        if (rd == 0 && (rs1 == 1 || rs1 == 5)) {
+            return JUMP_RETURN;
         }
+    }
+    return JUMP_PLAIN;
+}
 
-        case 0b1100111: // JALR
-            if (rd != 0) {
-                registers[rd] = current_pc + 4;
-            }
-            *pc = (rs1_val + imm_itype) & 0xFFFFFFFE;
-            fprintf(output_file, "0x%08x:jalr   %s,%s,0x%03x   pc=0x%08x+0x%08x,rd=0x%08x\n", current_pc, registers_label[rd], registers_label[rs1], imm_itype & 0xFFF, rs1_val, (uint32_t)imm_itype, registers[rd]);
-            break;
+// gives the instructions since the last call or return to the context
+// that ran them, now is the instret right after the jump
+static inline void profile_switch(profile *prof, uint64_t now) {
+    prof->nodes[prof->current].self += now - prof->last_switch;
+    prof->last_switch = now;
+}
 
-        case 0b1101111: // JAL
-            if (rd != 0) {
-                registers[rd] = current_pc + 4;
+// moves into the context of a call to target, making it on first use
+static void profile_call(profile *prof, uint64_t now, uint32_t target) {
+    profile_switch(prof, now);
+    if (prof->depth >= PROFILE_MAX_DEPTH) {
+        prof->lost_depth++;
+        return;
+    }
+    uint32_t child = prof->nodes[prof->current].first_child;
+    while (child != 0 && prof->nodes[child].pc != target) {
+        child = prof->nodes[child].next_sibling;
+    }
+    if (child == 0) {
+        if (prof->node_count == prof->node_capacity) {
+            uint32_t capacity = prof->node_capacity * 2;
+            profile_node *grown = NULL;
+            if (capacity <= PROFILE_MAX_NODES) {
+                grown = (profile_node *)realloc(prof->nodes, capacity * sizeof(profile_node));
             }
-            *pc = current_pc + imm_jtype;
-            fprintf(output_file, "0x%08x:jal    %s,0x%05x     pc=0x%08x,rd=0x%08x\n", current_pc, registers_label[rd], imm_jtype, *pc, registers[rd]);
-            break;
-            
-        case 0b1110011: // ebreak
-            if (funct3 == 0b000 && instruction == 0x00100073) { 
-                fprintf(output_file, "0x%08x:ebreak\n", current_pc);
-                keep_run = 0;
+            if (grown == NULL) {
+                prof->lost_depth++;
+                return;
             }
-            break;
+            prof->nodes = grown;
+            prof->node_capacity = capacity;
+        }
+        child = prof->node_count++;
+        profile_node *node = &prof->nodes[child];
+        node->pc = target;
+        node->parent = prof->current;
+        node->first_child = 0;
+        node->next_sibling = prof->nodes[prof->current].first_child;
+        node->self = 0;
+        prof->nodes[prof->current].first_child = child;
     }
+    prof->current = child;
+    prof->depth++;
+}
 
-    // x0 is hardwired to zero, so we always reset it
-    registers[0] = 0;
-    return keep_run;
+// back to the caller, a return from the root stays there
+static void profile_return(profile *prof, uint64_t now) {
+    profile_switch(prof, now);
+    if (prof->lost_depth > 0) {
+        prof->lost_depth--;
+    } else if (prof->current != 0) {
+        prof->current = prof->nodes[prof->current].parent;
+        prof->depth--;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    
-    // check if user provided input and output files
-    if (argc < 3) {
-        printf("Usage: %s <input_file.hex> <output_file.txt>\n", argv[0]);
-        return 1;
+static inline void profile_jump(profile *prof, int kind, uint64_t now, uint32_t target) {
+    if (kind == JUMP_CALL) {
+        profile_call(prof, now, target);
+    } else if (kind == JUMP_RETURN) {
+        profile_return(prof, now);
     }
-    
-    const char *input_path = argv[1];
-    const char *output_path = argv[2];
+}
 
-    // --- Hardware Initialization ---
-    // memory starts at 0x80000000 for this simulator
-    const uint32_t mem_offset = 0x80000000;
-    
-    const uint32_t mem_size = 32 * 1024;
-    uint8_t *memory = NULL;
-    memory = (uint8_t *)malloc(mem_size);
-    memset(memory, 0, mem_size);
-
-    uint32_t pc = mem_offset;
-    uint32_t registers[32] = {0};
-    // ABI names for the registers, useful for debbug
-    const char *registers_label[32] = {
-        "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", 
-        "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5", 
-        "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", 
-        "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"
-    };
+// counts one instruction the interpreter retired, the pc already moved on
+static inline void profile_step(exec_context *ctx, const decoded_instr *d, uint32_t pc, uint64_t now) {
+    profile *prof = ctx->profile;
+    uint32_t idx = pc - ctx->mem_offset;
+    if (idx < ctx->mem_size) {
+        prof->counts[idx >> 2]++;
+    } else {
+        prof->outside++;
+    }
+    // branches and jumps are next to each other in the op list
+    if ((unsigned)(d->op - OP_BEQ) <= OP_JAL - OP_BEQ) {
+        if (d->op <= OP_BGEU) {
+            if (idx < ctx->mem_size) {
+                prof->taken[idx >> 2] += (ctx->pc != pc + 4);
+            }
+        } else {
+            profile_jump(prof, jump_kind(d->op, d->rd, d->rs1), now, ctx->pc);
+        }
+    }
+}
 
-    FILE *input_file = fopen(input_path, "r");
-    if (input_file == NULL) {
-        perror("Error opening input file");
-        return 1;
+// looks a line up in a cache and the levels below it, filling it on the
+// way back. Returns the cycles the access adds.
+static uint32_t cache_access(const timing_model *t, cache_model *c, uint32_t address) {
+    uint32_t tag = (address >> c->line_shift) + 1;
+    uint32_t first = ((tag - 1) & c->set_mask) * c->ways;
+    uint32_t *tags = &c->tags[first];
+    uint64_t *stamps = &c->stamps[first];
+    c->accesses++;
+    c->clock++;
+    uint32_t victim = 0;
+    for (uint32_t w = 0; w < c->ways; w++) {
+        if (tags[w] == tag) {
+            if (c->policy == REPLACE_LRU) {
+                stamps[w] = c->clock;
+            }
+            return c->hit_cycles;
+        }
+        // empty ways go first, then the oldest one
+        if (tags[victim] != 0 && (tags[w] == 0 || stamps[w] < stamps[victim])) {
+            victim = w;
+        }
+    }
+    c->misses++;
+    if (c->policy == REPLACE_RANDOM && tags[victim] != 0) {
+        c->random ^= c->random << 13;
+        c->random ^= c->random >> 17;
+        c->random ^= c->random << 5;
+        victim = c->random % c->ways;
     }
+    tags[victim] = tag;
+    stamps[victim] = c->clock;
+    return c->hit_cycles + ((c->next != NULL) ? cache_access(t, c->next, address) : t->config.memory_cycles);
+}
 
-    FILE *output_file = fopen(output_path, "w");
-    if (output_file == NULL) {
-        perror("Error opening output file");
-        fclose(input_file);
-        return 1;
+static inline void ras_push(timing_model *t, uint32_t address) {
+    if (t->config.ras_entries == 0) {
+        return;
+    }
+    t->ras_top = (t->ras_top + 1) % t->config.ras_entries;
+    t->ras[t->ras_top] = address;
+    if (t->ras_count < t->config.ras_entries) {
+        t->ras_count++;
     }
+}
 
-    // loads the file in the simulated memory
-    hex_file_to_memory(input_file, memory, mem_offset);
+// predicts where a branch or jump goes, the next instruction tells
+// whether that was right. Direct targets come out of decode and are
+// always right, only their direction can be wrong.
+static void timing_predict(timing_model *t, const decoded_instr *d, uint32_t pc) {
+    if (d->op <= OP_BGEU) {
+        int taken = 0;
+        switch (t->config.predictor) {
+            case PREDICT_STATIC:
+                // backward taken, forward not taken
+                taken = (d->imm < 0);
+                break;
+            case PREDICT_BIMODAL:
+                t->counter = (pc >> 2) & t->counter_mask;
+                taken = (t->counters[t->counter] >= 2);
+                break;
+            case PREDICT_GSHARE:
+                t->counter = ((pc >> 2) ^ t->history) & t->counter_mask;
+                taken = (t->counters[t->counter] >= 2);
+                break;
+        }
+        t->branches++;
+        t->pending = PENDING_BRANCH;
+        t->pending_pc = pc;
+        t->predicted_pc = taken ? pc + (uint32_t)d->imm : pc + 4;
+        return;
+    }
+    int kind = jump_kind(d->op, d->rd, d->rs1);
+    if (d->op == OP_JAL) {
+        if (kind == JUMP_CALL) {
+            ras_push(t, pc + 4);
+        }
+        return;
+    }
+    // jalr: returns pop the stack, everything else asks the BTB
+    uint32_t predicted = pc + 4;
+    if (kind == JUMP_RETURN && t->ras_count != 0) {
+        predicted = t->ras[t->ras_top];
+        t->ras_top = (t->ras_top + t->config.ras_entries - 1) % t->config.ras_entries;
+        t->ras_count--;
+    } else {
+        uint32_t slot = (pc >> 2) & (t->config.btb_entries - 1);
+        if (t->btb_pc[slot] == pc) {
+            predicted = t->btb_target[slot];
+        }
+    }
+    if (kind == JUMP_CALL) {
+        ras_push(t, pc + 4);
+    }
+    t->indirect++;
+    t->pending = PENDING_INDIRECT;
+    t->pending_pc = pc;
+    t->predicted_pc = predicted;
+}
 
-    // main simulation loop
-    int keep_running = 1;
-    while (keep_running) {
-        // fetch
-        uint32_t idx = pc - mem_offset;
-        uint32_t instruction = read_word_from_mem(memory, idx);
-        // decode and execute
-        keep_running = instruction_read(instruction, registers, &pc, registers_label, memory, output_file, mem_offset);
-    }
-    
-    //Closes the file 
-    fclose(input_file);
-    fclose(output_file);
+// pc is where the pending branch or jump really went
+static void timing_resolve(timing_model *t, uint32_t pc) {
+    int wrong = (pc != t->predicted_pc);
+    t->cycles += wrong ? t->config.mispredict_cycles : 0;
+    if (t->pending == PENDING_BRANCH) {
+        t->branch_misses += wrong;
+        int taken = (pc != t->pending_pc + 4);
+        if (t->config.predictor != PREDICT_STATIC) {
+            uint8_t *counter = &t->counters[t->counter];
+            if (taken && *counter < 3) {
+                (*counter)++;
+            } else if (!taken && *counter > 0) {
+                (*counter)--;
+            }
+            t->history = (t->history << 1) | (uint32_t)taken;
+        }
+    } else {
+        t->indirect_misses += wrong;
+        uint32_t slot = (t->pending_pc >> 2) & (t->config.btb_entries - 1);
+        t->btb_pc[slot] = t->pending_pc;
+        t->btb_target[slot] = pc;
+    }
+    t->pending = PENDING_NONE;
+}
 
-    return 0;
+// the model sees every instruction right before it runs: the branch or
+// jump before it gets resolved by where the pc went, then the fetch and
+// the data access go through the caches
+static inline void timing_step(timing_model *t, const exec_context *ctx, const decoded_instr *d, uint32_t pc) {
+    if (t->pending != PENDING_NONE) {
+        timing_resolve(t, pc);
+    }
+    t->instructions++;
+    // a line used right before is a hit and already the most recent one
+    // of its set, straight-line code and sequential data skip the lookup
+    uint32_t line = (pc >> t->l1i.line_shift) + 1;
+    if (line == t->fetch_line) {
+        t->l1i.accesses++;
+    } else {
+        t->fetch_line = line;
+        t->cycles += cache_access(t, &t->l1i, pc);
+    }
+    int op = d->op;
+    if ((op >= OP_LB && op <= OP_LHU) || (op >= OP_SB && op <= OP_SW) || (op >= OP_LR_W && op <= OP_AMOMAXU_W)) {
+        uint32_t address = ctx->registers[d->rs1] + (uint32_t)d->imm;
+        line = (address >> t->l1d.line_shift) + 1;
+        if (line == t->data_line) {
+            t->l1d.accesses++;
+        } else {
+            t->data_line = line;
+            t->cycles += cache_access(t, &t->l1d, address);
+        }
+    } else if ((unsigned)(op - OP_BEQ) <= OP_JAL - OP_BEQ) {
+        timing_predict(t, d, pc);
+    }
+}
+
+// registers an operation reads, bit 0 for rs1 and bit 1 for rs2
+static inline int op_sources(int op) {
+    if ((op >= OP_LB && op <= OP_LHU) || (op >= OP_SLLI && op <= OP_XORI) || op == OP_JALR || op == OP_LR_W) {
+        return 1;
+    }
+    if ((op >= OP_SB && op <= OP_SW) || (op >= OP_SLL && op <= OP_REMU) || (op >= OP_BEQ && op <= OP_BGEU) ||
+        (op >= OP_SC_W && op <= OP_AMOMAXU_W)) {
+        return 3;
+    }
+    return 0;
+}
+
+static inline int op_writes_rd(int op) {
+    return (op >= OP_CLEAR_RD && op <= OP_AUIPC) || (op >= OP_SLL && op <= OP_LUI) || op == OP_JALR || op == OP_JAL ||
+           (op >= OP_LR_W && op <= OP_AMOMAXU_W);
+}
+
+// charges stall cycles to the instruction at pc
+static inline void pipeline_charge(pipeline_model *pl, uint32_t pc, int cause, uint64_t cycles) {
+    uint32_t idx = pc - pl->mem_offset;
+    if (idx < pl->mem_size) {
+        pl->stalls[(idx >> 2) * STALL_COUNT + cause] += cycles;
+    } else {
+        pl->outside[cause] += cycles;
+    }
+    pl->total[cause] += cycles;
+}
+
+// places the next instruction in the pipeline, right after the one before
+// it. Whether that one was a taken branch shows in the pc.
+static void pipeline_step(pipeline_model *pl, const decoded_instr *d, uint32_t pc) {
+    const pipeline_slot *p = &pl->window[(pl->instructions - 1) % PIPELINE_WINDOW];
+    pipeline_slot *s = &pl->window[pl->instructions % PIPELINE_WINDOW];
+
+    // fetch waits for ID to free up, and for a taken branch or jump to
+    // tell where to go
+    uint64_t fetch = (p->stage[STAGE_IF] + 1 > p->stage[STAGE_ID]) ? p->stage[STAGE_IF] + 1 : p->stage[STAGE_ID];
+    uint64_t flushed = 0;
+    if ((unsigned)(p->op - OP_BEQ) <= OP_JAL - OP_BEQ && pc != p->pc + 4) {
+        uint64_t redirect = p->stage[(p->op == OP_JAL) ? STAGE_ID : STAGE_EX] + 1;
+        if (redirect > fetch) {
+            flushed = redirect - fetch;
+            fetch = redirect;
+        }
+    }
+    if (pl->trace != NULL) {
+        pipeline_trace_cycles(pl, fetch);
+    }
+
+    s->pc = pc;
+    s->raw = d->raw;
+    s->op = d->op;
+    s->stage[STAGE_IF] = fetch;
+    s->stage[STAGE_ID] = (fetch + 1 > p->stage[STAGE_EX]) ? fetch + 1 : p->stage[STAGE_EX];
+    uint64_t issue = (s->stage[STAGE_ID] + 1 > p->stage[STAGE_MEM]) ? s->stage[STAGE_ID] + 1 : p->stage[STAGE_MEM];
+    uint64_t operands = issue;
+    int cause = STALL_MULDIV;
+    int sources = op_sources(d->op);
+    if ((sources & 1) && pl->ready[d->rs1] > operands) {
+        operands = pl->ready[d->rs1];
+        cause = pl->producer[d->rs1];
+    }
+    if ((sources & 2) && pl->ready[d->rs2] > operands) {
+        operands = pl->ready[d->rs2];
+        cause = pl->producer[d->rs2];
+    }
+    s->stage[STAGE_EX] = operands;
+    int muldiv = (d->op >= OP_MUL && d->op <= OP_REMU);
+    uint64_t latency = !muldiv ? 1 : (d->op >= OP_DIV) ? pl->div_cycles : pl->mul_cycles;
+    s->stage[STAGE_MEM] = (operands + latency > p->stage[STAGE_WB]) ? operands + latency : p->stage[STAGE_WB];
+    s->stage[STAGE_WB] = s->stage[STAGE_MEM] + 1;
+
+    // loads and atomics forward from the end of MEM, the rest from the end of EX
+    if (op_writes_rd(d->op) && d->rd != 0) {
+        int loads = (d->op >= OP_LB && d->op <= OP_LHU) || d->op >= OP_LR_W;
+        pl->ready[d->rd] = loads ? s->stage[STAGE_MEM] + 1 : operands + latency;
+        pl->producer[d->rd] = loads ? STALL_LOAD_USE : STALL_MULDIV;
+    }
+
+    // the extra cycles go to the flush first, then to waiting for an
+    // operand, the rest is EX still busy with a mul/div
+    uint64_t extra = s->stage[STAGE_WB] - p->stage[STAGE_WB] - 1;
+    if (extra != 0) {
+        uint64_t part = (flushed < extra) ? flushed : extra;
+        if (part != 0) {
+            pipeline_charge(pl, p->pc, STALL_FLUSH, part);
+            extra -= part;
+        }
+        part = (operands - issue < extra) ? operands - issue : extra;
+        if (part != 0) {
+            pipeline_charge(pl, pc, cause, part);
+            extra -= part;
+        }
+        if (extra != 0) {
+            pipeline_charge(pl, pc, STALL_MULDIV, extra);
+        }
+    }
+    pl->instructions++;
+}
+
+// queues one trace record, waiting for the writer only when the ring is full
+static inline void trace_push(trace_writer *tw, uint32_t pc, uint32_t raw, uint32_t rs1_val, uint32_t rs2_val, uint32_t result, uint32_t address) {
+    uint32_t head = atomic_load_explicit(&tw->head, memory_order_relaxed);
+    if (head - tw->cached_tail == TRACE_RING_SIZE) {
+        while ((tw->cached_tail = atomic_load_explicit(&tw->tail, memory_order_acquire)) == head - TRACE_RING_SIZE) {
+            sched_yield();
+        }
+    }
+    trace_record *r = &tw->ring[head & (TRACE_RING_SIZE - 1)];
+    r->pc = pc;
+    r->raw = raw;
+    r->rs1_val = rs1_val;
+    r->rs2_val = rs2_val;
+    r->result = result;
+    r->address = address;
+    atomic_store_explicit(&tw->head, head + 1, memory_order_release);
+}
+
+// pc can never be odd, so this never stops a run
+#define NO_STOP_PC 0xFFFFFFFFu
+
+// --- Execution core ---
+// built twice from the same source, the runner switches between the two
+
+#define CORE_FN(name) name##_traced
+#define CORE_HANDLER(d) ((d)->traced)
+#define TRACE(pc, rs1_val, rs2_val, result, address) trace_push(ctx->trace, (pc), d->raw, (rs1_val), (rs2_val), (result), (address))
+#define TIMING(d, pc)                                                                 \
+    if (ctx->timing != NULL) { timing_step(ctx->timing, ctx, (d), (pc)); }           \
+    if (ctx->pipeline != NULL) { pipeline_step(ctx->pipeline, (d), (pc)); }
+#define PROFILE(d, pc) if (ctx->profile != NULL && (keep_run || ctx->fault == FAULT_NONE)) { profile_step(ctx, (d), (pc), ctx->instret + steps); }
+#include "exec_core.inc"
+#undef PROFILE
+#undef TIMING
+#undef TRACE
+#undef CORE_HANDLER
+#undef CORE_FN
+
+#define CORE_FN(name) name##_fast
+#define CORE_HANDLER(d) ((d)->handler)
+#define CORE_FUSION
+#define TRACE(pc, rs1_val, rs2_val, result, address) ((void)0)
+#define TIMING(d, pc) ((void)0)
+#define PROFILE(d, pc) ((void)0)
+#include "exec_core.inc"
+#undef PROFILE
+#undef TIMING
+#undef TRACE
+#undef CORE_FUSION
+#undef CORE_HANDLER
+#undef CORE_FN
+
+// the untraced handlers again, only the loop is new: it feeds --profile
+// and the timing model. Those need to see every instruction on its own,
+// so fused pairs run as their first instruction here.
+#define CORE_FN(name) name##_observed
+#define CORE_HANDLER(d) (op_handlers_fast[(d)->op])
+#define CORE_LOOP_ONLY
+#define TIMING(d, pc)                                                                 \
+    if (ctx->timing != NULL) { timing_step(ctx->timing, ctx, (d), (pc)); }           \
+    if (ctx->pipeline != NULL) { pipeline_step(ctx->pipeline, (d), (pc)); }
+#define PROFILE(d, pc) if (ctx->profile != NULL && (keep_run || ctx->fault == FAULT_NONE)) { profile_step(ctx, (d), (pc), ctx->instret + steps); }
+#include "exec_core.inc"
+#undef PROFILE
+#undef TIMING
+#undef CORE_LOOP_ONLY
+#undef CORE_HANDLER
+#undef CORE_FN
+
+// and once more without anything around them, for untraced runs that have
+// to stop at an exact count or pc: the fast loop counts a fused pair as one
+// step, so it could only stop after the pair
+#define CORE_FN(name) name##_exact
+#define CORE_HANDLER(d) (op_handlers_fast[(d)->op])
+#define CORE_LOOP_ONLY
+#define TRACE(pc, rs1_val, rs2_val, result, address) ((void)0)
+#define TIMING(d, pc) ((void)0)
+#define PROFILE(d, pc) ((void)0)
+#include "exec_core.inc"
+#undef PROFILE
+#undef TIMING
+#undef TRACE
+#undef CORE_LOOP_ONLY
+#undef CORE_HANDLER
+#undef CORE_FN
+
+
+// decodes one instruction word into its compact form, this is the only
+// place that looks at the opcode/funct fields
+void decode_instruction(uint32_t instruction, decoded_instr *d) {
+    // breaking down the instruction word into fields
+    uint32_t opcode = instruction & 0x7F;
+    uint32_t funct3 = (instruction >> 12) & 0x7;
+    uint32_t funct7 = (instruction >> 25) & 0x7F;
+    int op = OP_NOP;
+    int32_t imm = 0;
+
+    switch (opcode) {
+
+            // Load-Type
+        case 0b0000011: {
+            static const uint8_t load_ops[8] = {
+                OP_LB, OP_LH, OP_LW, OP_CLEAR_RD, OP_LBU, OP_LHU, OP_CLEAR_RD, OP_CLEAR_RD
+            };
+            op = load_ops[funct3];
+            imm = sign_extension((instruction >> 20), 12);
+            break;
+        }
+
+            // I-Type (ALU immediate)
+        case 0b0010011: {
+            static const uint8_t itype_ops[8] = {
+                OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_ORI, OP_ANDI
+            };
+            op = itype_ops[funct3];
+            if (funct3 == 0b001 || funct3 == 0b101) {
+                imm = (instruction >> 20) & 0x1F; // shamt
+                if (funct3 == 0b101 && funct7 != 0b0000000) {
+                    op = OP_SRAI;
+                }
+            } else {
+                imm = sign_extension((instruction >> 20), 12);
+            }
+            break;
+        }
+
+            // AUIPC
+        case 0b0010111:
+            op = OP_AUIPC;
+            imm = (int32_t)(instruction & 0xFFFFF000);
+            break;
+
+            // Store-Type
+        case 0b0100011: {
+            static const uint8_t store_ops[8] = {
+                OP_SB, OP_SH, OP_SW, OP_NOP, OP_NOP, OP_NOP, OP_NOP, OP_NOP
+            };
+            op = store_ops[funct3];
+            imm = sign_extension(((instruction >> 25) << 5) | ((instruction >> 7) & 0x1F), 12);
+            break;
+        }
+
+            // R-Type, grouped by funct7 first
+        case 0b0110011: {
+            static const uint8_t base_ops[8] = {
+                OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND
+            };
+            static const uint8_t alt_ops[8] = {
+                OP_SUB, OP_CLEAR_RD, OP_CLEAR_RD, OP_CLEAR_RD, OP_CLEAR_RD, OP_SRA, OP_CLEAR_RD, OP_CLEAR_RD
+            };
+            // M-Extension
+            static const uint8_t mext_ops[8] = {
+                OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU
+            };
+            if (funct7 == 0b0000000) {
+                op = base_ops[funct3];
+            } else if (funct7 == 0b0100000) {
+                op = alt_ops[funct3];
+            } else if (funct7 == 0b0000001) {
+                op = mext_ops[funct3];
+            } else {
+                op = OP_CLEAR_RD;
+            }
+            break;
+        }
+
+        case 0b0110111: // LUI
+            op = OP_LUI;
+            imm = (int32_t)(instruction & 0xFFFFF000);
+            break;
+
+            // B-Type
+        case 0b1100011: {
+            static const uint8_t branch_ops[8] = {
+                OP_BEQ, OP_BNE, OP_NOP, OP_NOP, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU
+            };
+            op = branch_ops[funct3];
+            // B-type immediate is weird, need to shuffle bits
+            imm = sign_extension((((instruction >> 31) & 0x1) << 12) | (((instruction >> 7) & 0x1) << 11) | (((instruction >> 25) & 0x3F) << 5) | (((instruction >> 8) & 0xF) << 1), 13);
+            break;
+        }
+
+        case 0b1100111: // JALR
+            op = OP_JALR;
+            imm = sign_extension((instruction >> 20), 12);
+            break;
+
+        case 0b1101111: // JAL
+            op = OP_JAL;
+            // J-type immediate is also weird, more bit shuffling
+            imm = sign_extension((((instruction >> 31) & 0x1) << 20) | (((instruction >> 12) & 0xFF) << 12) | (((instruction >> 20) & 0x1) << 11) | (((instruction >> 21) & 0x3FF) << 1), 21);
+            break;
+
+        case 0b1110011: // ebreak
+            if (funct3 == 0b000 && instruction == 0x00100073) {
+                op = OP_EBREAK;
+            }
+            break;
+
+        case 0b0001111: // fence.i, a plain fence stays a nop
+            if (funct3 == 0b001) {
+                op = OP_FENCE_I;
+            }
+            break;
+
+            // A-Extension, picked by funct5 (unknown ones are nops), aq/rl
+            // don't change anything
+        case 0b0101111: {
+            static const uint8_t amo_ops[32] = {
+                [0b00000] = OP_AMOADD_W, [0b00001] = OP_AMOSWAP_W, [0b00010] = OP_LR_W, [0b00011] = OP_SC_W,
+                [0b00100] = OP_AMOXOR_W, [0b01000] = OP_AMOOR_W, [0b01100] = OP_AMOAND_W,
+                [0b10000] = OP_AMOMIN_W, [0b10100] = OP_AMOMAX_W, [0b11000] = OP_AMOMINU_W, [0b11100] = OP_AMOMAXU_W,
+            };
+            if (funct3 == 0b010) {
+                op = amo_ops[instruction >> 27];
+            }
+            break;
+        }
+    }
+
+    d->raw = instruction;
+    d->op = (uint8_t)op;
+    d->rd = (instruction >> 7) & 0x1F;
+    d->rs1 = (instruction >> 15) & 0x1F;
+    d->rs2 = (instruction >> 20) & 0x1F;
+    d->imm = imm;
+    d->fused = FUSE_NONE;
+    d->handler = op_handlers_fast[op];
+    d->traced = op_handlers_traced[op];
+}
+
+// --- Macro-op fusion ---
+// compilers emit some instructions in pairs, the untraced interpreter runs
+// those as one operation to save a dispatch. The pair lives in the cache
+// entry of its first word and reads the second from the entry after it,
+// which stays a normal entry: a branch to the second word just runs it
+// alone. A store to the second word drops the pair (see
+// invalidate_decoded), and the traced and observed cores never use it, so
+// every instruction still shows up in the trace and the models.
+
+static const char *const fusion_names[FUSE_COUNT] = {
+    [FUSE_LUI_ADDI] = "lui+addi", [FUSE_AUIPC_JALR] = "auipc+jalr", [FUSE_AUIPC_LW] = "auipc+lw",
+    [FUSE_SLLI_SRLI] = "slli+srli", [FUSE_MULH_MUL] = "mulh+mul", [FUSE_DIV_REM] = "div+rem",
+};
+
+// the handlers run both instructions, the loop counts the first as its
+// step and they count the second. The first always writes a register
+// other than x0.
+static int exec_fused_lui_addi(const decoded_instr *d, exec_context *ctx) {
+    ctx->registers[d->rd] = (uint32_t)d->imm + (uint32_t)d[1].imm;
+    ctx->fused[FUSE_LUI_ADDI]++;
+    ctx->pc += 8;
+    ctx->instret++;
+    return 1;
+}
+
+static int exec_fused_auipc_jalr(const decoded_instr *d, exec_context *ctx) {
+    uint32_t current_pc = ctx->pc;
+    uint32_t base = current_pc + d->imm;
+    ctx->registers[d->rd] = base;
+    if (d[1].rd != 0) {
+        ctx->registers[d[1].rd] = current_pc + 8;
+    }
+    ctx->pc = (base + d[1].imm) & 0xFFFFFFFE;
+    ctx->fused[FUSE_AUIPC_JALR]++;
+    ctx->instret++;
+    return 1;
+}
+
+static int exec_fused_auipc_lw(const decoded_instr *d, exec_context *ctx) {
+    uint32_t base = ctx->pc + d->imm;
+    uint32_t address = base + d[1].imm;
+    ctx->registers[d->rd] = base;
+    ctx->pc += 4;
+    // devices and faults are left to the lw, run on its own next
+    if (!page_allows(ctx->page_flags, address, 4, PAGE_R)) {
+        return 1;
+    }
+    ctx->registers[d[1].rd] = read_word_from_mem(ctx->memory, address);
+    ctx->fused[FUSE_AUIPC_LW]++;
+    ctx->pc += 4;
+    ctx->instret++;
+    return 1;
+}
+
+static int exec_fused_slli_srli(const decoded_instr *d, exec_context *ctx) {
+    ctx->registers[d->rd] = (ctx->registers[d->rs1] << d->imm) >> d[1].imm;
+    ctx->fused[FUSE_SLLI_SRLI]++;
+    ctx->pc += 8;
+    ctx->instret++;
+    return 1;
+}
+
+// one multiply gives both halves
+static int exec_fused_mulh_mul(const decoded_instr *d, exec_context *ctx) {
+    uint32_t a = ctx->registers[d->rs1];
+    uint32_t b = ctx->registers[d->rs2];
+    uint64_t product = (d->op == OP_MULH) ? (uint64_t)((int64_t)(int32_t)a * (int64_t)(int32_t)b) : (uint64_t)a * b;
+    ctx->registers[d->rd] = (uint32_t)(product >> 32);
+    ctx->registers[d[1].rd] = (uint32_t)product;
+    ctx->fused[FUSE_MULH_MUL]++;
+    ctx->pc += 8;
+    ctx->instret++;
+    return 1;
+}
+
+// the remainder comes from the quotient, a - q * b also gives the right
+// result for a zero divisor and for INT32_MIN / -1
+static int exec_fused_div_rem(const decoded_instr *d, exec_context *ctx) {
+    uint32_t a = ctx->registers[d->rs1];
+    uint32_t b = ctx->registers[d->rs2];
+    uint32_t q = (d->op == OP_DIV) ? rv_div(a, b) : rv_divu(a, b);
+    ctx->registers[d->rd] = q;
+    if (d[1].rd != 0) {
+        ctx->registers[d[1].rd] = a - q * b;
+    }
+    ctx->fused[FUSE_DIV_REM]++;
+    ctx->pc += 8;
+    ctx->instret++;
+    return 1;
+}
+
+static const instr_handler fused_handlers[FUSE_COUNT] = {
+    [FUSE_LUI_ADDI] = exec_fused_lui_addi, [FUSE_AUIPC_JALR] = exec_fused_auipc_jalr,
+    [FUSE_AUIPC_LW] = exec_fused_auipc_lw, [FUSE_SLLI_SRLI] = exec_fused_slli_srli,
+    [FUSE_MULH_MUL] = exec_fused_mulh_mul, [FUSE_DIV_REM] = exec_fused_div_rem,
+};
+
+// mulh/mul and div/rem pairs read the same operands, which the first
+// result must not overwrite
+static int same_operands(const decoded_instr *a, const decoded_instr *b) {
+    return a->rs1 == b->rs1 && a->rs2 == b->rs2 && a->rd != a->rs1 && a->rd != a->rs2;
+}
+
+// FUSE_* kind of the pair a, b or FUSE_NONE
+static int fusion_kind(const decoded_instr *a, const decoded_instr *b) {
+    if (a->rd == 0) {
+        return FUSE_NONE;
+    }
+    switch (a->op) {
+        case OP_LUI:
+            if (b->op == OP_ADDI && b->rd == a->rd && b->rs1 == a->rd) {
+                return FUSE_LUI_ADDI;
+            }
+            break;
+        case OP_AUIPC:
+            if (b->op == OP_JALR && b->rs1 == a->rd) {
+                return FUSE_AUIPC_JALR;
+            }
+            if (b->op == OP_LW && b->rs1 == a->rd && b->rd != 0) {
+                return FUSE_AUIPC_LW;
+            }
+            break;
+        case OP_SLLI:
+            if (b->op == OP_SRLI && b->rd == a->rd && b->rs1 == a->rd) {
+                return FUSE_SLLI_SRLI;
+            }
+            break;
+        case OP_MULH:
+        case OP_MULHU:
+            if (b->op == OP_MUL && b->rd != 0 && same_operands(a, b)) {
+                return FUSE_MULH_MUL;
+            }
+            break;
+        case OP_DIV:
+        case OP_DIVU:
+            if (b->op == (a->op == OP_DIV ? OP_REM : OP_REMU) && same_operands(a, b)) {
+                return FUSE_DIV_REM;
+            }
+            break;
+    }
+    return FUSE_NONE;
+}
+
+// called on a word the untraced interpreter just cached at pc, fuses it
+// with the next word when the two make a pair. The next word has to pass
+// the fetch check like any other, and only gets cached when it is part of
+// a pair: caching it otherwise would keep it from starting a pair itself.
+// A branch that closes a loop idiom gets its handler here instead.
+static void fuse_decoded(exec_context *ctx, decoded_instr *d, uint32_t pc) {
+    uint32_t next = pc + 4;
+    if (loop_idiom_decoded(ctx, d, pc)) {
+        return;
+    }
+    if (next - ctx->mem_offset >= ctx->mem_size || !page_allows(ctx->page_flags, next, 4, PAGE_X)) {
+        return;
+    }
+    decoded_instr second = d[1];
+    if (second.handler == NULL) {
+        decode_instruction(read_word_from_mem(ctx->memory, next), &second);
+    }
+    int kind = fusion_kind(d, &second);
+    if (kind != FUSE_NONE) {
+        if (d[1].handler == NULL) {
+            d[1] = second;
+        }
+        d->fused = (uint8_t)kind;
+        d->handler = fused_handlers[kind];
+    }
+}
+
+// how many pairs ran fused, nothing when there were none
+void print_fusion_stats(const exec_context *ctx, FILE *out) {
+    uint64_t total = 0;
+    for (int kind = FUSE_NONE + 1; kind < FUSE_COUNT; kind++) {
+        total += ctx->fused[kind];
+    }
+    if (total == 0) {
+        return;
+    }
+    fprintf(out, "fused pairs:          %llu (%.1f%% of instructions)\n", (unsigned long long)total,
+            ctx->instret ? 200.0 * (double)total / (double)ctx->instret : 0.0);
+    for (int kind = FUSE_NONE + 1; kind < FUSE_COUNT; kind++) {
+        if (ctx->fused[kind] != 0) {
+            fprintf(out, "  %-12s %llu\n", fusion_names[kind], (unsigned long long)ctx->fused[kind]);
+        }
+    }
+}
+
+// --- Loop idioms ---
+// copy, fill and strlen loops compile to a handful of instructions that
+// the interpreter would run once per byte or word. When the backward
+// branch that closes one of them gets cached, it gets a handler that runs
+// all the iterations left at once on host memory and leaves the registers
+// and pc exactly where the loop would have. The loop has to be nothing but
+// its load and/or store plus addi steps of registers, and the branch a bne
+// against a register the loop doesn't change (or the loaded byte against
+// zero, for strlen). Like fused pairs, only the untraced interpreter
+// uses them, and the block engine for a block that is the whole loop.
+
+#define LOOP_MAX_BODY 6 // instructions before the branch
+
+static const char *const idiom_names[IDIOM_COUNT] = {
+    [IDIOM_COPY] = "copy", [IDIOM_FILL] = "fill", [IDIOM_SCAN] = "strlen",
+};
+
+// what a loop does, worked out from its decoded instructions
+typedef struct {
+    int kind;                    // IDIOM_*
+    uint32_t length;             // instructions per iteration, the branch included
+    const decoded_instr *load;   // NULL for a fill
+    const decoded_instr *store;  // NULL for strlen
+    int load_pre, store_pre;     // their base register already stepped in the iteration
+    uint32_t stepped;            // bit for every register an addi steps
+    int32_t step[32];            // by how much, only for those registers
+    int count_reg, bound_reg;    // the branch compares these, count_reg is stepped
+} loop_shape;
+
+static uint32_t access_size(int op) {
+    switch (op) {
+        case OP_LB: case OP_LBU: case OP_SB: return 1;
+        case OP_LH: case OP_LHU: case OP_SH: return 2;
+        default: return 4;
+    }
+}
+
+// IDIOM_* kind of the loop closed by branch, which has to be a cached
+// word with the body cached in the words before it
+static int match_loop(const decoded_instr *branch, loop_shape *s) {
+    int body = -branch->imm / 4;
+    if (branch->op != OP_BNE || branch->imm >= 0 || (branch->imm & 3) != 0 || body > LOOP_MAX_BODY) {
+        return IDIOM_NONE;
+    }
+    const decoded_instr *first = branch - body;
+    int load_at = -1;
+    int store_at = -1;
+    s->load = NULL;
+    s->store = NULL;
+    s->stepped = 0;
+    for (int i = 0; i < body; i++) {
+        const decoded_instr *in = &first[i];
+        if (in->handler == NULL) {
+            return IDIOM_NONE;
+        }
+        if (in->op == OP_ADDI && in->rd == in->rs1 && in->rd != 0 && in->imm != 0 && !((s->stepped >> in->rd) & 1)) {
+            s->stepped |= 1u << in->rd;
+            s->step[in->rd] = in->imm;
+        } else if (in->op >= OP_LB && in->op <= OP_LHU && in->rd != 0 && load_at < 0) {
+            s->load = in;
+            s->load_pre = (s->stepped >> in->rs1) & 1;
+            load_at = i;
+        } else if (in->op >= OP_SB && in->op <= OP_SW && store_at < 0) {
+            s->store = in;
+            s->store_pre = (s->stepped >> in->rs1) & 1;
+            store_at = i;
+        } else {
+            return IDIOM_NONE;
+        }
+    }
+    s->length = (uint32_t)body + 1;
+
+    // the loaded register holds data, memory is walked forwards one
+    // element per iteration
+    int loaded = (s->load != NULL) ? s->load->rd : 0;
+    if (loaded != 0 && ((s->stepped >> loaded) & 1)) {
+        return IDIOM_NONE;
+    }
+    if (s->load != NULL && !(((s->stepped >> s->load->rs1) & 1) && (uint32_t)s->step[s->load->rs1] == access_size(s->load->op))) {
+        return IDIOM_NONE;
+    }
+    if (s->store != NULL && !(((s->stepped >> s->store->rs1) & 1) && (uint32_t)s->step[s->store->rs1] == access_size(s->store->op))) {
+        return IDIOM_NONE;
+    }
+
+    if (s->store == NULL) {
+        // strlen: the loop ends on the byte it loaded being zero
+        int on_byte = (branch->rs1 == loaded && branch->rs2 == 0) || (branch->rs2 == loaded && branch->rs1 == 0);
+        if ((s->load->op != OP_LB && s->load->op != OP_LBU) || !on_byte) {
+            return IDIOM_NONE;
+        }
+        s->kind = IDIOM_SCAN;
+        return s->kind;
+    }
+    if (s->load != NULL) {
+        // the store writes what the same iteration loaded
+        if (s->store->rs2 != loaded || load_at > store_at || access_size(s->load->op) != access_size(s->store->op) ||
+            s->load->rs1 == s->store->rs1) {
+            return IDIOM_NONE;
+        }
+        s->kind = IDIOM_COPY;
+    } else {
+        if ((s->stepped >> s->store->rs2) & 1) {
+            return IDIOM_NONE;
+        }
+        s->kind = IDIOM_FILL;
+    }
+
+    // counted: a stepped register against one that stays put, with a
+    // power of two step so the trip count is a plain division
+    if (((s->stepped >> branch->rs1) & 1) && !((s->stepped >> branch->rs2) & 1) && (loaded == 0 || branch->rs2 != loaded)) {
+        s->count_reg = branch->rs1;
+        s->bound_reg = branch->rs2;
+    } else if (((s->stepped >> branch->rs2) & 1) && !((s->stepped >> branch->rs1) & 1) && (loaded == 0 || branch->rs1 != loaded)) {
+        s->count_reg = branch->rs2;
+        s->bound_reg = branch->rs1;
+    } else {
+        return IDIOM_NONE;
+    }
+    uint32_t magnitude = (s->step[s->count_reg] < 0) ? -(uint32_t)s->step[s->count_reg] : (uint32_t)s->step[s->count_reg];
+    if ((magnitude & (magnitude - 1)) != 0) {
+        return IDIOM_NONE;
+    }
+    return s->kind;
+}
+
+// every page of [address, address + size) allows perm, and the range
+// doesn't wrap around
+static int range_allows(const uint8_t *page_flags, uint32_t address, uint64_t size, uint8_t perm) {
+    if (size == 0 || (uint64_t)address + size > (1ull << 32)) {
+        return size == 0;
+    }
+    uint32_t last = (uint32_t)(address + size - 1);
+    for (uint32_t page = address >> PAGE_SHIFT; page <= last >> PAGE_SHIFT; page++) {
+        if (!(page_flags[page] & perm)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// what a load of op read at address, sign extended like the load does it
+static uint32_t loaded_value(const exec_context *ctx, int op, uint32_t address) {
+    uint32_t size = access_size(op);
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        value |= (uint32_t)ctx->memory[(uint32_t)(address + i)] << (8 * i);
+    }
+    if (op == OP_LB || op == OP_LH) {
+        value = (uint32_t)sign_extension(value, (int)size * 8);
+    }
+    return value;
+}
+
+// runs iterations of the loop closed by the branch at pc, which is taken,
+// at most as many as the budget allows. Returns how many ran, 0 when the
+// interpreter has to run the next one itself (a fault, a device, an
+// overlap that isn't a memmove, or a store into the loop). *finished
+// tells whether the last one fell through the branch.
+static uint64_t run_loop_idiom(exec_context *ctx, const loop_shape *s, int *finished) {
+    uint32_t *regs = ctx->registers;
+    uint64_t limit = ctx->idiom_budget / s->length;
+    uint64_t n;
+    uint32_t loaded = 0;
+
+    if (s->kind == IDIOM_SCAN) {
+        uint32_t start = regs[s->load->rs1] + (uint32_t)s->load_pre + (uint32_t)s->load->imm;
+        uint32_t address = start;
+        n = 0;
+        *finished = 0;
+        while (n < limit && (ctx->page_flags[address >> PAGE_SHIFT] & PAGE_R)) {
+            uint64_t chunk = PAGE_SIZE - (address & (PAGE_SIZE - 1));
+            if (chunk > limit - n) {
+                chunk = limit - n;
+            }
+            const uint8_t *zero = memchr(ctx->memory + address, 0, (size_t)chunk);
+            if (zero != NULL) {
+                n += (uint64_t)(zero - (ctx->memory + address)) + 1;
+                *finished = 1;
+                break;
+            }
+            n += chunk;
+            address += (uint32_t)chunk;
+            if (address == 0) {
+                break;
+            }
+        }
+        if (n == 0) {
+            return 0;
+        }
+        loaded = loaded_value(ctx, s->load->op, start + (uint32_t)(n - 1));
+    } else {
+        int32_t step = s->step[s->count_reg];
+        uint32_t distance = (step < 0) ? regs[s->count_reg] - regs[s->bound_reg] : regs[s->bound_reg] - regs[s->count_reg];
+        uint32_t magnitude = (step < 0) ? -(uint32_t)step : (uint32_t)step;
+        if (distance % magnitude != 0) {
+            return 0;
+        }
+        n = distance / magnitude;
+        *finished = (n <= limit);
+        if (!*finished) {
+            n = limit;
+        }
+        if (n == 0) {
+            return 0;
+        }
+
+        uint32_t size = access_size(s->store->op);
+        uint64_t bytes = n * size;
+        uint32_t to = regs[s->store->rs1] + (uint32_t)s->store_pre * size + (uint32_t)s->store->imm;
+        uint32_t loop_start = ctx->pc - 4 * (s->length - 1);
+        if (!range_allows(ctx->page_flags, to, bytes, PAGE_W) || (to < ctx->pc + 4 && (uint64_t)to + bytes > loop_start)) {
+            return 0;
+        }
+        if (s->kind == IDIOM_COPY) {
+            uint32_t from = regs[s->load->rs1] + (uint32_t)s->load_pre * size + (uint32_t)s->load->imm;
+            // copying forwards one element at a time only matches memmove
+            // when the destination doesn't start inside the source
+            if (!range_allows(ctx->page_flags, from, bytes, PAGE_R) || (to > from && to < (uint64_t)from + bytes)) {
+                return 0;
+            }
+            // before the copy, the last element may overlap the one stored
+            loaded = loaded_value(ctx, s->load->op, from + (uint32_t)(bytes - size));
+            memmove(ctx->memory + to, ctx->memory + from, (size_t)bytes);
+        } else {
+            uint32_t value = regs[s->store->rs2];
+            uint8_t *p = ctx->memory + to;
+            if (size == 1) {
+                memset(p, (int)(value & 0xFF), (size_t)bytes);
+            } else {
+                // the first element, then what is there doubled until full
+                for (uint32_t i = 0; i < size; i++) {
+                    p[i] = (uint8_t)(value >> (8 * i));
+                }
+                for (uint64_t done = size; done < bytes;) {
+                    uint64_t chunk = (done < bytes - done) ? done : bytes - done;
+                    memcpy(p + done, p, (size_t)chunk);
+                    done += chunk;
+                }
+            }
+        }
+        invalidate_decoded_range(ctx, to, (uint32_t)bytes);
+    }
+
+    for (int r = 1; r < 32; r++) {
+        if ((s->stepped >> r) & 1) {
+            regs[r] += (uint32_t)n * (uint32_t)s->step[r];
+        }
+    }
+    if (s->load != NULL) {
+        regs[s->load->rd] = loaded;
+    }
+    return n;
+}
+
+// the bne that closes a loop idiom. The loop is matched again every time,
+// a store into it leaves a word empty or different.
+static int exec_loop_idiom(const decoded_instr *d, exec_context *ctx) {
+    if (ctx->registers[d->rs1] == ctx->registers[d->rs2]) {
+        ctx->pc += 4;
+        return 1;
+    }
+    loop_shape s;
+    int finished = 0;
+    uint64_t n = 0;
+    if (match_loop(d, &s) != IDIOM_NONE) {
+        n = run_loop_idiom(ctx, &s, &finished);
+    }
+    if (n == 0) {
+        ctx->pc += d->imm;
+        return 1;
+    }
+    ctx->instret += n * s.length;
+    ctx->idiom_budget -= n * s.length;
+    ctx->idioms[s.kind]++;
+    ctx->idiom_insns += n * s.length;
+    ctx->pc = finished ? ctx->pc + 4 : ctx->pc + d->imm;
+    return 1;
+}
+
+// called on a word the untraced interpreter just cached at pc, gives a
+// branch that closes a loop idiom its handler. Returns 1 when it did.
+static int loop_idiom_decoded(exec_context *ctx, decoded_instr *d, uint32_t pc) {
+    loop_shape s;
+    if (d->op != OP_BNE || d->imm >= 0 || (uint32_t)-d->imm > pc - ctx->mem_offset || match_loop(d, &s) == IDIOM_NONE) {
+        return 0;
+    }
+    d->handler = exec_loop_idiom;
+    return 1;
+}
+
+// how many loops ran all at once, nothing when there were none
+void print_idiom_stats(const exec_context *ctx, FILE *out) {
+    uint64_t total = 0;
+    for (int kind = IDIOM_NONE + 1; kind < IDIOM_COUNT; kind++) {
+        total += ctx->idioms[kind];
+    }
+    if (total == 0) {
+        return;
+    }
+    fprintf(out, "loop idioms:          %llu (%llu instructions, %.1f%%)\n", (unsigned long long)total,
+            (unsigned long long)ctx->idiom_insns, ctx->instret ? 100.0 * (double)ctx->idiom_insns / (double)ctx->instret : 0.0);
+    for (int kind = IDIOM_NONE + 1; kind < IDIOM_COUNT; kind++) {
+        if (ctx->idioms[kind] != 0) {
+            fprintf(out, "  %-12s %llu\n", idiom_names[kind], (unsigned long long)ctx->idioms[kind]);
+        }
+    }
+}
+
+// --- Trace formatting ---
+// a small hand written formatter, it produces exactly what the printf
+// format strings used to, without going through printf
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static char *put_str(char *p, const char *s) {
+    while (*s) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+// same as "%08x"
+static char *put_hex8(char *p, uint32_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = hex_digits[v & 0xF];
+        v >>= 4;
+    }
+    return p + 8;
+}
+
+// same as "%0<min_digits>x", bigger values still print all their digits
+static char *put_hex(char *p, uint32_t v, int min_digits) {
+    int digits = 1;
+    while (digits < 8 && (v >> (digits * 4)) != 0) {
+        digits++;
+    }
+    if (digits < min_digits) {
+        digits = min_digits;
+    }
+    for (int i = digits - 1; i >= 0; i--) {
+        p[i] = hex_digits[v & 0xF];
+        v >>= 4;
+    }
+    return p + digits;
+}
+
+// same as "%d"
+static char *put_dec(char *p, int32_t v) {
+    char tmp[12];
+    int n = 0;
+    uint32_t u = (uint32_t)v;
+    if (v < 0) {
+        *p++ = '-';
+        u = 0u - u;
+    }
+    do {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+// mnemonics already padded to the width of the trace column
+static const char *const op_mnemonic[OP_COUNT] = {
+    [OP_LB] = "lb     ", [OP_LH] = "lh     ", [OP_LW] = "lw     ", [OP_LBU] = "lbu    ", [OP_LHU] = "lhu    ",
+    [OP_SLLI] = "slli   ", [OP_SRLI] = "srli   ", [OP_SRAI] = "srai   ", [OP_ADDI] = "addi   ",
+    [OP_ANDI] = "andi   ", [OP_SLTI] = "slti   ", [OP_SLTIU] = "sltiu  ", [OP_ORI] = "ori    ",
+    [OP_XORI] = "xori   ",
+    [OP_AUIPC] = "auipc  ",
+    [OP_SB] = "sb     ", [OP_SH] = "sh     ", [OP_SW] = "sw     ",
+    [OP_SLL] = "sll    ", [OP_SRL] = "srl    ", [OP_SLT] = "slt    ", [OP_SLTU] = "sltu   ",
+    [OP_ADD] = "add    ", [OP_AND] = "and    ", [OP_OR] = "or     ", [OP_XOR] = "xor    ",
+    [OP_SRA] = "sra    ", [OP_SUB] = "sub    ",
+    [OP_MUL] = "mul    ", [OP_MULH] = "mulh   ", [OP_MULHSU] = "mulhsu ", [OP_MULHU] = "mulhu  ",
+    [OP_DIV] = "div    ", [OP_DIVU] = "divu   ", [OP_REM] = "rem    ", [OP_REMU] = "remu   ",
+    [OP_LUI] = "lui    ",
+    [OP_BEQ] = "beq    ", [OP_BNE] = "bne    ", [OP_BLT] = "blt    ", [OP_BGE] = "bge    ",
+    [OP_BLTU] = "bltu   ", [OP_BGEU] = "bgeu   ",
+    [OP_JALR] = "jalr   ", [OP_JAL] = "jal    ",
+    [OP_EBREAK] = "ebreak",
+    [OP_LR_W] = "lr.w   ", [OP_SC_W] = "sc.w   ",
+    [OP_AMOSWAP_W] = "amoswap.w ", [OP_AMOADD_W] = "amoadd.w ", [OP_AMOXOR_W] = "amoxor.w ",
+    [OP_AMOAND_W] = "amoand.w ", [OP_AMOOR_W] = "amoor.w ", [OP_AMOMIN_W] = "amomin.w ",
+    [OP_AMOMAX_W] = "amomax.w ", [OP_AMOMINU_W] = "amominu.w ", [OP_AMOMAXU_W] = "amomaxu.w ",
+};
+
+// the operator printed between the two operands of ALU and branch lines
+static const char *const op_symbol[OP_COUNT] = {
+    [OP_SLLI] = "<<", [OP_SRLI] = ">>", [OP_SRAI] = ">>>", [OP_ADDI] = "+", [OP_ANDI] = "&",
+    [OP_SLTI] = "<", [OP_SLTIU] = "<", [OP_ORI] = "|", [OP_XORI] = "^",
+    [OP_SLL] = "<<", [OP_SRL] = ">>", [OP_SRA] = ">>>", [OP_SLT] = "<", [OP_SLTU] = "<",
+    [OP_ADD] = "+", [OP_SUB] = "-", [OP_AND] = "&", [OP_OR] = "|", [OP_XOR] = "^",
+    [OP_MUL] = "*", [OP_MULH] = "*", [OP_MULHSU] = "(s)*", [OP_MULHU] = "*",
+    [OP_DIV] = "/", [OP_DIVU] = "/", [OP_REM] = "%", [OP_REMU] = "%",
+    [OP_BEQ] = "==", [OP_BNE] = "!=", [OP_BLT] = "<", [OP_BGE] = ">=", [OP_BLTU] = "<", [OP_BGEU] = ">=",
+};
+
+// writes the trace line of one record into out, returns its length
+size_t render_trace_record(const trace_record *r, char *out) {
+    decoded_instr d;
+    decode_instruction(r->raw, &d);
+    const char *rd = registers_label[d.rd];
+    const char *rs1 = registers_label[d.rs1];
+    const char *rs2 = registers_label[d.rs2];
+    char *p = out;
+
+    *p++ = '0';
+    *p++ = 'x';
+    p = put_hex8(p, r->pc);
+    *p++ = ':';
+    p = put_str(p, op_mnemonic[d.op]);
+
+    switch (d.op) {
+        case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+            p = put_str(p, rd); p = put_str(p, ",0x"); p = put_hex(p, d.imm & 0xFFF, 3);
+            *p++ = '('; p = put_str(p, rs1); p = put_str(p, ")  ");
+            p = put_str(p, rd); p = put_str(p, "=mem[0x"); p = put_hex8(p, r->address);
+            p = put_str(p, "]=0x"); p = put_hex8(p, r->result);
+            break;
+
+        case OP_SLLI: case OP_SRLI: case OP_SRAI:
+            p = put_str(p, rd); *p++ = ','; p = put_str(p, rs1); *p++ = ','; p = put_dec(p, d.imm);
+            p = put_str(p, "      "); p = put_str(p, rd); p = put_str(p, "=0x"); p = put_hex8(p, r->rs1_val);
+            p = put_str(p, op_symbol[d.op]); p = put_dec(p, d.imm);
+            p = put_str(p, "=0x"); p = put_hex8(p, r->result);
+            break;
+
+        case OP_ADDI: case OP_ANDI: case OP_ORI: case OP_XORI: case OP_SLTI: case OP_SLTIU:
+            p = put_str(p, rd); *p++ = ','; p = put_str(p, rs1); p = put_str(p, ",0x"); p = put_hex(p, d.imm & 0xFFF, 3);
+            p = put_str(p, "   "); p = put_str(p, rd);
+            if (d.op == OP_SLTI || d.op == OP_SLTIU) {
+                p = put_str(p, "=(0x"); p = put_hex8(p, r->rs1_val); p = put_str(p, "<0x");
+                p = put_hex8(p, (uint32_t)d.imm); p = put_str(p, ")="); p = put_dec(p, (int32_t)r->result);
+            } else {
+                p = put_str(p, "=0x"); p = put_hex8(p, r->rs1_val); p = put_str(p, op_symbol[d.op]);
+                p = put_str(p, "0x"); p = put_hex8(p, (uint32_t)d.imm);
+                p = put_str(p, "=0x"); p = put_hex8(p, r->result);
+            }
+            break;
+
+        case OP_AUIPC:
+            p = put_str(p, rd); p = put_str(p, ",0x"); p = put_hex(p, (uint32_t)d.imm >> 12, 5);
+            p = put_str(p, "     "); p = put_str(p, rd); p = put_str(p, "=0x"); p = put_hex8(p, r->pc);
+            p = put_str(p, "+0x"); p = put_hex8(p, (uint32_t)d.imm);
+            p = put_str(p, "=0x"); p = put_hex8(p, r->result);
+            break;
+
+        case OP_SB: case OP_SH: case OP_SW:
+            p = put_str(p, rs2); p = put_str(p, ",0x"); p = put_hex(p, d.imm & 0xFFF, 3);
+            *p++ = '('; p = put_str(p, rs1); p = put_str(p, ") mem[0x"); p = put_hex8(p, r->address);
+            p = put_str(p, "]=0x");
+            if (d.op == OP_SB) {
+                p = put_hex(p, r->rs2_val & 0xFF, 2);
+            } else if (d.op == OP_SH) {
+                p = put_hex(p, r->rs2_val & 0xFFFF, 4);
+            } else {
+                p = put_hex8(p, r->rs2_val);
+            }
+            break;
+
+        case OP_SLL: case OP_SRL: case OP_SRA:
+        case OP_SLT: case OP_SLTU:
+        case OP_ADD: case OP_SUB: case OP_AND: case OP_OR: case OP_XOR:
+        case OP_MUL: case OP_MULH: case OP_MULHSU: case OP_MULHU:
+        case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+            p = put_str(p, rd); *p++ = ','; p = put_str(p, rs1); *p++ = ','; p = put_str(p, rs2);
+            p = put_str(p, "     "); p = put_str(p, rd); *p++ = '=';
+            if (d.op == OP_SLL || d.op == OP_SRL || d.op == OP_SRA) {
+                // shifts show the shift amount instead of rs2
+                p = put_str(p, "0x"); p = put_hex8(p, r->rs1_val); p = put_str(p, op_symbol[d.op]);
+                p = put_dec(p, (int32_t)(r->rs2_val & 0x1F)); p = put_str(p, "=0x"); p = put_hex8(p, r->result);
+            } else if (d.op == OP_SLT || d.op == OP_SLTU) {
+                p = put_str(p, "(0x"); p = put_hex8(p, r->rs1_val); p = put_str(p, "<0x"); p = put_hex8(p, r->rs2_val);
+                p = put_str(p, ")="); p = put_dec(p, (int32_t)r->result);
+            } else {
+                int upper = (d.op == OP_MULH || d.op == OP_MULHSU || d.op == OP_MULHU);
+                p = put_str(p, upper ? "upper(0x" : "0x"); p = put_hex8(p, r->rs1_val);
+                p = put_str(p, op_symbol[d.op]); p = put_str(p, "0x"); p = put_hex8(p, r->rs2_val);
+                if (d.op == OP_MULHSU) {
+                    p = put_str(p, "(u)");
+                }
+                p = put_str(p, upper ? ")=0x" : "=0x"); p = put_hex8(p, r->result);
+            }
+            break;
+
+        case OP_LUI:
+            p = put_str(p, rd); p = put_str(p, ",0x"); p = put_hex(p, (uint32_t)d.imm >> 12, 5);
+            p = put_str(p, "     "); p = put_str(p, rd); p = put_str(p, "=0x"); p = put_hex8(p, r->result);
+            break;
+
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+            p = put_str(p, rs1); *p++ = ','; p = put_str(p, rs2); p = put_str(p, ",0x"); p = put_hex(p, (uint32_t)d.imm, 3);
+            p = put_str(p, "  (0x"); p = put_hex8(p, r->rs1_val); p = put_str(p, op_symbol[d.op]);
+            p = put_str(p, "0x"); p = put_hex8(p, r->rs2_val); p = put_str(p, ")=");
+            p = put_dec(p, (int32_t)r->result); p = put_str(p, "->pc=0x"); p = put_hex8(p, r->address);
+            break;
+
+        case OP_JALR:
+            p = put_str(p, rd); *p++ = ','; p = put_str(p, rs1); p = put_str(p, ",0x"); p = put_hex(p, d.imm & 0xFFF, 3);
+            p = put_str(p, "   pc=0x"); p = put_hex8(p, r->rs1_val); p = put_str(p, "+0x"); p = put_hex8(p, (uint32_t)d.imm);
+            p = put_str(p, ",rd=0x"); p = put_hex8(p, r->result);
+            break;
+
+        case OP_JAL:
+            p = put_str(p, rd); p = put_str(p, ",0x"); p = put_hex(p, (uint32_t)d.imm, 5);
+            p = put_str(p, "     pc=0x"); p = put_hex8(p, r->address);
+            p = put_str(p, ",rd=0x"); p = put_hex8(p, r->result);
+            break;
+
+        case OP_LR_W:
+            p = put_str(p, rd); p = put_str(p, ",("); p = put_str(p, rs1); p = put_str(p, ")  ");
+            p = put_str(p, rd); p = put_str(p, "=mem[0x"); p = put_hex8(p, r->address);
+            p = put_str(p, "]=0x"); p = put_hex8(p, r->result);
+            break;
+
+        case OP_SC_W:
+            // a failed sc leaves memory alone, only rd shows up
+            p = put_str(p, rd); *p++ = ','; p = put_str(p, rs2); p = put_str(p, ",("); p = put_str(p, rs1); p = put_str(p, ")  ");
+            if (r->result == 0) {
+                p = put_str(p, "mem[0x"); p = put_hex8(p, r->address); p = put_str(p, "]=0x"); p = put_hex8(p, r->rs2_val);
+                *p++ = ',';
+            }
+            p = put_str(p, rd); *p++ = '='; p = put_dec(p, (int32_t)r->result);
+            break;
+
+        case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W: case OP_AMOOR_W:
+        case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W:
+            p = put_str(p, rd); *p++ = ','; p = put_str(p, rs2); p = put_str(p, ",("); p = put_str(p, rs1); p = put_str(p, ")  ");
+            p = put_str(p, rd); p = put_str(p, "=mem[0x"); p = put_hex8(p, r->address); p = put_str(p, "]=0x"); p = put_hex8(p, r->result);
+            p = put_str(p, ",mem[0x"); p = put_hex8(p, r->address); p = put_str(p, "]=0x");
+            p = put_hex8(p, amo_result(d.op, r->result, r->rs2_val));
+            break;
+    }
+
+    *p++ = '\n';
+    return (size_t)(p - out);
+}
+
+// --- Binary traces ---
+// --trace-format=binary stores a record in a few bytes instead of a line:
+// the pc as a distance from the one that follows the record before, the
+// instruction word only when it isn't the one last seen at that pc, and
+// of the values the text line shows only those a copy of the registers
+// kept by the writer and the reader doesn't already hold. Values the
+// instruction itself decides (the link of a jal, the result of a lui, the
+// target of a taken branch) aren't stored at all.
+//
+// The records come in segments of TRACE_SEGMENT_RECORDS that each start
+// from an empty register copy, and the end of the file lists where every
+// segment starts and the pcs it touches, so --render= can go straight to
+// instruction N or skip the segments that never run a pc range. A file
+// whose writer didn't finish has no index and is read from the start.
+#define TRACE_FILE_MAGIC "RVTRACE1"
+#define TRACE_INDEX_MAGIC "RVTRIDX1"
+#define TRACE_SEGMENT_RECORDS 65536
+#define TRACE_RAW_CACHE 1024 // instruction words remembered, power of two
+
+typedef struct {
+    char magic[8];
+    uint32_t segment_records;
+    uint32_t reserved;
+} trace_file_header;
+
+// one per segment, in order, right before the trailer
+typedef struct {
+    uint64_t offset; // of its first record, from the start of the file
+    uint32_t min_pc;
+    uint32_t max_pc;
+} trace_segment;
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t segments;
+    uint64_t records;
+    char magic[8];
+} trace_file_trailer;
+
+// what both the writer and the reader know at every point of a segment
+typedef struct {
+    uint32_t pc; // of the record before
+    uint32_t registers[32];
+    uint32_t raw_pc[TRACE_RAW_CACHE];
+    uint32_t raw[TRACE_RAW_CACHE];
+} trace_model;
+
+// the first byte of every record
+enum {
+    RECORD_NEXT_PC = 0x01,  // pc is the one after the record before
+    RECORD_SAME_RAW = 0x02, // the instruction word last seen at this pc
+    RECORD_RS1 = 0x04,      // rs1 value differs from the register copy, follows
+    RECORD_RS2 = 0x08,      // same for rs2
+    RECORD_ADDRESS = 0x10,  // address isn't rs1 + imm, follows
+    RECORD_TAKEN = 0x20     // a branch that was taken
+};
+
+// the values of a record its text line shows and the trace has to keep
+enum { SHOWS_RS1 = 1, SHOWS_RS2 = 2, SHOWS_RESULT = 4, SHOWS_ADDRESS = 8 };
+
+static int record_shows(int op) {
+    if ((op >= OP_LB && op <= OP_LHU) || op == OP_LR_W) {
+        return SHOWS_ADDRESS | SHOWS_RESULT;
+    }
+    if (op >= OP_SLLI && op <= OP_XORI) {
+        return SHOWS_RS1 | SHOWS_RESULT;
+    }
+    if (op >= OP_SB && op <= OP_SW) {
+        return SHOWS_RS2 | SHOWS_ADDRESS;
+    }
+    if (op >= OP_SLL && op <= OP_REMU) {
+        return SHOWS_RS1 | SHOWS_RS2 | SHOWS_RESULT;
+    }
+    if (op >= OP_BEQ && op <= OP_BGEU) {
+        return SHOWS_RS1 | SHOWS_RS2;
+    }
+    if (op == OP_JALR) {
+        return SHOWS_RS1;
+    }
+    if (op >= OP_SC_W && op <= OP_AMOMAXU_W) {
+        return SHOWS_RS2 | SHOWS_ADDRESS | SHOWS_RESULT;
+    }
+    return 0; // auipc, lui, jal and ebreak
+}
+
+static void trace_model_reset(trace_model *m) {
+    m->pc = 0;
+    memset(m->registers, 0, sizeof(m->registers));
+    memset(m->raw_pc, 0xFF, sizeof(m->raw_pc)); // odd, never a pc
+}
+
+// brings the register copy up to date with a record, writer and reader
+// call it with the same record so their copies never drift apart
+static void trace_model_learn(trace_model *m, const decoded_instr *d, const trace_record *r) {
+    int shows = record_shows(d->op);
+
+    if (shows & SHOWS_RS1) {
+        m->registers[d->rs1] = r->rs1_val;
+    }
+    if (shows & SHOWS_RS2) {
+        m->registers[d->rs2] = r->rs2_val;
+    }
+    if (shows & SHOWS_ADDRESS) {
+        m->registers[d->rs1] = r->address - (uint32_t)d->imm;
+    }
+    if ((shows & SHOWS_RESULT) || d->op == OP_AUIPC || d->op == OP_LUI || d->op == OP_JAL || d->op == OP_JALR) {
+        m->registers[d->rd] = r->result;
+    }
+    m->registers[0] = 0;
+
+    m->pc = r->pc;
+    uint32_t slot = (r->pc >> 2) & (TRACE_RAW_CACHE - 1);
+    m->raw_pc[slot] = r->pc;
+    m->raw[slot] = r->raw;
+}
+
+// small values in few bytes: zigzag for the sign, then 7 bits per byte
+static uint8_t *put_varint(uint8_t *p, uint32_t delta) {
+    uint32_t v = (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// reads what put_varint wrote, NULL when the record runs past end
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *delta) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p == end) {
+            return NULL;
+        }
+        uint8_t byte = *p++;
+        v |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *delta = (v >> 1) ^ (0u - (v & 1));
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// writes one record into out (at most TRACE_MAX_LINE bytes), returns its length
+static size_t encode_trace_record(trace_model *m, const trace_record *r, uint8_t *out) {
+    decoded_instr d;
+    decode_instruction(r->raw, &d);
+    int shows = record_shows(d.op);
+    uint8_t flags = 0;
+    uint8_t *p = out + 1;
+
+    if (r->pc == m->pc + 4) {
+        flags |= RECORD_NEXT_PC;
+    } else {
+        p = put_varint(p, r->pc - (m->pc + 4));
+    }
+    uint32_t slot = (r->pc >> 2) & (TRACE_RAW_CACHE - 1);
+    if (m->raw_pc[slot] == r->pc && m->raw[slot] == r->raw) {
+        flags |= RECORD_SAME_RAW;
+    } else {
+        memcpy(p, &r->raw, 4);
+        p += 4;
+    }
+    if ((shows & SHOWS_RS1) && r->rs1_val != m->registers[d.rs1]) {
+        flags |= RECORD_RS1;
+        p = put_varint(p, r->rs1_val - m->registers[d.rs1]);
+    }
+    if ((shows & SHOWS_RS2) && r->rs2_val != m->registers[d.rs2]) {
+        flags |= RECORD_RS2;
+        p = put_varint(p, r->rs2_val - m->registers[d.rs2]);
+    }
+    if (shows & SHOWS_ADDRESS) {
+        uint32_t expected = m->registers[d.rs1] + (uint32_t)d.imm;
+        if (r->address != expected) {
+            flags |= RECORD_ADDRESS;
+            p = put_varint(p, r->address - expected);
+        }
+    }
+    if (shows & SHOWS_RESULT) {
+        p = put_varint(p, r->result - m->registers[d.rd]);
+    }
+    if (d.op >= OP_BEQ && d.op <= OP_BGEU && r->result) {
+        flags |= RECORD_TAKEN;
+    }
+    out[0] = flags;
+
+    trace_model_learn(m, &d, r);
+    return (size_t)(p - out);
+}
+
+// reads one record back, returns the position after it or NULL when the
+// data is cut short
+static const uint8_t *decode_trace_record(trace_model *m, const uint8_t *p, const uint8_t *end, trace_record *r) {
+    if (p == end) {
+        return NULL;
+    }
+    uint8_t flags = *p++;
+    uint32_t delta;
+
+    r->pc = m->pc + 4;
+    if (!(flags & RECORD_NEXT_PC)) {
+        if ((p = get_varint(p, end, &delta)) == NULL) {
+            return NULL;
+        }
+        r->pc += delta;
+    }
+    uint32_t slot = (r->pc >> 2) & (TRACE_RAW_CACHE - 1);
+    if (flags & RECORD_SAME_RAW) {
+        r->raw = m->raw[slot];
+    } else {
+        if (end - p < 4) {
+            return NULL;
+        }
+        memcpy(&r->raw, p, 4);
+        p += 4;
+    }
+
+    decoded_instr d;
+    decode_instruction(r->raw, &d);
+    if (op_mnemonic[d.op] == NULL) {
+        return NULL; // nothing that leaves a record decodes to this
+    }
+    int shows = record_shows(d.op);
+    r->rs1_val = 0;
+    r->rs2_val = 0;
+    r->result = 0;
+    r->address = 0;
+    if (shows & SHOWS_RS1) {
+        r->rs1_val = m->registers[d.rs1];
+        if (flags & RECORD_RS1) {
+            if ((p = get_varint(p, end, &delta)) == NULL) {
+                return NULL;
+            }
+            r->rs1_val += delta;
+        }
+    }
+    if (shows & SHOWS_RS2) {
+        r->rs2_val = m->registers[d.rs2];
+        if (flags & RECORD_RS2) {
+            if ((p = get_varint(p, end, &delta)) == NULL) {
+                return NULL;
+            }
+            r->rs2_val += delta;
+        }
+    }
+    if (shows & SHOWS_ADDRESS) {
+        r->address = m->registers[d.rs1] + (uint32_t)d.imm;
+        if (flags & RECORD_ADDRESS) {
+            if ((p = get_varint(p, end, &delta)) == NULL) {
+                return NULL;
+            }
+            r->address += delta;
+        }
+    }
+    if (shows & SHOWS_RESULT) {
+        if ((p = get_varint(p, end, &delta)) == NULL) {
+            return NULL;
+        }
+        r->result = m->registers[d.rd] + delta;
+    }
+
+    // what the instruction decides by itself, as its handler traces it
+    uint32_t link = d.rd ? r->pc + 4 : 0;
+    switch (d.op) {
+        case OP_AUIPC: r->result = d.rd ? r->pc + (uint32_t)d.imm : 0; break;
+        case OP_LUI: r->result = d.rd ? (uint32_t)d.imm : 0; break;
+        case OP_JALR: r->result = link; break;
+        case OP_JAL:
+            r->result = link;
+            r->address = r->pc + (uint32_t)d.imm;
+            break;
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+            r->result = (flags & RECORD_TAKEN) != 0;
+            r->address = r->result ? r->pc + (uint32_t)d.imm : r->pc + 4;
+            break;
+        default: break;
+    }
+
+    trace_model_learn(m, &d, r);
+    return p;
+}
+
+// the writer thread's side of a binary trace: the register copy and the
+// index of the segments so far
+struct trace_encoder {
+    trace_model model;
+    trace_segment *segments;
+    uint64_t segment_count;
+    uint64_t capacity;
+    uint64_t records;
+    int index_lost; // out of memory, the file goes without an index
+};
+
+// encodes the record that lands at offset of the file into out
+static size_t trace_encoder_put(trace_encoder *e, const trace_record *r, uint8_t *out, uint64_t offset) {
+    if (e->records % TRACE_SEGMENT_RECORDS == 0) {
+        trace_model_reset(&e->model);
+        if (e->segment_count == e->capacity && !e->index_lost) {
+            uint64_t capacity = e->capacity ? e->capacity * 2 : 256;
+            trace_segment *grown = (trace_segment *)realloc(e->segments, capacity * sizeof(trace_segment));
+            if (grown == NULL) {
+                e->index_lost = 1;
+            } else {
+                e->segments = grown;
+                e->capacity = capacity;
+            }
+        }
+        if (!e->index_lost) {
+            e->segments[e->segment_count] = (trace_segment){offset, r->pc, r->pc};
+        }
+        e->segment_count++;
+    }
+    if (!e->index_lost) {
+        trace_segment *s = &e->segments[e->segment_count - 1];
+        if (r->pc < s->min_pc) {
+            s->min_pc = r->pc;
+        }
+        if (r->pc > s->max_pc) {
+            s->max_pc = r->pc;
+        }
+    }
+    e->records++;
+    return encode_trace_record(&e->model, r, out);
+}
+
+// appends the index and the trailer, offset is where the records end
+static void trace_encoder_finish(trace_encoder *e, FILE *output_file, uint64_t offset) {
+    if (!e->index_lost) {
+        trace_file_trailer trailer = {offset, e->segment_count, e->records, TRACE_INDEX_MAGIC};
+        fwrite(e->segments, sizeof(trace_segment), e->segment_count, output_file);
+        fwrite(&trailer, sizeof(trailer), 1, output_file);
+    }
+    free(e->segments);
+}
+
+// turns the records number start up to, not including, end of a binary
+// trace into the text trace, keeping only pcs in [pc_low, pc_high].
+// Returns 0 on success
+int render_binary_trace(const char *trace_path, const char *output_path, uint64_t start, uint64_t end, uint32_t pc_low, uint32_t pc_high) {
+    int fd = open(trace_path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening the binary trace");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error reading the binary trace");
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t *file = NULL;
+    if (size >= sizeof(trace_file_header)) {
+        void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        file = (mapped == MAP_FAILED) ? NULL : (const uint8_t *)mapped;
+    }
+    close(fd);
+    trace_file_header header;
+    if (file != NULL) {
+        memcpy(&header, file, sizeof(header));
+    }
+    if (file == NULL || memcmp(header.magic, TRACE_FILE_MAGIC, 8) != 0 || header.segment_records == 0) {
+        fprintf(stderr, "%s is not a binary trace\n", trace_path);
+        if (file != NULL) {
+            munmap((void *)file, size);
+        }
+        return -1;
+    }
+
+    // the index, when the writer got to write it
+    const trace_segment *segments = NULL;
+    uint64_t segment_count = 0;
+    uint64_t records_end = size;
+    trace_file_trailer trailer;
+    if (size >= sizeof(header) + sizeof(trailer)) {
+        memcpy(&trailer, file + size - sizeof(trailer), sizeof(trailer));
+        uint64_t index_size = trailer.segments * sizeof(trace_segment);
+        if (memcmp(trailer.magic, TRACE_INDEX_MAGIC, 8) == 0 && trailer.index_offset >= sizeof(header) &&
+            trailer.segments <= size / sizeof(trace_segment) &&
+            trailer.index_offset + index_size == size - sizeof(trailer)) {
+            segments = (const trace_segment *)(file + trailer.index_offset);
+            segment_count = trailer.segments;
+            records_end = trailer.index_offset;
+        }
+    }
+
+    FILE *output_file = fopen(output_path, "w");
+    if (output_file == NULL) {
+        perror("Error opening output file");
+        munmap((void *)file, size);
+        return -1;
+    }
+    char *out = (char *)malloc(TRACE_OUT_BUFFER_SIZE);
+    trace_model *model = (trace_model *)malloc(sizeof(trace_model));
+    if (out == NULL || model == NULL) {
+        fprintf(stderr, "Error allocating the renderer buffers\n");
+        free(out);
+        free(model);
+        fclose(output_file);
+        munmap((void *)file, size);
+        return -1;
+    }
+    size_t used = 0;
+    int status = 0;
+
+    // with an index we start at the segment holding record start, without
+    // one the segments are only found by reading them all
+    uint64_t segment = 0;
+    const uint8_t *p = file + sizeof(header);
+    if (segments != NULL) {
+        segment = start / header.segment_records;
+        if (segment >= segment_count) {
+            p = file + records_end;
+        }
+    }
+    uint64_t number = segment * header.segment_records;
+    while (p < file + records_end && number < end) {
+        const uint8_t *segment_end = file + records_end;
+        if (segments != NULL) {
+            if (segment >= segment_count || segments[segment].offset > records_end) {
+                status = -1;
+                break;
+            }
+            if (segment + 1 < segment_count) {
+                if (segments[segment + 1].offset < segments[segment].offset || segments[segment + 1].offset > records_end) {
+                    status = -1;
+                    break;
+                }
+                segment_end = file + segments[segment + 1].offset;
+            }
+            // a segment that never runs the pcs asked for is skipped whole
+            if (segments[segment].max_pc < pc_low || segments[segment].min_pc > pc_high) {
+                p = segment_end;
+                number += header.segment_records;
+                segment++;
+                continue;
+            }
+            p = file + segments[segment].offset;
+        }
+
+        trace_model_reset(model);
+        for (uint32_t i = 0; i < header.segment_records && p < segment_end && number < end; i++, number++) {
+            trace_record r;
+            p = decode_trace_record(model, p, segment_end, &r);
+            if (p == NULL) {
+                break;
+            }
+            if (number < start || r.pc < pc_low || r.pc > pc_high) {
+                continue;
+            }
+            if (used > TRACE_OUT_BUFFER_SIZE - TRACE_MAX_LINE) {
+                fwrite(out, 1, used, output_file);
+                used = 0;
+            }
+            used += render_trace_record(&r, out + used);
+        }
+        if (p == NULL) {
+            status = -1;
+            break;
+        }
+        if (segments != NULL) {
+            p = segment_end;
+            number = (segment + 1) * header.segment_records;
+        }
+        segment++;
+    }
+    if (status != 0) {
+        fprintf(stderr, "%s is cut short or corrupt after record %llu\n", trace_path, (unsigned long long)number);
+    }
+
+    fwrite(out, 1, used, output_file);
+    if (fclose(output_file) != 0) {
+        perror("Error writing output file");
+        status = -1;
+    }
+    free(out);
+    free(model);
+    munmap((void *)file, size);
+    return status;
+}
+
+// --- Trace writer thread ---
+
+static void *trace_writer_main(void *arg) {
+    trace_writer *tw = (trace_writer *)arg;
+    char *out = tw->out;
+    size_t used = 0;
+    uint64_t written = 0; // bytes already handed to the file
+    trace_encoder *encoder = tw->encoder;
+    if (encoder != NULL) {
+        trace_file_header header = {TRACE_FILE_MAGIC, TRACE_SEGMENT_RECORDS, 0};
+        memcpy(out, &header, sizeof(header));
+        used = sizeof(header);
+    }
+    uint32_t tail = atomic_load_explicit(&tw->tail, memory_order_relaxed);
+
+    for (;;) {
+        uint32_t head = atomic_load_explicit(&tw->head, memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load_explicit(&tw->done, memory_order_acquire)) {
+                // the last records may have landed right before done was set
+                if (atomic_load_explicit(&tw->head, memory_order_acquire) == tail) {
+                    break;
+                }
+                continue;
+            }
+            // nothing to do, hand the core back to the simulator
+            struct timespec nap = {0, 50000};
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        while (tail != head) {
+            if (used > TRACE_OUT_BUFFER_SIZE - TRACE_MAX_LINE) {
+                fwrite(out, 1, used, tw->output_file);
+                written += used;
+                used = 0;
+            }
+            const trace_record *r = &tw->ring[tail & (TRACE_RING_SIZE - 1)];
+            if (encoder != NULL) {
+                used += trace_encoder_put(encoder, r, (uint8_t *)out + used, written + used);
+            } else {
+                used += render_trace_record(r, out + used);
+            }
+            tail++;
+            // give slots back in batches so the simulator rarely waits
+            if ((tail & 1023) == 0) {
+                atomic_store_explicit(&tw->tail, tail, memory_order_release);
+            }
+        }
+        atomic_store_explicit(&tw->tail, tail, memory_order_release);
+    }
+
+    fwrite(out, 1, used, tw->output_file);
+    if (encoder != NULL) {
+        trace_encoder_finish(encoder, tw->output_file, written + used);
+    }
+    return NULL;
+}
+
+// allocates the ring and the output buffer and starts the writer thread,
+// returns 0 on success
+int trace_writer_start(trace_writer *tw, FILE *output_file, int format) {
+    tw->ring = (trace_record *)malloc(TRACE_RING_SIZE * sizeof(trace_record));
+    tw->out = (char *)malloc(TRACE_OUT_BUFFER_SIZE);
+    if (tw->ring == NULL || tw->out == NULL) {
+        free(tw->out);
+        free(tw->ring);
+        return -1;
+    }
+    tw->output_file = output_file;
+    tw->encoder = NULL;
+    if (format == TRACE_BINARY) {
+        tw->encoder = (trace_encoder *)calloc(1, sizeof(trace_encoder));
+        if (tw->encoder == NULL) {
+            free(tw->out);
+            free(tw->ring);
+            return -1;
+        }
+    }
+    atomic_init(&tw->head, 0);
+    atomic_init(&tw->tail, 0);
+    atomic_init(&tw->done, 0);
+    tw->cached_tail = 0;
+    if (pthread_create(&tw->thread, NULL, trace_writer_main, tw) != 0) {
+        free(tw->encoder);
+        free(tw->out);
+        free(tw->ring);
+        return -1;
+    }
+    return 0;
+}
+
+// waits until every queued record is written out
+void trace_writer_finish(trace_writer *tw) {
+    atomic_store_explicit(&tw->done, 1, memory_order_release);
+    pthread_join(tw->thread, NULL);
+    free(tw->encoder);
+    free(tw->out);
+    free(tw->ring);
+}
+
+// --- x86-64 JIT ---
+// hot blocks of the block engine get compiled to native code. The most
+// used guest registers of a block live in host registers while it runs,
+// loads are inline, stores go through jit_store so writes into translated
+// code are still caught. Misaligned accesses and pages without permission
+// leave native code before the access, the interpreter takes those.
+// Anything the JIT doesn't take (blocks ending in ebreak, a full code
+// buffer) simply stays on the threaded path.
+
+#if defined(__x86_64__)
+
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// x86 condition codes
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD };
+
+// fixed host registers: R15 holds the guest register file, R14 the guest
+// memory, these four are handed out to guest registers per block
+static const uint8_t jit_guest_hosts[] = {RBX, RBP, R12, R13};
+#define JIT_MAPPED_REGS (int)(sizeof(jit_guest_hosts) / sizeof(jit_guest_hosts[0]))
+
+enum {
+    JIT_EXIT_TAKEN = 0,        // successor next_pc[0]
+    JIT_EXIT_FALLTHROUGH = 1,  // successor next_pc[1]
+    JIT_EXIT_INDIRECT = 2,     // JALR, frame->next_pc holds the target
+    JIT_EXIT_CODE_WRITTEN = 3, // a store hit translated code
+    JIT_EXIT_SLOW_ACCESS = 4   // a load or store the interpreter has to do
+};
+
+typedef struct {
+    uint8_t *p;
+    uint8_t *end;
+    int overflow;
+    int8_t host_of[32];   // host register of each guest register, -1 if none
+    uint32_t dirty;       // mapped guest registers written by the block
+    uint8_t *exit_jumps[BLOCK_MAX_LENGTH + 2]; // rel32 fields to patch
+    int exit_count;
+} jit_emitter;
+
+static void emit8(jit_emitter *e, uint32_t byte) {
+    if (e->p < e->end) {
+        *e->p++ = (uint8_t)byte;
+    } else {
+        e->overflow = 1;
+    }
+}
+
+static void emit32(jit_emitter *e, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit8(e, (value >> (8 * i)) & 0xFF);
+    }
+}
+
+static void emit_rex(jit_emitter *e, int wide, int reg, int rm) {
+    uint32_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (rex != 0x40) {
+        emit8(e, rex);
+    }
+}
+
+// opcode with a register-direct ModRM, opcode2 is emitted when non zero
+static void emit_rr(jit_emitter *e, int wide, uint32_t opcode, uint32_t opcode2, int reg, int rm) {
+    emit_rex(e, wide, reg, rm);
+    emit8(e, opcode);
+    if (opcode2) {
+        emit8(e, opcode2);
+    }
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// opcode with a [base + disp32] operand
+static void emit_rm(jit_emitter *e, int wide, uint32_t opcode, uint32_t opcode2, int reg, int base, int32_t disp) {
+    emit_rex(e, wide, reg, base);
+    emit8(e, opcode);
+    if (opcode2) {
+        emit8(e, opcode2);
+    }
+    emit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit8(e, 0x24); // SIB for rsp/r12 bases
+    }
+    emit32(e, (uint32_t)disp);
+}
+
+static void emit_mov_imm32(jit_emitter *e, int reg, uint32_t value) {
+    emit_rex(e, 0, 0, reg);
+    emit8(e, 0xB8 + (reg & 7));
+    emit32(e, value);
+}
+
+static void emit_mov_imm64(jit_emitter *e, int reg, uint64_t value) {
+    emit_rex(e, 1, 0, reg);
+    emit8(e, 0xB8 + (reg & 7));
+    emit32(e, (uint32_t)value);
+    emit32(e, (uint32_t)(value >> 32));
+}
+
+static void emit_push(jit_emitter *e, int reg) {
+    emit_rex(e, 0, 0, reg);
+    emit8(e, 0x50 + (reg & 7));
+}
+
+static void emit_pop(jit_emitter *e, int reg) {
+    emit_rex(e, 0, 0, reg);
+    emit8(e, 0x58 + (reg & 7));
+}
+
+// short forward jump, returns the displacement byte to patch
+static uint8_t *emit_jcc8(jit_emitter *e, int cc) {
+    emit8(e, 0x70 + cc);
+    emit8(e, 0);
+    return e->p - 1;
+}
+
+static uint8_t *emit_jmp8(jit_emitter *e) {
+    emit8(e, 0xEB);
+    emit8(e, 0);
+    return e->p - 1;
+}
+
+static void patch8(jit_emitter *e, uint8_t *at) {
+    if (!e->overflow) {
+        *at = (uint8_t)(e->p - (at + 1));
+    }
+}
+
+// jumps to the shared exit sequence, patched once it is emitted
+static void emit_jmp_exit(jit_emitter *e) {
+    emit8(e, 0xE9);
+    emit32(e, 0);
+    e->exit_jumps[e->exit_count++] = e->p - 4;
+}
+
+static void emit_jcc_exit(jit_emitter *e, int cc) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 + cc);
+    emit32(e, 0);
+    e->exit_jumps[e->exit_count++] = e->p - 4;
+}
+
+// host <- guest register
+static void load_guest(jit_emitter *e, int host, int guest) {
+    if (guest == 0) {
+        emit_rr(e, 0, 0x31, 0, host, host); // xor host, host
+    } else if (e->host_of[guest] >= 0) {
+        emit_rr(e, 0, 0x89, 0, e->host_of[guest], host);
+    } else {
+        emit_rm(e, 0, 0x8B, 0, host, R15, 4 * guest);
+    }
+}
+
+// guest register <- host, writes to x0 are dropped
+static void store_guest(jit_emitter *e, int guest, int host) {
+    if (guest == 0) {
+        return;
+    }
+    if (e->host_of[guest] >= 0) {
+        emit_rr(e, 0, 0x89, 0, host, e->host_of[guest]);
+    } else {
+        emit_rm(e, 0, 0x89, 0, host, R15, 4 * guest);
+    }
+}
+
+// frame field <- 32-bit immediate
+static void emit_frame_store_imm(jit_emitter *e, size_t offset, uint32_t value) {
+    emit_rm(e, 1, 0x8B, 0, RDX, RSP, 0); // mov rdx, [rsp] (the frame)
+    emit_rex(e, 0, 0, RDX);
+    emit8(e, 0xC7);
+    emit8(e, 0x80 | RDX);
+    emit32(e, (uint32_t)offset);
+    emit32(e, value);
+}
+
+// writes a store into guest memory and drops whatever was translated or
+// decoded from those bytes. Returns 0 when native code can go on, or the
+// exit status (with next_pc and done filled in) when it has to stop.
+static uint32_t jit_store(jit_frame *frame, uint32_t address, uint32_t value, uint32_t size, uint32_t index, uint32_t pc) {
+    exec_context *ctx = frame->ctx;
+    if ((address & (size - 1)) != 0 || !(ctx->page_flags[address >> PAGE_SHIFT] & PAGE_W)) {
+        frame->next_pc = pc;
+        frame->done = index;
+        return JIT_EXIT_SLOW_ACCESS;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        ctx->memory[address + i] = (value >> (8 * i)) & 0xFF;
+    }
+    if (invalidate_decoded(ctx, address - ctx->mem_offset, size)) {
+        frame->next_pc = pc + 4;
+        frame->done = index + 1;
+        return JIT_EXIT_CODE_WRITTEN;
+    }
+    return 0;
+}
+
+// picks the guest registers this block uses the most for host registers
+static void jit_allocate_registers(jit_emitter *e, const block *b) {
+    uint32_t uses[32] = {0};
+    for (uint32_t i = 0; i < b->length; i++) {
+        const block_insn *bi = &b->insns[i];
+        uses[bi->rs1]++;
+        uses[bi->rs2]++;
+        uses[bi->rd]++;
+    }
+    uses[0] = 0;
+    memset(e->host_of, -1, sizeof(e->host_of));
+    for (int slot = 0; slot < JIT_MAPPED_REGS; slot++) {
+        int best = 0;
+        for (int g = 1; g < 32; g++) {
+            if (e->host_of[g] < 0 && uses[g] > uses[best]) {
+                best = g;
+            }
+        }
+        // a single use is cheaper straight from memory
+        if (best == 0 || uses[best] < 2) {
+            break;
+        }
+        e->host_of[best] = (int8_t)jit_guest_hosts[slot];
+    }
+    e->dirty = 0;
+    for (uint32_t i = 0; i < b->length; i++) {
+        int rd = b->insns[i].rd;
+        if (e->host_of[rd] >= 0) {
+            e->dirty |= 1u << rd;
+        }
+    }
+}
+
+// DIV/DIVU/REM/REMU with eax = dividend, ecx = divisor, result in eax.
+// Follows rv_div and friends: x/0 and INT32_MIN/-1 never reach idiv.
+static void emit_division(jit_emitter *e, int op) {
+    int is_signed = (op == OP_DIV || op == OP_REM);
+    int is_rem = (op == OP_REM || op == OP_REMU);
+    uint8_t *by_zero, *overflow1 = NULL, *overflow2 = NULL, *to_end1, *to_end2 = NULL;
+
+    emit_rr(e, 0, 0x85, 0, RCX, RCX); // test ecx, ecx
+    by_zero = emit_jcc8(e, CC_E);
+    if (is_signed) {
+        emit_rr(e, 0, 0x81, 0, 7, RAX); // cmp eax, INT32_MIN
+        emit32(e, 0x80000000);
+        overflow1 = emit_jcc8(e, CC_NE);
+        emit_rr(e, 0, 0x83, 0, 7, RCX); // cmp ecx, -1
+        emit8(e, 0xFF);
+        overflow2 = emit_jcc8(e, CC_NE);
+        // INT32_MIN / -1: quotient is the dividend, remainder is 0
+        if (is_rem) {
+            emit_rr(e, 0, 0x31, 0, RAX, RAX);
+        }
+        to_end2 = emit_jmp8(e);
+        patch8(e, overflow1);
+        patch8(e, overflow2);
+        emit8(e, 0x99);                 // cdq
+        emit_rr(e, 0, 0xF7, 0, 7, RCX); // idiv ecx
+    } else {
+        emit_rr(e, 0, 0x31, 0, RDX, RDX);
+        emit_rr(e, 0, 0xF7, 0, 6, RCX); // div ecx
+    }
+    if (is_rem) {
+        emit_rr(e, 0, 0x89, 0, RDX, RAX);
+    }
+    to_end1 = emit_jmp8(e);
+    patch8(e, by_zero);
+    // divide by zero: quotient is all ones, remainder is the dividend
+    if (!is_rem) {
+        emit_mov_imm32(e, RAX, 0xFFFFFFFF);
+    }
+    patch8(e, to_end1);
+    if (to_end2 != NULL) {
+        patch8(e, to_end2);
+    }
+}
+
+// compiles one block, returns 0 when it has to stay on the threaded path
+static int jit_compile_block(exec_context *ctx, block *b) {
+    block_cache *bc = ctx->blocks;
+    const block_insn *last = &b->insns[b->length - 1];
+    jit_emitter e;
+
+    if (last->op == OP_EBREAK) {
+        return 0;
+    }
+
+    e.p = bc->jit_code + bc->jit_used;
+    e.end = bc->jit_code + JIT_CODE_SIZE;
+    e.overflow = 0;
+    e.exit_count = 0;
+    jit_allocate_registers(&e, b);
+    uint8_t *entry = e.p;
+
+    // prologue: save callee-saved registers, keep the frame at [rsp]
+    emit_push(&e, RBX);
+    emit_push(&e, RBP);
+    emit_push(&e, R12);
+    emit_push(&e, R13);
+    emit_push(&e, R14);
+    emit_push(&e, R15);
+    emit_rr(&e, 1, 0x83, 0, 5, RSP); // sub rsp, 8
+    emit8(&e, 8);
+    emit_rm(&e, 1, 0x89, 0, RDI, RSP, 0);
+    emit_rm(&e, 1, 0x8B, 0, R15, RDI, (int32_t)offsetof(jit_frame, registers));
+    emit_rm(&e, 1, 0x8B, 0, R14, RDI, (int32_t)offsetof(jit_frame, memory));
+    for (int g = 1; g < 32; g++) {
+        if (e.host_of[g] >= 0) {
+            emit_rm(&e, 0, 0x8B, 0, e.host_of[g], R15, 4 * g);
+        }
+    }
+
+    for (uint32_t i = 0; i <= b->length && !e.overflow; i++) {
+        const block_insn *bi = &b->insns[i];
+        uint32_t insn_pc = b->start_pc + 4 * i;
+        int op = bi->op;
+
+        if (i == b->length && op != BLOCK_OP_FALLTHROUGH) {
+            break; // the terminator already jumped to the exit
+        }
+
+        switch (op) {
+            case OP_NOP:
+                break;
+            case OP_CLEAR_RD:
+                emit_rr(&e, 0, 0x31, 0, RAX, RAX);
+                store_guest(&e, bi->rd, RAX);
+                break;
+
+                // Load-Type
+            case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU: {
+                static const uint8_t load_opcode2[] = {
+                    [OP_LB] = 0xBE, [OP_LH] = 0xBF, [OP_LBU] = 0xB6, [OP_LHU] = 0xB7
+                };
+                uint8_t *misaligned = NULL, *no_perm, *checked;
+                uint32_t size = (op == OP_LW) ? 4 : ((op == OP_LH || op == OP_LHU) ? 2 : 1);
+                load_guest(&e, RAX, bi->rs1);
+                emit_rr(&e, 0, 0x81, 0, 0, RAX); // add eax, imm
+                emit32(&e, (uint32_t)bi->imm);
+                if (size > 1) {
+                    emit8(&e, 0xA8); // test al, size - 1
+                    emit8(&e, size - 1);
+                    misaligned = emit_jcc8(&e, CC_NE);
+                }
+                emit_rr(&e, 0, 0x89, 0, RAX, RCX);
+                emit_rr(&e, 0, 0xC1, 0, 5, RCX); // shr ecx, PAGE_SHIFT
+                emit8(&e, PAGE_SHIFT);
+                emit_mov_imm64(&e, RDX, (uint64_t)(uintptr_t)ctx->page_flags);
+                emit_rr(&e, 1, 0x01, 0, RCX, RDX); // add rdx, rcx
+                emit_rm(&e, 0, 0xF6, 0, 0, RDX, 0); // test byte [rdx], PAGE_R
+                emit8(&e, PAGE_R);
+                no_perm = emit_jcc8(&e, CC_E);
+                checked = emit_jmp8(&e);
+                // cold path: leave before the load, the interpreter does it
+                if (misaligned != NULL) {
+                    patch8(&e, misaligned);
+                }
+                patch8(&e, no_perm);
+                emit_frame_store_imm(&e, offsetof(jit_frame, next_pc), insn_pc);
+                emit_frame_store_imm(&e, offsetof(jit_frame, done), i);
+                emit_mov_imm32(&e, RAX, JIT_EXIT_SLOW_ACCESS);
+                emit_jmp_exit(&e);
+                patch8(&e, checked);
+                emit_rr(&e, 1, 0x01, 0, R14, RAX); // add rax, r14
+                if (op == OP_LW) {
+                    emit_rm(&e, 0, 0x8B, 0, RCX, RAX, 0);
+                } else {
+                    emit_rm(&e, 0, 0x0F, load_opcode2[op], RCX, RAX, 0);
+                }
+                store_guest(&e, bi->rd, RCX);
+                break;
+            }
+
+                // I-Type (ALU immediate)
+            case OP_ADDI: case OP_ANDI: case OP_ORI: case OP_XORI: {
+                static const uint8_t digit[] = {[OP_ADDI] = 0, [OP_ORI] = 1, [OP_ANDI] = 4, [OP_XORI] = 6};
+                load_guest(&e, RAX, bi->rs1);
+                emit_rr(&e, 0, 0x81, 0, digit[op], RAX);
+                emit32(&e, (uint32_t)bi->imm);
+                store_guest(&e, bi->rd, RAX);
+                break;
+            }
+            case OP_SLLI: case OP_SRLI: case OP_SRAI: {
+                static const uint8_t digit[] = {[OP_SLLI] = 4, [OP_SRLI] = 5, [OP_SRAI] = 7};
+                load_guest(&e, RAX, bi->rs1);
+                emit_rr(&e, 0, 0xC1, 0, digit[op], RAX);
+                emit8(&e, (uint32_t)bi->imm);
+                store_guest(&e, bi->rd, RAX);
+                break;
+            }
+            case OP_SLTI: case OP_SLTIU:
+                load_guest(&e, RCX, bi->rs1);
+                emit_rr(&e, 0, 0x31, 0, RAX, RAX);
+                emit_rr(&e, 0, 0x81, 0, 7, RCX); // cmp ecx, imm
+                emit32(&e, (uint32_t)bi->imm);
+                emit_rr(&e, 0, 0x0F, op == OP_SLTI ? 0x9C : 0x92, 0, RAX); // setl/setb al
+                store_guest(&e, bi->rd, RAX);
+                break;
+            case OP_LUI: // AUIPC too, translation already folded the pc in
+                emit_mov_imm32(&e, RAX, (uint32_t)bi->imm);
+                store_guest(&e, bi->rd, RAX);
+                break;
+
+                // Store-Type
+            case OP_SB: case OP_SH: case OP_SW:
+                load_guest(&e, RSI, bi->rs1);
+                emit_rr(&e, 0, 0x81, 0, 0, RSI); // add esi, imm
+                emit32(&e, (uint32_t)bi->imm);
+                load_guest(&e, RDX, bi->rs2);
+                emit_mov_imm32(&e, RCX, op == OP_SB ? 1 : (op == OP_SH ? 2 : 4));
+                emit_mov_imm32(&e, R8, i);
+                emit_mov_imm32(&e, R9, insn_pc);
+                emit_rm(&e, 1, 0x8B, 0, RDI, RSP, 0);
+                emit_mov_imm64(&e, RAX, (uint64_t)(uintptr_t)jit_store);
+                emit_rr(&e, 0, 0xFF, 0, 2, RAX); // call rax
+                // a non zero status already set up the frame, leave with it
+                emit_rr(&e, 0, 0x85, 0, RAX, RAX);
+                emit_jcc_exit(&e, CC_NE);
+                break;
+
+                // R-Type
+            case OP_ADD: case OP_SUB: case OP_AND: case OP_OR: case OP_XOR: {
+                static const uint8_t opcode[] = {[OP_ADD] = 0x01, [OP_SUB] = 0x29, [OP_AND] = 0x21, [OP_OR] = 0x09, [OP_XOR] = 0x31};
+                load_guest(&e, RAX, bi->rs1);
+                load_guest(&e, RCX, bi->rs2);
+                emit_rr(&e, 0, opcode[op], 0, RCX, RAX);
+                store_guest(&e, bi->rd, RAX);
+                break;
+            }
+            case OP_SLL: case OP_SRL: case OP_SRA: {
+                static const uint8_t digit[] = {[OP_SLL] = 4, [OP_SRL] = 5, [OP_SRA] = 7};
+                load_guest(&e, RAX, bi->rs1);
+                load_guest(&e, RCX, bi->rs2);
+                emit_rr(&e, 0, 0xD3, 0, digit[op], RAX); // shift eax by cl, x86 masks it to 5 bits
+                store_guest(&e, bi->rd, RAX);
+                break;
+            }
+            case OP_SLT: case OP_SLTU:
+                load_guest(&e, RCX, bi->rs1);
+                load_guest(&e, RDX, bi->rs2);
+                emit_rr(&e, 0, 0x31, 0, RAX, RAX);
+                emit_rr(&e, 0, 0x39, 0, RDX, RCX); // cmp ecx, edx
+                emit_rr(&e, 0, 0x0F, op == OP_SLT ? 0x9C : 0x92, 0, RAX);
+                store_guest(&e, bi->rd, RAX);
+                break;
+
+                // M-Extension
+            case OP_MUL:
+                load_guest(&e, RAX, bi->rs1);
+                load_guest(&e, RCX, bi->rs2);
+                emit_rr(&e, 0, 0x0F, 0xAF, RAX, RCX); // imul eax, ecx
+                store_guest(&e, bi->rd, RAX);
+                break;
+            case OP_MULH: case OP_MULHSU: case OP_MULHU:
+                // 64-bit product of the (sign or zero) extended operands
+                load_guest(&e, RAX, bi->rs1);
+                load_guest(&e, RCX, bi->rs2);
+                if (op != OP_MULHU) {
+                    emit_rr(&e, 1, 0x63, 0, RAX, RAX); // movsxd rax, eax
+                }
+                if (op == OP_MULH) {
+                    emit_rr(&e, 1, 0x63, 0, RCX, RCX);
+                }
+                emit_rr(&e, 1, 0x0F, 0xAF, RAX, RCX); // imul rax, rcx
+                emit_rr(&e, 1, 0xC1, 0, 5, RAX);      // shr rax, 32
+                emit8(&e, 32);
+                store_guest(&e, bi->rd, RAX);
+                break;
+            case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+                load_guest(&e, RAX, bi->rs1);
+                load_guest(&e, RCX, bi->rs2);
+                emit_division(&e, op);
+                store_guest(&e, bi->rd, RAX);
+                break;
+
+                // B-Type: eax = 0 when taken, 1 when not
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+                static const uint8_t not_taken_cc[] = {
+                    [OP_BEQ] = CC_NE, [OP_BNE] = CC_E, [OP_BLT] = CC_GE,
+                    [OP_BGE] = CC_L, [OP_BLTU] = CC_AE, [OP_BGEU] = CC_B
+                };
+                load_guest(&e, RCX, bi->rs1);
+                load_guest(&e, RDX, bi->rs2);
+                emit_rr(&e, 0, 0x31, 0, RAX, RAX);
+                emit_rr(&e, 0, 0x39, 0, RDX, RCX);
+                emit_rr(&e, 0, 0x0F, 0x90 + not_taken_cc[op], 0, RAX);
+                emit_jmp_exit(&e);
+                break;
+            }
+
+            case OP_JAL:
+                emit_mov_imm32(&e, RCX, b->end_pc);
+                store_guest(&e, bi->rd, RCX);
+                emit_mov_imm32(&e, RAX, JIT_EXIT_TAKEN);
+                emit_jmp_exit(&e);
+                break;
+
+            case OP_JALR:
+                load_guest(&e, RCX, bi->rs1);
+                emit_rr(&e, 0, 0x81, 0, 0, RCX); // add ecx, imm
+                emit32(&e, (uint32_t)bi->imm);
+                emit_rr(&e, 0, 0x83, 0, 4, RCX); // and ecx, ~1
+                emit8(&e, 0xFE);
+                emit_mov_imm32(&e, RAX, b->end_pc);
+                store_guest(&e, bi->rd, RAX);
+                emit_rm(&e, 1, 0x8B, 0, RDX, RSP, 0);
+                emit_rm(&e, 0, 0x89, 0, RCX, RDX, (int32_t)offsetof(jit_frame, next_pc));
+                emit_mov_imm32(&e, RAX, JIT_EXIT_INDIRECT);
+                emit_jmp_exit(&e);
+                break;
+
+            case BLOCK_OP_FALLTHROUGH:
+                emit_mov_imm32(&e, RAX, JIT_EXIT_FALLTHROUGH);
+                emit_jmp_exit(&e);
+                break;
+
+            default:
+                return 0;
+        }
+    }
+
+    // shared exit: write mapped registers back and return eax
+    uint8_t *exit = e.p;
+    for (int g = 1; g < 32; g++) {
+        if (e.dirty & (1u << g)) {
+            emit_rm(&e, 0, 0x89, 0, e.host_of[g], R15, 4 * g);
+        }
+    }
+    emit_rr(&e, 1, 0x83, 0, 0, RSP); // add rsp, 8
+    emit8(&e, 8);
+    emit_pop(&e, R15);
+    emit_pop(&e, R14);
+    emit_pop(&e, R13);
+    emit_pop(&e, R12);
+    emit_pop(&e, RBP);
+    emit_pop(&e, RBX);
+    emit8(&e, 0xC3);
+
+    if (e.overflow) {
+        return 0;
+    }
+    for (int j = 0; j < e.exit_count; j++) {
+        int32_t rel = (int32_t)(exit - (e.exit_jumps[j] + 4));
+        memcpy(e.exit_jumps[j], &rel, 4);
+    }
+
+    bc->jit_used = (size_t)(e.p - bc->jit_code + 15) & ~(size_t)15;
+    bc->jit_compiled++;
+    b->native = (jit_block_fn)(void *)entry;
+    return 1;
+}
+
+// maps the executable buffer, returns 0 when the host won't give us one
+static int jit_enable(block_cache *bc, uint64_t threshold) {
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return 0;
+    }
+    bc->jit_code = (uint8_t *)code;
+    bc->jit_used = 0;
+    bc->jit_threshold = threshold;
+    return 1;
+}
+
+#else
+
+static int jit_compile_block(exec_context *ctx, block *b) {
+    (void)ctx;
+    (void)b;
+    return 0;
+}
+
+static int jit_enable(block_cache *bc, uint64_t threshold) {
+    (void)bc;
+    (void)threshold;
+    return 0;
+}
+
+#endif
+
+// --- Block engine ---
+// translates straight-line code into arrays of label addresses and runs
+// them with computed gotos (direct threading), blocks are chained to their
+// successors so hot loops never go back to the lookup
+
+block_cache *block_cache_create(uint32_t mem_size) {
+    block_cache *bc = (block_cache *)calloc(1, sizeof(block_cache));
+    if (bc == NULL) {
+        return NULL;
+    }
+    bc->map = (block **)calloc(mem_size / 4, sizeof(block *));
+    bc->code_words = (uint8_t *)calloc(mem_size / 4, 1);
+    bc->arena = (uint8_t *)malloc(BLOCK_ARENA_SIZE);
+    if (bc->map == NULL || bc->code_words == NULL || bc->arena == NULL) {
+        block_cache_destroy(bc);
+        return NULL;
+    }
+    bc->code_lo = UINT32_MAX;
+    return bc;
+}
+
+void block_cache_destroy(block_cache *bc) {
+    if (bc->jit_code != NULL) {
+        munmap(bc->jit_code, JIT_CODE_SIZE);
+    }
+    free(bc->map);
+    free(bc->code_words);
+    free(bc->arena);
+    free(bc);
+}
+
+// drops every translated block, chained pointers included
+void block_cache_flush(exec_context *ctx) {
+    block_cache *bc = ctx->blocks;
+    if (ctx->profile != NULL) {
+        profile_fold_blocks(ctx);
+    }
+    if (bc->code_lo < bc->code_hi) {
+        memset(bc->map + bc->code_lo, 0, (bc->code_hi - bc->code_lo) * sizeof(block *));
+        memset(bc->code_words + bc->code_lo, 0, bc->code_hi - bc->code_lo);
+    }
+    bc->code_lo = UINT32_MAX;
+    bc->code_hi = 0;
+    bc->arena_used = 0;
+    bc->jit_used = 0;
+    bc->flushes++;
+}
+
+// flushes and zeroes the counters, for a machine that runs a new program
+void block_cache_reset(exec_context *ctx) {
+    block_cache *bc = ctx->blocks;
+    block_cache_flush(ctx);
+    bc->translated = 0;
+    bc->flushes = 0;
+    bc->insns_in_blocks = 0;
+    bc->jit_compiled = 0;
+    bc->jit_insns = 0;
+}
+
+// decodes the words of a block that branches back to its own start into
+// words, and returns the IDIOM_* kind of the loop they make
+static int block_loop_shape(const exec_context *ctx, const block *b, decoded_instr *words, loop_shape *s) {
+    for (uint32_t k = 0; k < b->length; k++) {
+        decode_instruction(read_word_from_mem(ctx->memory, b->start_pc + 4 * k), &words[k]);
+    }
+    return match_loop(&words[b->length - 1], s);
+}
+
+// decodes the block starting at pc, returns NULL when there is nothing
+// to translate there
+static block *translate_block(exec_context *ctx, uint32_t pc, const void *const *labels) {
+    block_cache *bc = ctx->blocks;
+    uint32_t idx = pc - ctx->mem_offset;
+    block_insn insns[BLOCK_MAX_LENGTH + 1];
+    uint32_t next_pc[2] = {0, 0};
+    uint32_t n = 0;
+    int terminated = 0;
+
+    while (!terminated && n < BLOCK_MAX_LENGTH && idx + 4 * n + 4 <= ctx->mem_size) {
+        decoded_instr d;
+        uint32_t insn_pc = pc + 4 * n;
+        // the interpreter reports the fetch fault once the block runs out
+        if (!page_allows(ctx->page_flags, insn_pc, 4, PAGE_X)) {
+            break;
+        }
+        decode_instruction(read_word_from_mem(ctx->memory, insn_pc), &d);
+        // atomics and fence.i are left to the interpreter, the block
+        // ends right before them
+        if (d.op >= OP_LR_W && d.op <= OP_FENCE_I) {
+            break;
+        }
+        block_insn *bi = &insns[n++];
+        int op = d.op;
+        bi->rd = d.rd;
+        bi->rs1 = d.rs1;
+        bi->rs2 = d.rs2;
+        bi->imm = d.imm;
+
+        switch (op) {
+            case OP_AUIPC:
+                // the pc is known here, so it becomes a constant like LUI
+                op = OP_LUI;
+                bi->imm = (int32_t)(insn_pc + d.imm);
+                break;
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+                next_pc[0] = insn_pc + d.imm;
+                next_pc[1] = insn_pc + 4;
+                terminated = 1;
+                break;
+            case OP_JAL:
+                next_pc[0] = insn_pc + d.imm;
+                terminated = 1;
+                break;
+            case OP_JALR:
+            case OP_EBREAK:
+                terminated = 1;
+                break;
+        }
+
+        // results written to x0 are thrown away, only loads keep running
+        // since they still read memory
+        if (d.rd == 0 && ((op >= OP_SLLI && op <= OP_XORI) || (op >= OP_SLL && op <= OP_LUI) || op == OP_CLEAR_RD)) {
+            op = OP_NOP;
+        }
+        bi->op = (uint8_t)op;
+        bi->label = labels[op];
+    }
+
+    if (n == 0) {
+        return NULL;
+    }
+
+    uint32_t slots = n;
+    if (!terminated) {
+        next_pc[1] = pc + 4 * n;
+        insns[slots].op = BLOCK_OP_FALLTHROUGH;
+        insns[slots++].label = labels[BLOCK_OP_FALLTHROUGH];
+    }
+
+    size_t size = (sizeof(block) + slots * sizeof(block_insn) + 15) & ~(size_t)15;
+    if (bc->arena_used + size > BLOCK_ARENA_SIZE) {
+        block_cache_flush(ctx);
+    }
+    block *b = (block *)(bc->arena + bc->arena_used);
+    bc->arena_used += size;
+
+    b->start_pc = pc;
+    b->end_pc = pc + 4 * n;
+    b->length = n;
+    b->exec_count = 0;
+    b->folded = 0;
+    b->taken_count = 0;
+    b->exit_kind = (uint8_t)(terminated ? jump_kind(insns[n - 1].op, insns[n - 1].rd, insns[n - 1].rs1) : JUMP_PLAIN);
+    b->next_pc[0] = next_pc[0];
+    b->next_pc[1] = next_pc[1];
+    b->idiom = 0;
+    if (insns[n - 1].op == OP_BNE && next_pc[0] == pc && n - 1 <= LOOP_MAX_BODY) {
+        decoded_instr words[LOOP_MAX_BODY + 1];
+        loop_shape s;
+        b->idiom = (block_loop_shape(ctx, b, words, &s) != IDIOM_NONE);
+    }
+    b->next[0] = NULL;
+    b->next[1] = NULL;
+    b->native = NULL;
+    memcpy(b->insns, insns, slots * sizeof(block_insn));
+
+    bc->map[idx >> 2] = b;
+    memset(bc->code_words + (idx >> 2), 1, n);
+    if ((idx >> 2) < bc->code_lo) {
+        bc->code_lo = idx >> 2;
+    }
+    if ((idx >> 2) + n > bc->code_hi) {
+        bc->code_hi = (idx >> 2) + n;
+    }
+    bc->translated++;
+    return b;
+}
+
+// a block that is a whole loop idiom just branched back to its start:
+// runs the iterations left at once, at most budget instructions of them,
+// like exec_loop_idiom does in the interpreter. Sets the pc and *taken to
+// where the last one went and returns how many ran, 0 when the block has
+// to run the next one itself. The profile gets the iterations straight
+// in its counters, since the store may have flushed the block.
+static uint64_t block_loop_idiom(exec_context *ctx, const block *b, uint64_t budget, int *taken) {
+    decoded_instr words[LOOP_MAX_BODY + 1];
+    loop_shape s;
+    uint32_t first = (b->start_pc - ctx->mem_offset) >> 2;
+    uint32_t length = b->length;
+    uint32_t start_pc = b->start_pc;
+    uint32_t end_pc = b->end_pc;
+    int finished = 0;
+    if (block_loop_shape(ctx, b, words, &s) == IDIOM_NONE) {
+        return 0;
+    }
+    ctx->pc = end_pc - 4;
+    ctx->idiom_budget = budget;
+    uint64_t n = run_loop_idiom(ctx, &s, &finished);
+    ctx->pc = start_pc;
+    if (n == 0) {
+        return 0;
+    }
+    ctx->idioms[s.kind]++;
+    ctx->idiom_insns += n * length;
+    if (ctx->profile != NULL) {
+        for (uint32_t k = 0; k < length; k++) {
+            ctx->profile->counts[first + k] += n;
+        }
+        ctx->profile->taken[first + length - 1] += n - (uint64_t)finished;
+    }
+    *taken = finished;
+    ctx->pc = finished ? end_pc : start_pc;
+    return n;
+}
+
+// finds (or translates) the block starting at pc
+static block *block_lookup(exec_context *ctx, uint32_t pc, const void *const *labels) {
+    uint32_t idx = pc - ctx->mem_offset;
+    if (idx >= ctx->mem_size || (idx & 3) != 0) {
+        return NULL;
+    }
+    block *b = ctx->blocks->map[idx >> 2];
+    if (b == NULL) {
+        b = translate_block(ctx, pc, labels);
+    }
+    return b;
+}
+
+// same contract as run_core_fast, but executes whole blocks at a time.
+// Whatever can't run as a full block (misaligned pc, the last few steps
+// before max_steps or stop_pc) goes through the interpreter.
+int run_blocks(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc) {
+    static const void *const labels[OP_COUNT + 1] = {
+        [OP_NOP] = &&do_nop, [OP_CLEAR_RD] = &&do_clear_rd,
+        [OP_LB] = &&do_lb, [OP_LH] = &&do_lh, [OP_LW] = &&do_lw, [OP_LBU] = &&do_lbu, [OP_LHU] = &&do_lhu,
+        [OP_SLLI] = &&do_slli, [OP_SRLI] = &&do_srli, [OP_SRAI] = &&do_srai, [OP_ADDI] = &&do_addi,
+        [OP_ANDI] = &&do_andi, [OP_SLTI] = &&do_slti, [OP_SLTIU] = &&do_sltiu, [OP_ORI] = &&do_ori,
+        [OP_XORI] = &&do_xori,
+        [OP_AUIPC] = &&do_lui,
+        [OP_SB] = &&do_sb, [OP_SH] = &&do_sh, [OP_SW] = &&do_sw,
+        [OP_SLL] = &&do_sll, [OP_SRL] = &&do_srl, [OP_SLT] = &&do_slt, [OP_SLTU] = &&do_sltu,
+        [OP_ADD] = &&do_add, [OP_AND] = &&do_and, [OP_OR] = &&do_or, [OP_XOR] = &&do_xor,
+        [OP_SRA] = &&do_sra, [OP_SUB] = &&do_sub,
+        [OP_MUL] = &&do_mul, [OP_MULH] = &&do_mulh, [OP_MULHSU] = &&do_mulhsu, [OP_MULHU] = &&do_mulhu,
+        [OP_DIV] = &&do_div, [OP_DIVU] = &&do_divu, [OP_REM] = &&do_rem, [OP_REMU] = &&do_remu,
+        [OP_LUI] = &&do_lui,
+        [OP_BEQ] = &&do_beq, [OP_BNE] = &&do_bne, [OP_BLT] = &&do_blt, [OP_BGE] = &&do_bge,
+        [OP_BLTU] = &&do_bltu, [OP_BGEU] = &&do_bgeu,
+        [OP_JALR] = &&do_jalr, [OP_JAL] = &&do_jal,
+        [OP_EBREAK] = &&do_ebreak,
+        [BLOCK_OP_FALLTHROUGH] = &&do_fallthrough,
+    };
+    block_cache *bc = ctx->blocks;
+    profile *prof = ctx->profile;
+    uint32_t *regs = ctx->registers;
+    uint32_t *pc = &ctx->pc;
+    uint8_t *memory = ctx->memory;
+    const uint8_t *page_flags = ctx->page_flags;
+    const uint32_t mem_offset = ctx->mem_offset;
+    uint64_t steps = 0;
+    uint64_t interpreted = 0; // steps that went through the interpreter
+    const int bounded = (max_steps != UINT64_MAX || stop_pc != NO_STOP_PC);
+    int keep_run = 1;
+    int taken = 0;
+    block *b;
+    block *next;
+    const block_insn *ip;
+
+// a block only runs when all of it fits before max_steps and stop_pc
+#define BLOCK_FITS(blk) (max_steps - steps >= (blk)->length && stop_pc - (blk)->start_pc >= (blk)->length * 4)
+#define NEXT() goto *(++ip)->label
+#define ALU(expr) regs[ip->rd] = (expr); NEXT()
+// only aligned accesses to pages that allow them run here, anything else
+// (faults included) is left to the interpreter
+#define FAST_ACCESS(address, size, perm) (((address) & ((size) - 1)) == 0 && (page_flags[(address) >> PAGE_SHIFT] & (perm)))
+#define LOAD(size, expr) { uint32_t address = regs[ip->rs1] + ip->imm; if (!FAST_ACCESS(address, size, PAGE_R)) { goto slow_access; } uint32_t value = (expr); if (ip->rd != 0) { regs[ip->rd] = value; } NEXT(); }
+#define BRANCH(condition) taken = (condition) ? 0 : 1; goto block_end
+#define RS1 regs[ip->rs1]
+#define RS2 regs[ip->rs2]
+// instret as of the current point of the run
+#define NOW() (ctx->instret + steps - interpreted)
+
+dispatch:
+    if (!keep_run || steps >= max_steps || *pc == stop_pc) {
+        goto done;
+    }
+    b = block_lookup(ctx, *pc, labels);
+    if (b == NULL || !BLOCK_FITS(b)) {
+        goto interpret_one;
+    }
+
+enter:
+    b->exec_count++;
+    if (b->native != NULL || (bc->jit_code != NULL && b->exec_count == bc->jit_threshold && jit_compile_block(ctx, b))) {
+        jit_frame frame = {regs, memory, ctx, 0, 0};
+        uint32_t status = b->native(&frame);
+        if (status <= JIT_EXIT_FALLTHROUGH) {
+            bc->jit_insns += b->length;
+            taken = (int)status;
+            goto block_end;
+        }
+        if (status == JIT_EXIT_INDIRECT) {
+            bc->jit_insns += b->length;
+            steps += b->length;
+            if (prof != NULL) {
+                profile_jump(prof, b->exit_kind, NOW(), frame.next_pc);
+            }
+        } else {
+            // stopped partway: on JIT_EXIT_CODE_WRITTEN the flush already
+            // dropped b, on JIT_EXIT_SLOW_ACCESS the access is still to do
+            bc->jit_insns += frame.done;
+            steps += frame.done;
+            if (prof != NULL) {
+                profile_partial_block(ctx, b, frame.done);
+            }
+        }
+        *pc = frame.next_pc;
+        if (status == JIT_EXIT_SLOW_ACCESS) {
+            goto interpret_one;
+        }
+        goto dispatch;
+    }
+    ip = b->insns;
+    goto *ip->label;
+
+do_nop: NEXT();
+do_clear_rd: ALU(0);
+
+do_lb: LOAD(1, (uint32_t)sign_extension(memory[address], 8))
+do_lh: LOAD(2, (uint32_t)sign_extension(memory[address] | (memory[address+1] << 8), 16))
+do_lw: LOAD(4, read_word_from_mem(memory, address))
+do_lbu: LOAD(1, memory[address])
+do_lhu: LOAD(2, memory[address] | (memory[address+1] << 8))
+
+do_slli: ALU(RS1 << ip->imm);
+do_srli: ALU(RS1 >> ip->imm);
+do_srai: ALU((uint32_t)((int32_t)RS1 >> ip->imm));
+do_addi: ALU(RS1 + ip->imm);
+do_andi: ALU(RS1 & ip->imm);
+do_slti: ALU(((int32_t)RS1 < ip->imm) ? 1 : 0);
+do_sltiu: ALU((RS1 < (uint32_t)ip->imm) ? 1 : 0);
+do_ori: ALU(RS1 | ip->imm);
+do_xori: ALU(RS1 ^ ip->imm);
+do_lui: ALU((uint32_t)ip->imm);
+
+do_sb: {
+    uint32_t address = RS1 + ip->imm;
+    if (!FAST_ACCESS(address, 1, PAGE_W)) {
+        goto slow_access;
+    }
+    memory[address] = RS2 & 0xFF;
+    if (invalidate_decoded(ctx, address - mem_offset, 1)) {
+        goto code_written;
+    }
+    NEXT();
+}
+do_sh: {
+    uint32_t address = RS1 + ip->imm;
+    uint32_t value = RS2;
+    if (!FAST_ACCESS(address, 2, PAGE_W)) {
+        goto slow_access;
+    }
+    memory[address] = value & 0xFF;
+    memory[address+1] = (value >> 8) & 0xFF;
+    if (invalidate_decoded(ctx, address - mem_offset, 2)) {
+        goto code_written;
+    }
+    NEXT();
+}
+do_sw: {
+    uint32_t address = RS1 + ip->imm;
+    uint32_t value = RS2;
+    if (!FAST_ACCESS(address, 4, PAGE_W)) {
+        goto slow_access;
+    }
+    memory[address] = value & 0xFF;
+    memory[address+1] = (value >> 8) & 0xFF;
+    memory[address+2] = (value >> 16) & 0xFF;
+    memory[address+3] = (value >> 24) & 0xFF;
+    if (invalidate_decoded(ctx, address - mem_offset, 4)) {
+        goto code_written;
+    }
+    NEXT();
+}
+
+do_sll: ALU(RS1 << (RS2 & 0x1F));
+do_srl: ALU(RS1 >> (RS2 & 0x1F));
+do_sra: ALU((uint32_t)((int32_t)RS1 >> (RS2 & 0x1F)));
+do_slt: ALU(((int32_t)RS1 < (int32_t)RS2) ? 1 : 0);
+do_sltu: ALU((RS1 < RS2) ? 1 : 0);
+do_add: ALU(RS1 + RS2);
+do_sub: ALU(RS1 - RS2);
+do_and: ALU(RS1 & RS2);
+do_or: ALU(RS1 | RS2);
+do_xor: ALU(RS1 ^ RS2);
+do_mul: ALU(RS1 * RS2);
+do_mulh: ALU(rv_mulh(RS1, RS2));
+do_mulhsu: ALU(rv_mulhsu(RS1, RS2));
+do_mulhu: ALU(rv_mulhu(RS1, RS2));
+do_div: ALU(rv_div(RS1, RS2));
+do_divu: ALU(rv_divu(RS1, RS2));
+do_rem: ALU(rv_rem(RS1, RS2));
+do_remu: ALU(rv_remu(RS1, RS2));
+
+do_beq: BRANCH(RS1 == RS2);
+do_bne: BRANCH(RS1 != RS2);
+do_blt: BRANCH((int32_t)RS1 < (int32_t)RS2);
+do_bge: BRANCH((int32_t)RS1 >= (int32_t)RS2);
+do_bltu: BRANCH(RS1 < RS2);
+do_bgeu: BRANCH(RS1 >= RS2);
+do_fallthrough: taken = 1; goto block_end;
+
+do_jal:
+    if (ip->rd != 0) {
+        regs[ip->rd] = b->end_pc;
+    }
+    taken = 0;
+    goto block_end;
+
+do_jalr: {
+    uint32_t target = (RS1 + ip->imm) & 0xFFFFFFFE;
+    if (ip->rd != 0) {
+        regs[ip->rd] = b->end_pc;
+    }
+    steps += b->length;
+    if (prof != NULL) {
+        profile_jump(prof, b->exit_kind, NOW(), target);
+    }
+    *pc = target;
+    goto dispatch;
+}
+
+do_ebreak:
+    steps += b->length;
+    *pc = b->end_pc;
+    keep_run = 0;
+    goto done;
+
+block_end:
+    steps += b->length;
+    if (prof != NULL) {
+        b->taken_count += (taken == 0);
+        profile_jump(prof, b->exit_kind, NOW(), b->next_pc[taken]);
+    }
+    if (b->idiom && taken == 0) {
+        uint64_t flushes = bc->flushes;
+        uint64_t n = block_loop_idiom(ctx, b, max_steps - steps, &taken);
+        steps += n * b->length;
+        // a copy or fill over translated code flushed b
+        if (bc->flushes != flushes) {
+            goto dispatch;
+        }
+    }
+    next = b->next[taken];
+    // hot path: already chained, jump straight in without touching the pc
+    if (next != NULL && (!bounded || BLOCK_FITS(next))) {
+        b = next;
+        goto enter;
+    }
+    *pc = b->next_pc[taken];
+    if (next == NULL) {
+        uint64_t flushes = bc->flushes;
+        next = block_lookup(ctx, *pc, labels);
+        // if translating flushed the cache, b itself is gone
+        if (next != NULL && bc->flushes == flushes) {
+            b->next[taken] = next;
+        }
+        if (next != NULL && (!bounded || BLOCK_FITS(next))) {
+            b = next;
+            goto enter;
+        }
+    }
+    goto dispatch;
+
+code_written: {
+    // a store hit translated code, the cache was flushed under us, so stop
+    // right after the store and continue from a fresh translation
+    uint32_t done_insns = (uint32_t)(ip - b->insns) + 1;
+    steps += done_insns;
+    if (prof != NULL) {
+        profile_partial_block(ctx, b, done_insns);
+    }
+    *pc = b->start_pc + 4 * done_insns;
+    goto dispatch;
+}
+
+slow_access: {
+    // the interpreter runs this one instruction, it faults if it has to
+    uint32_t done_insns = (uint32_t)(ip - b->insns);
+    steps += done_insns;
+    if (prof != NULL) {
+        profile_partial_block(ctx, b, done_insns);
+    }
+    *pc = b->start_pc + 4 * done_insns;
+    goto interpret_one;
+}
+
+interpret_one: {
+    uint64_t before = ctx->instret;
+    keep_run = (prof != NULL) ? run_core_observed(ctx, 1, stop_pc) : run_core_exact(ctx, 1, stop_pc);
+    // a faulting instruction doesn't retire
+    steps += ctx->instret - before;
+    interpreted += ctx->instret - before;
+    goto dispatch;
+}
+
+#undef NOW
+#undef RS2
+#undef RS1
+#undef BRANCH
+#undef LOAD
+#undef FAST_ACCESS
+#undef ALU
+#undef NEXT
+#undef BLOCK_FITS
+
+done:
+    // the interpreter already counted its own steps
+    ctx->instret += steps - interpreted;
+    bc->insns_in_blocks += steps - interpreted;
+    return keep_run;
+}
+
+// prints the block engine counters and its most executed blocks
+void print_block_stats(const exec_context *ctx, FILE *out) {
+    const block_cache *bc = ctx->blocks;
+    enum { TOP = 5 };
+    const block *top[TOP] = {NULL};
+
+    fprintf(out, "blocks translated:    %llu (%llu flushes)\n", (unsigned long long)bc->translated, (unsigned long long)bc->flushes);
+    fprintf(out, "instructions in blocks: %llu (%.1f%%)\n", (unsigned long long)bc->insns_in_blocks,
+            ctx->instret ? 100.0 * (double)bc->insns_in_blocks / (double)ctx->instret : 0.0);
+    if (bc->jit_code != NULL) {
+        fprintf(out, "blocks compiled:      %llu (%zu bytes of code)\n", (unsigned long long)bc->jit_compiled, bc->jit_used);
+        fprintf(out, "instructions native:  %llu (%.1f%%)\n", (unsigned long long)bc->jit_insns,
+                ctx->instret ? 100.0 * (double)bc->jit_insns / (double)ctx->instret : 0.0);
+    }
+
+    for (uint32_t i = 0; i < ctx->mem_size / 4; i++) {
+        const block *b = bc->map[i];
+        if (b == NULL) {
+            continue;
+        }
+        for (int t = 0; t < TOP; t++) {
+            if (top[t] == NULL || b->exec_count > top[t]->exec_count) {
+                memmove(&top[t + 1], &top[t], (TOP - t - 1) * sizeof(top[0]));
+                top[t] = b;
+                break;
+            }
+        }
+    }
+    for (int t = 0; t < TOP && top[t] != NULL; t++) {
+        fprintf(out, "  block 0x%08x  %2u insns  entered %llu times\n", top[t]->start_pc, top[t]->length, (unsigned long long)top[t]->exec_count);
+    }
+}
+
+// --- Profiler ---
+// --profile keeps a counter per RAM word. The interpreter bumps it on
+// every instruction, the block engine only counts block entries and folds
+// them into the per-word counters when the blocks get dropped, so
+// profiling costs next to nothing there. The report works everything else
+// out from those counters and the code in memory.
+
+#define PROFILE_TOP 20
+
+// opcode classes of the instruction mix
+enum {
+    CLASS_LOAD, CLASS_STORE, CLASS_ITYPE, CLASS_UTYPE, CLASS_RTYPE, CLASS_MEXT,
+    CLASS_BRANCH, CLASS_JUMP, CLASS_ATOMIC, CLASS_OTHER, CLASS_COUNT
+};
+
+static const char *const class_name[CLASS_COUNT] = {
+    [CLASS_LOAD] = "load", [CLASS_STORE] = "store", [CLASS_ITYPE] = "alu immediate",
+    [CLASS_UTYPE] = "lui/auipc", [CLASS_RTYPE] = "alu register", [CLASS_MEXT] = "mul/div",
+    [CLASS_BRANCH] = "branch", [CLASS_JUMP] = "jal/jalr", [CLASS_ATOMIC] = "atomic",
+    [CLASS_OTHER] = "other",
+};
+
+static int op_class(int op) {
+    if (op >= OP_LB && op <= OP_LHU) return CLASS_LOAD;
+    if (op >= OP_SLLI && op <= OP_XORI) return CLASS_ITYPE;
+    if (op == OP_AUIPC || op == OP_LUI) return CLASS_UTYPE;
+    if (op >= OP_SB && op <= OP_SW) return CLASS_STORE;
+    if (op >= OP_SLL && op <= OP_SUB) return CLASS_RTYPE;
+    if (op >= OP_MUL && op <= OP_REMU) return CLASS_MEXT;
+    if (op >= OP_BEQ && op <= OP_BGEU) return CLASS_BRANCH;
+    if (op == OP_JALR || op == OP_JAL) return CLASS_JUMP;
+    if (op >= OP_LR_W && op <= OP_AMOMAXU_W) return CLASS_ATOMIC;
+    return CLASS_OTHER;
+}
+
+profile *profile_create(uint32_t mem_size) {
+    profile *prof = (profile *)calloc(1, sizeof(profile));
+    if (prof == NULL) {
+        return NULL;
+    }
+    prof->counts_size = (size_t)(mem_size / 4) * sizeof(uint64_t);
+    void *counts = mmap(NULL, prof->counts_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void *taken = mmap(NULL, prof->counts_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    prof->node_capacity = 1024;
+    prof->nodes = (profile_node *)malloc(prof->node_capacity * sizeof(profile_node));
+    prof->counts = (counts == MAP_FAILED) ? NULL : (uint64_t *)counts;
+    prof->taken = (taken == MAP_FAILED) ? NULL : (uint64_t *)taken;
+    if (prof->counts == NULL || prof->taken == NULL || prof->nodes == NULL) {
+        profile_destroy(prof);
+        return NULL;
+    }
+    profile_reset(prof);
+    return prof;
+}
+
+void profile_destroy(profile *prof) {
+    if (prof->counts != NULL) {
+        munmap(prof->counts, prof->counts_size);
+    }
+    if (prof->taken != NULL) {
+        munmap(prof->taken, prof->counts_size);
+    }
+    free(prof->nodes);
+    free(prof);
+}
+
+// drops every count, the counter pages go back to the host
+void profile_reset(profile *prof) {
+    madvise(prof->counts, prof->counts_size, MADV_DONTNEED);
+    madvise(prof->taken, prof->counts_size, MADV_DONTNEED);
+    prof->outside = 0;
+    memset(&prof->nodes[0], 0, sizeof(profile_node));
+    prof->node_count = 1;
+    prof->current = 0;
+    prof->depth = 0;
+    prof->lost_depth = 0;
+    prof->last_switch = 0;
+}
+
+// the root context is whatever the hart starts running
+void profile_start(exec_context *ctx) {
+    ctx->profile->nodes[0].pc = ctx->pc;
+    ctx->profile->last_switch = ctx->instret;
+}
+
+// adds the block entries not counted yet to the per-word counters
+void profile_fold_blocks(exec_context *ctx) {
+    block_cache *bc = ctx->blocks;
+    profile *prof = ctx->profile;
+    for (uint32_t i = bc->code_lo; i < bc->code_hi; i++) {
+        block *b = bc->map[i];
+        if (b == NULL) {
+            continue;
+        }
+        uint64_t entries = b->exec_count - b->folded;
+        for (uint32_t k = 0; k < b->length; k++) {
+            prof->counts[i + k] += entries;
+        }
+        prof->taken[i + b->length - 1] += b->taken_count;
+        b->folded = b->exec_count;
+        b->taken_count = 0;
+    }
+}
+
+// a block left after done instructions, its entry counted the rest too
+static void profile_partial_block(exec_context *ctx, const block *b, uint32_t done) {
+    uint32_t first = (b->start_pc - ctx->mem_offset) >> 2;
+    for (uint32_t k = done; k < b->length; k++) {
+        ctx->profile->counts[first + k]--;
+    }
+}
+
+typedef struct {
+    uint32_t pc;  // first instruction
+    uint32_t length;
+    uint64_t count;
+} profile_entry;
+
+static int compare_entry_count(const void *a, const void *b) {
+    const profile_entry *x = (const profile_entry *)a;
+    const profile_entry *y = (const profile_entry *)b;
+    uint64_t wx = x->count * x->length;
+    uint64_t wy = y->count * y->length;
+    if (wx != wy) {
+        return (wx < wy) ? 1 : -1;
+    }
+    return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+static int compare_entry_pc(const void *a, const void *b) {
+    const profile_entry *x = (const profile_entry *)a;
+    const profile_entry *y = (const profile_entry *)b;
+    return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+// the mnemonic without its padding
+static const char *profile_mnemonic(uint32_t raw, char *buffer) {
+    decoded_instr d;
+    decode_instruction(raw, &d);
+    const char *name = op_mnemonic[d.op];
+    if (name == NULL) {
+        name = (d.op == OP_FENCE_I) ? "fence.i" : "-";
+    }
+    size_t n = 0;
+    while (name[n] != '\0' && name[n] != ' ') {
+        buffer[n] = name[n];
+        n++;
+    }
+    buffer[n] = '\0';
+    return buffer;
+}
+
+// the words whose counters were ever written, the counter pages nothing
+// touched aren't resident and the reports don't read them either.
+// counters holds per_word bytes for each of the words.
+static void counter_range(const void *counters, size_t size, size_t per_word, uint32_t words, uint32_t *first, uint32_t *last) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    unsigned char *resident = (unsigned char *)malloc(pages);
+    *first = 0;
+    *last = words;
+    if (resident == NULL || mincore((void *)counters, size, resident) != 0) {
+        free(resident);
+        return;
+    }
+    size_t lo = 0;
+    size_t hi = pages;
+    while (lo < hi && !(resident[lo] & 1)) {
+        lo++;
+    }
+    while (hi > lo && !(resident[hi - 1] & 1)) {
+        hi--;
+    }
+    size_t end = (hi * page + per_word - 1) / per_word;
+    *first = (uint32_t)(lo * page / per_word);
+    *last = (end < words) ? (uint32_t)end : words;
+    free(resident);
+}
+
+// "0x80000000;0x80000124;..." for the path from the root to node
+static void profile_write_stack(FILE *out, const profile *prof, uint32_t node) {
+    if (node != 0) {
+        profile_write_stack(out, prof, prof->nodes[node].parent);
+        fputc(';', out);
+    }
+    fprintf(out, "0x%08x", prof->nodes[node].pc);
+}
+
+// writes <prefix>.txt with the report and <prefix>.folded with the call
+// stacks in the folded format flame graph tools read, one line per
+// calling context with the instructions it retired itself
+int profile_write(exec_context *ctx, const char *prefix) {
+    profile *prof = ctx->profile;
+    if (ctx->blocks != NULL) {
+        profile_fold_blocks(ctx);
+    }
+    profile_switch(prof, ctx->instret);
+
+    size_t path_size = strlen(prefix) + 8;
+    char *path = (char *)malloc(path_size);
+    uint32_t first;
+    uint32_t last;
+    counter_range(prof->counts, prof->counts_size, sizeof(uint64_t), ctx->mem_size / 4, &first, &last);
+    uint32_t executed = 0;
+    for (uint32_t i = first; i < last; i++) {
+        executed += (prof->counts[i] != 0);
+    }
+    profile_entry *entries = (profile_entry *)malloc(((size_t)executed + prof->node_count + 1) * sizeof(profile_entry));
+    if (path == NULL || entries == NULL) {
+        fprintf(stderr, "Error allocating the profile report\n");
+        free(path);
+        free(entries);
+        return -1;
+    }
+    snprintf(path, path_size, "%s.txt", prefix);
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror("Error opening the profile report");
+        free(path);
+        free(entries);
+        return -1;
+    }
+
+    // instruction mix, taken branches and memory accesses come from the
+    // counters and the code as it is in memory now
+    uint64_t class_count[CLASS_COUNT] = {0};
+    uint64_t taken = 0;
+    uint64_t total = prof->outside;
+    for (uint32_t i = first; i < last; i++) {
+        if (prof->counts[i] == 0) {
+            continue;
+        }
+        decoded_instr d;
+        decode_instruction(read_word_from_mem(ctx->memory, ctx->mem_offset + 4 * i), &d);
+        int cls = op_class(d.op);
+        class_count[cls] += prof->counts[i];
+        total += prof->counts[i];
+        if (cls == CLASS_BRANCH) {
+            taken += prof->taken[i];
+        }
+    }
+    fprintf(out, "# guest profile, %llu instructions", (unsigned long long)total);
+    if (prof->outside != 0) {
+        fprintf(out, " (%llu outside RAM, not in the tables below)", (unsigned long long)prof->outside);
+    }
+    fprintf(out, "\n\ninstruction mix\n");
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        fprintf(out, "  %-14s %14llu  %5.1f%%\n", class_name[c], (unsigned long long)class_count[c], percent(class_count[c], total));
+    }
+    uint64_t branches = class_count[CLASS_BRANCH];
+    fprintf(out, "\nbranches: %llu, %llu taken (%.1f%%), %llu not taken (%.1f%%)\n", (unsigned long long)branches,
+            (unsigned long long)taken, percent(taken, branches), (unsigned long long)(branches - taken), percent(branches - taken, branches));
+    fprintf(out, "memory accesses: %llu loads, %llu stores, %llu atomics\n", (unsigned long long)class_count[CLASS_LOAD],
+            (unsigned long long)class_count[CLASS_STORE], (unsigned long long)class_count[CLASS_ATOMIC]);
+
+    // hot functions, the contexts of each function added up
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < prof->node_count; i++) {
+        entries[n].pc = prof->nodes[i].pc;
+        entries[n].length = 1;
+        entries[n].count = prof->nodes[i].self;
+        n++;
+    }
+    qsort(entries, n, sizeof(profile_entry), compare_entry_pc);
+    uint32_t functions = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (functions > 0 && entries[functions - 1].pc == entries[i].pc) {
+            entries[functions - 1].count += entries[i].count;
+        } else {
+            entries[functions++] = entries[i];
+        }
+    }
+    qsort(entries, functions, sizeof(profile_entry), compare_entry_count);
+    fprintf(out, "\nhot functions (instructions retired in the function itself)\n");
+    for (uint32_t i = 0; i < functions && i < PROFILE_TOP && entries[i].count != 0; i++) {
+        fprintf(out, "  0x%08x %14llu  %5.1f%%\n", entries[i].pc, (unsigned long long)entries[i].count, percent(entries[i].count, total));
+    }
+
+    // hot blocks: straight runs of words with the same count, broken
+    // after every branch, jump and ebreak
+    n = 0;
+    for (uint32_t i = first; i < last; i++) {
+        if (prof->counts[i] == 0) {
+            continue;
+        }
+        if (n > 0 && entries[n - 1].count == prof->counts[i] && (entries[n - 1].pc - ctx->mem_offset) / 4 + entries[n - 1].length == i) {
+            decoded_instr d;
+            decode_instruction(read_word_from_mem(ctx->memory, ctx->mem_offset + 4 * (i - 1)), &d);
+            int cls = op_class(d.op);
+            if (cls != CLASS_BRANCH && cls != CLASS_JUMP && d.op != OP_EBREAK) {
+                entries[n - 1].length++;
+                continue;
+            }
+        }
+        entries[n].pc = ctx->mem_offset + 4 * i;
+        entries[n].length = 1;
+        entries[n].count = prof->counts[i];
+        n++;
+    }
+    qsort(entries, n, sizeof(profile_entry), compare_entry_count);
+    fprintf(out, "\nhot blocks (instructions retired in the block)\n");
+    for (uint32_t i = 0; i < n && i < PROFILE_TOP; i++) {
+        uint64_t retired = entries[i].count * entries[i].length;
+        fprintf(out, "  0x%08x-0x%08x %3u insns %14llu times %14llu  %5.1f%%\n", entries[i].pc, entries[i].pc + 4 * entries[i].length - 4,
+                entries[i].length, (unsigned long long)entries[i].count, (unsigned long long)retired, percent(retired, total));
+    }
+
+    // every executed word, hottest first
+    n = 0;
+    for (uint32_t i = first; i < last; i++) {
+        if (prof->counts[i] != 0) {
+            entries[n].pc = ctx->mem_offset + 4 * i;
+            entries[n].length = 1;
+            entries[n].count = prof->counts[i];
+            n++;
+        }
+    }
+    qsort(entries, n, sizeof(profile_entry), compare_entry_count);
+    fprintf(out, "\nhot spots\n  %-10s  %-8s  %-8s %14s  %6s  %6s  %s\n", "pc", "word", "insn", "count", "%", "cum%", "taken");
+    uint64_t cumulative = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t idx = (entries[i].pc - ctx->mem_offset) / 4;
+        uint32_t raw = read_word_from_mem(ctx->memory, entries[i].pc);
+        char mnemonic[16];
+        cumulative += entries[i].count;
+        fprintf(out, "  0x%08x  %08x  %-8s %14llu  %5.1f%%  %5.1f%%", entries[i].pc, raw, profile_mnemonic(raw, mnemonic),
+                (unsigned long long)entries[i].count, percent(entries[i].count, total), percent(cumulative, total));
+        decoded_instr d;
+        decode_instruction(raw, &d);
+        if (op_class(d.op) == CLASS_BRANCH) {
+            fprintf(out, "  %5.1f%%", percent(prof->taken[idx], entries[i].count));
+        }
+        fputc('\n', out);
+    }
+    int failed = ferror(out);
+    fclose(out);
+
+    snprintf(path, path_size, "%s.folded", prefix);
+    out = fopen(path, "w");
+    if (out == NULL) {
+        perror("Error opening the folded stacks file");
+        free(path);
+        free(entries);
+        return -1;
+    }
+    for (uint32_t i = 0; i < prof->node_count; i++) {
+        if (prof->nodes[i].self != 0) {
+            profile_write_stack(out, prof, i);
+            fprintf(out, " %llu\n", (unsigned long long)prof->nodes[i].self);
+        }
+    }
+    failed |= ferror(out);
+    fclose(out);
+    free(path);
+    free(entries);
+    if (failed) {
+        fprintf(stderr, "Error writing the profile\n");
+        return -1;
+    }
+    return 0;
+}
+
+// --- Timing model ---
+// --timing and the cache and predictor options. The model runs on the
+// interpreter, it needs to see every instruction on its own.
+
+static int is_power_of_two(uint64_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// <size>[K|M]:<ways>:<line>[:lru|fifo|random[:<hit cycles>]], or "off"
+// for a cache that may be left out
+int parse_cache_option(const char *value, int optional, cache_config *config) {
+    if (optional && strcmp(value, "off") == 0) {
+        config->size = 0;
+        return 0;
+    }
+    cache_config c = *config;
+    char *end;
+    uint64_t size = strtoull(value, &end, 0);
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end++;
+    }
+    if (*end != ':') {
+        return -1;
+    }
+    c.ways = (uint32_t)strtoul(end + 1, &end, 0);
+    if (*end != ':') {
+        return -1;
+    }
+    c.line = (uint32_t)strtoul(end + 1, &end, 0);
+    if (*end == ':') {
+        const char *policy = end + 1;
+        size_t length = strcspn(policy, ":");
+        if (length == 3 && strncmp(policy, "lru", 3) == 0) {
+            c.policy = REPLACE_LRU;
+        } else if (length == 4 && strncmp(policy, "fifo", 4) == 0) {
+            c.policy = REPLACE_FIFO;
+        } else if (length == 6 && strncmp(policy, "random", 6) == 0) {
+            c.policy = REPLACE_RANDOM;
+        } else {
+            return -1;
+        }
+        end = (char *)policy + length;
+        if (*end == ':') {
+            c.hit_cycles = (uint32_t)strtoul(end + 1, &end, 0);
+        }
+    }
+    if (*end != '\0' || c.ways == 0 || c.line < 4 || !is_power_of_two(c.line) || size > (1u << 30) ||
+        size % ((uint64_t)c.ways * c.line) != 0 || !is_power_of_two(size / ((uint64_t)c.ways * c.line))) {
+        return -1;
+    }
+    c.size = (uint32_t)size;
+    *config = c;
+    return 0;
+}
+
+// static|bimodal|gshare[:<counters>]
+int parse_predictor_option(const char *value, timing_config *config) {
+    static const char *const names[] = {
+        [PREDICT_STATIC] = "static", [PREDICT_BIMODAL] = "bimodal", [PREDICT_GSHARE] = "gshare"
+    };
+    for (int i = 0; i < 3; i++) {
+        size_t length = strlen(names[i]);
+        if (strncmp(value, names[i], length) != 0) {
+            continue;
+        }
+        if (value[length] == '\0') {
+            config->predictor = i;
+            return 0;
+        }
+        char *end;
+        uint64_t entries = strtoull(value + length + 1, &end, 0);
+        if (value[length] != ':' || *end != '\0' || !is_power_of_two(entries) || entries > (1u << 24)) {
+            return -1;
+        }
+        config->predictor = i;
+        config->predictor_entries = (uint32_t)entries;
+        return 0;
+    }
+    return -1;
+}
+
+static int cache_init(cache_model *c, const cache_config *config, cache_model *next) {
+    uint32_t sets = config->size / (config->ways * config->line);
+    c->tags = (uint32_t *)calloc((size_t)sets * config->ways, sizeof(uint32_t));
+    c->stamps = (uint64_t *)calloc((size_t)sets * config->ways, sizeof(uint64_t));
+    c->ways = config->ways;
+    c->set_mask = sets - 1;
+    c->line_shift = 0;
+    while ((1u << c->line_shift) < config->line) {
+        c->line_shift++;
+    }
+    c->policy = config->policy;
+    c->hit_cycles = config->hit_cycles;
+    c->next = next;
+    return (c->tags != NULL && c->stamps != NULL) ? 0 : -1;
+}
+
+static void cache_reset(cache_model *c) {
+    if (c->tags == NULL) {
+        return;
+    }
+    memset(c->tags, 0, (size_t)(c->set_mask + 1) * c->ways * sizeof(uint32_t));
+    memset(c->stamps, 0, (size_t)(c->set_mask + 1) * c->ways * sizeof(uint64_t));
+    c->clock = 0;
+    c->random = 0x9E3779B9u;
+    c->accesses = 0;
+    c->misses = 0;
+}
+
+timing_model *timing_create(const timing_config *config) {
+    timing_model *t = (timing_model *)calloc(1, sizeof(timing_model));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->config = *config;
+    cache_model *l2 = (config->l2.size != 0) ? &t->l2 : NULL;
+    int failed = cache_init(&t->l1i, &config->l1i, l2) | cache_init(&t->l1d, &config->l1d, l2);
+    if (l2 != NULL) {
+        failed |= cache_init(l2, &config->l2, NULL);
+    }
+    t->counters = (uint8_t *)malloc(config->predictor_entries);
+    t->counter_mask = config->predictor_entries - 1;
+    t->btb_pc = (uint32_t *)malloc(config->btb_entries * sizeof(uint32_t));
+    t->btb_target = (uint32_t *)malloc(config->btb_entries * sizeof(uint32_t));
+    t->ras = (uint32_t *)malloc((config->ras_entries + 1) * sizeof(uint32_t));
+    if (failed || t->counters == NULL || t->btb_pc == NULL || t->btb_target == NULL || t->ras == NULL) {
+        timing_destroy(t);
+        return NULL;
+    }
+    timing_reset(t);
+    return t;
+}
+
+void timing_destroy(timing_model *t) {
+    free(t->l1i.tags);
+    free(t->l1i.stamps);
+    free(t->l1d.tags);
+    free(t->l1d.stamps);
+    free(t->l2.tags);
+    free(t->l2.stamps);
+    free(t->counters);
+    free(t->btb_pc);
+    free(t->btb_target);
+    free(t->ras);
+    free(t);
+}
+
+// cold caches and predictor, nothing counted
+void timing_reset(timing_model *t) {
+    cache_reset(&t->l1i);
+    cache_reset(&t->l1d);
+    cache_reset(&t->l2);
+    t->fetch_line = 0;
+    t->data_line = 0;
+    memset(t->counters, 1, t->config.predictor_entries); // weakly not taken
+    t->history = 0;
+    // an odd pc never matches, so these are empty entries
+    memset(t->btb_pc, 0xFF, t->config.btb_entries * sizeof(uint32_t));
+    t->ras_top = 0;
+    t->ras_count = 0;
+    t->pending = PENDING_NONE;
+    t->cycles = 0;
+    t->instructions = 0;
+    t->branches = 0;
+    t->branch_misses = 0;
+    t->indirect = 0;
+    t->indirect_misses = 0;
+}
+
+static void cache_report(const char *name, const cache_model *c, const cache_config *config, FILE *out) {
+    static const char *const policy_name[] = {
+        [REPLACE_LRU] = "LRU", [REPLACE_FIFO] = "FIFO", [REPLACE_RANDOM] = "random"
+    };
+    fprintf(out, "  %s (%u KiB, %u-way, %u-byte lines, %s): %llu accesses, %llu misses (%.2f%%)\n", name, config->size >> 10,
+            config->ways, config->line, policy_name[config->policy], (unsigned long long)c->accesses,
+            (unsigned long long)c->misses, c->accesses ? 100.0 * (double)c->misses / (double)c->accesses : 0.0);
+}
+
+// the estimate and what went into it, a branch still in flight is
+// resolved against the pc the run stopped at
+void timing_report(exec_context *ctx, FILE *out) {
+    static const char *const predictor_name[] = {
+        [PREDICT_STATIC] = "static", [PREDICT_BIMODAL] = "bimodal", [PREDICT_GSHARE] = "gshare"
+    };
+    timing_model *t = ctx->timing;
+    if (t->pending != PENDING_NONE) {
+        timing_resolve(t, ctx->pc);
+    }
+    uint64_t cycles = t->instructions + t->cycles;
+    fprintf(out, "timing model: %llu cycles, CPI %.3f\n", (unsigned long long)cycles,
+            t->instructions ? (double)cycles / (double)t->instructions : 0.0);
+    cache_report("L1I", &t->l1i, &t->config.l1i, out);
+    cache_report("L1D", &t->l1d, &t->config.l1d, out);
+    if (t->config.l2.size != 0) {
+        cache_report("L2", &t->l2, &t->config.l2, out);
+    }
+    fprintf(out, "  branches (%s", predictor_name[t->config.predictor]);
+    if (t->config.predictor != PREDICT_STATIC) {
+        fprintf(out, ", %u counters", t->config.predictor_entries);
+    }
+    fprintf(out, "): %llu, %llu mispredicted (%.2f%%)\n", (unsigned long long)t->branches, (unsigned long long)t->branch_misses,
+            t->branches ? 100.0 * (double)t->branch_misses / (double)t->branches : 0.0);
+    fprintf(out, "  jalr (%u BTB entries, %u RAS entries): %llu, %llu mispredicted (%.2f%%)\n", t->config.btb_entries,
+            t->config.ras_entries, (unsigned long long)t->indirect, (unsigned long long)t->indirect_misses,
+            t->indirect ? 100.0 * (double)t->indirect_misses / (double)t->indirect : 0.0);
+}
+
+// --- Pipeline model ---
+// --pipeline works out when every instruction enters each stage from the
+// instruction before it, so it runs on the interpreter like the timing
+// model. Stalls are kept per RAM word.
+
+pipeline_model *pipeline_create(uint32_t mem_offset, uint32_t mem_size, uint32_t mul_cycles, uint32_t div_cycles) {
+    pipeline_model *pl = (pipeline_model *)calloc(1, sizeof(pipeline_model));
+    if (pl == NULL) {
+        return NULL;
+    }
+    pl->stalls_size = (size_t)(mem_size / 4) * STALL_COUNT * sizeof(uint64_t);
+    void *stalls = mmap(NULL, pl->stalls_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stalls == MAP_FAILED) {
+        free(pl);
+        return NULL;
+    }
+    pl->stalls = (uint64_t *)stalls;
+    pl->mem_offset = mem_offset;
+    pl->mem_size = mem_size;
+    pl->mul_cycles = mul_cycles;
+    pl->div_cycles = div_cycles;
+    pipeline_reset(pl);
+    return pl;
+}
+
+void pipeline_destroy(pipeline_model *pl) {
+    munmap(pl->stalls, pl->stalls_size);
+    free(pl);
+}
+
+// an empty pipeline whose first fetch is in cycle 1
+void pipeline_reset(pipeline_model *pl) {
+    madvise(pl->stalls, pl->stalls_size, MADV_DONTNEED);
+    memset(pl->ready, 0, sizeof(pl->ready));
+    memset(pl->producer, 0, sizeof(pl->producer));
+    memset(pl->window, 0, sizeof(pl->window));
+    pipeline_slot *before = &pl->window[PIPELINE_WINDOW - 1];
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        before->stage[stage] = (uint64_t)stage;
+    }
+    pl->instructions = 0;
+    memset(pl->outside, 0, sizeof(pl->outside));
+    memset(pl->total, 0, sizeof(pl->total));
+    pl->traced_until = 1;
+}
+
+// writes one line per cycle before until, with what each stage holds
+static void pipeline_trace_cycles(pipeline_model *pl, uint64_t until) {
+    uint64_t known = (pl->instructions < PIPELINE_WINDOW) ? pl->instructions : PIPELINE_WINDOW;
+    for (uint64_t cycle = pl->traced_until; cycle < until; cycle++) {
+        char cells[STAGE_COUNT][32];
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            strcpy(cells[stage], "-");
+        }
+        for (uint64_t i = 1; i <= known; i++) {
+            const pipeline_slot *slot = &pl->window[(pl->instructions - i) % PIPELINE_WINDOW];
+            for (int stage = 0; stage < STAGE_COUNT; stage++) {
+                uint64_t leaves = (stage == STAGE_WB) ? slot->stage[STAGE_WB] + 1 : slot->stage[stage + 1];
+                if (slot->stage[stage] <= cycle && cycle < leaves) {
+                    char mnemonic[16];
+                    snprintf(cells[stage], sizeof(cells[stage]), "%08x %s", slot->pc, profile_mnemonic(slot->raw, mnemonic));
+                }
+            }
+        }
+        fprintf(pl->trace, "%10llu  %-18s %-18s %-18s %-18s %s\n", (unsigned long long)cycle, cells[STAGE_IF], cells[STAGE_ID],
+                cells[STAGE_EX], cells[STAGE_MEM], cells[STAGE_WB]);
+    }
+    if (until > pl->traced_until) {
+        pl->traced_until = until;
+    }
+}
+
+typedef struct {
+    uint32_t pc;
+    uint64_t cycles[STALL_COUNT];
+    uint64_t total;
+} stall_entry;
+
+static int compare_stall_entry(const void *a, const void *b) {
+    const stall_entry *x = (const stall_entry *)a;
+    const stall_entry *y = (const stall_entry *)b;
+    if (x->total != y->total) {
+        return (x->total < y->total) ? 1 : -1;
+    }
+    return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+// cycles, CPI, the stall cycles by cause and the instructions that
+// stalled the most. Also finishes the per-cycle trace.
+void pipeline_report(pipeline_model *pl, FILE *out) {
+    static const char *const cause_name[STALL_COUNT] = {
+        [STALL_LOAD_USE] = "load-use", [STALL_MULDIV] = "mul/div", [STALL_FLUSH] = "flush"
+    };
+    const pipeline_slot *last = &pl->window[(pl->instructions - 1) % PIPELINE_WINDOW];
+    uint64_t cycles = pl->instructions ? last->stage[STAGE_WB] : 0;
+    if (pl->trace != NULL) {
+        pipeline_trace_cycles(pl, cycles + 1);
+    }
+    fprintf(out, "pipeline: %llu cycles, %llu instructions, CPI %.3f (mul %u, div %u cycles)\n", (unsigned long long)cycles,
+            (unsigned long long)pl->instructions, pl->instructions ? (double)cycles / (double)pl->instructions : 0.0,
+            pl->mul_cycles, pl->div_cycles);
+    for (int cause = 0; cause < STALL_COUNT; cause++) {
+        fprintf(out, "  %-9s stalls: %14llu cycles (%.1f%%)\n", cause_name[cause], (unsigned long long)pl->total[cause],
+                percent(pl->total[cause], cycles));
+    }
+
+    uint32_t first;
+    uint32_t last_word;
+    counter_range(pl->stalls, pl->stalls_size, STALL_COUNT * sizeof(uint64_t), pl->mem_size / 4, &first, &last_word);
+    size_t count = 0;
+    for (uint32_t i = first; i < last_word; i++) {
+        const uint64_t *c = &pl->stalls[(size_t)i * STALL_COUNT];
+        count += (c[STALL_LOAD_USE] | c[STALL_MULDIV] | c[STALL_FLUSH]) != 0;
+    }
+    stall_entry *entries = (stall_entry *)malloc((count + 1) * sizeof(stall_entry));
+    if (entries == NULL) {
+        return;
+    }
+    size_t n = 0;
+    for (uint32_t i = first; i < last_word; i++) {
+        const uint64_t *c = &pl->stalls[(size_t)i * STALL_COUNT];
+        if ((c[STALL_LOAD_USE] | c[STALL_MULDIV] | c[STALL_FLUSH]) == 0) {
+            continue;
+        }
+        entries[n].pc = pl->mem_offset + 4 * i;
+        entries[n].total = 0;
+        for (int cause = 0; cause < STALL_COUNT; cause++) {
+            entries[n].cycles[cause] = c[cause];
+            entries[n].total += c[cause];
+        }
+        n++;
+    }
+    qsort(entries, n, sizeof(stall_entry), compare_stall_entry);
+    if (n != 0) {
+        fprintf(out, "  stalls by pc:  %14s %14s %14s %14s\n", "total", cause_name[STALL_LOAD_USE], cause_name[STALL_MULDIV],
+                cause_name[STALL_FLUSH]);
+    }
+    for (size_t i = 0; i < n && i < PROFILE_TOP; i++) {
+        fprintf(out, "    0x%08x   %14llu %14llu %14llu %14llu\n", entries[i].pc, (unsigned long long)entries[i].total,
+                (unsigned long long)entries[i].cycles[STALL_LOAD_USE], (unsigned long long)entries[i].cycles[STALL_MULDIV],
+                (unsigned long long)entries[i].cycles[STALL_FLUSH]);
+    }
+    free(entries);
+}
+
+// --- Checkpoints ---
+// a checkpoint holds pc, the registers and the mapped guest pages. Pages
+// that are still all zero leave only their permissions behind, the rest is
+// stored page aligned so a restore can map it straight from the file.
+#define CHECKPOINT_MAGIC "RVCKPT01"
+#define CHECKPOINT_HAS_DATA 0x80 // page table flag: its contents are in the file
+
+typedef struct {
+    char magic[8];
+    uint32_t pc;
+    uint32_t registers[32];
+    uint64_t instret;
+    uint32_t mem_offset;
+    uint32_t mem_size;
+    uint32_t mapped_pages; // entries in the page table that follows
+    uint32_t data_pages;   // pages stored after the table, in table order
+} checkpoint_header;
+
+typedef struct {
+    uint32_t page;
+    uint32_t flags; // PAGE_* bits, plus CHECKPOINT_HAS_DATA
+} checkpoint_page;
+
+// where the page contents start, right after the page table
+static uint64_t checkpoint_data_offset(uint32_t mapped_pages) {
+    uint64_t end = sizeof(checkpoint_header) + (uint64_t)mapped_pages * sizeof(checkpoint_page);
+    return (end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+static int page_is_zero(const uint8_t *page) {
+    const uint64_t *words = (const uint64_t *)page;
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < PAGE_SIZE / 8; i++) {
+        bits |= words[i];
+    }
+    return bits == 0;
+}
+
+// writes the machine state to path, returns 0 on success
+int checkpoint_save(const char *path, const exec_context *ctx) {
+    checkpoint_header header = {0};
+    uint32_t capacity = 1024;
+    checkpoint_page *table = (checkpoint_page *)malloc(capacity * sizeof(checkpoint_page));
+    if (table == NULL) {
+        fprintf(stderr, "Error allocating the checkpoint page table\n");
+        return -1;
+    }
+
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        uint8_t flags = ctx->page_flags[page];
+        if (flags == 0) {
+            continue;
+        }
+        if (header.mapped_pages == capacity) {
+            capacity *= 2;
+            checkpoint_page *grown = (checkpoint_page *)realloc(table, capacity * sizeof(checkpoint_page));
+            if (grown == NULL) {
+                free(table);
+                fprintf(stderr, "Error allocating the checkpoint page table\n");
+                return -1;
+            }
+            table = grown;
+        }
+        if (!page_is_zero(ctx->memory + ((size_t)page << PAGE_SHIFT))) {
+            flags |= CHECKPOINT_HAS_DATA;
+            header.data_pages++;
+        }
+        table[header.mapped_pages].page = page;
+        table[header.mapped_pages].flags = flags;
+        header.mapped_pages++;
+    }
+
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.pc = ctx->pc;
+    memcpy(header.registers, ctx->registers, sizeof(header.registers));
+    header.instret = ctx->instret;
+    header.mem_offset = ctx->mem_offset;
+    header.mem_size = ctx->mem_size;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Error opening checkpoint file");
+        free(table);
+        return -1;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(table, sizeof(checkpoint_page), header.mapped_pages, file) == header.mapped_pages &&
+             fseeko(file, (off_t)checkpoint_data_offset(header.mapped_pages), SEEK_SET) == 0;
+    for (uint32_t i = 0; ok && i < header.mapped_pages; i++) {
+        if (table[i].flags & CHECKPOINT_HAS_DATA) {
+            ok = fwrite(ctx->memory + ((size_t)table[i].page << PAGE_SHIFT), PAGE_SIZE, 1, file) == 1;
+        }
+    }
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    free(table);
+    if (!ok) {
+        perror("Error writing checkpoint file");
+        return -1;
+    }
+    return 0;
+}
+
+// brings back a saved machine. The stored pages are mapped copy-on-write
+// from the file, so restoring costs nothing up front and runs started from
+// the same checkpoint share them until they get written.
+int checkpoint_restore(const char *path, exec_context *ctx) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening checkpoint file");
+        return -1;
+    }
+    checkpoint_header header;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.mapped_pages > PAGE_COUNT || header.data_pages > header.mapped_pages) {
+        fprintf(stderr, "%s is not a checkpoint\n", path);
+        close(fd);
+        return -1;
+    }
+    if (header.mem_size == 0 || (header.mem_size & 3) != 0 || header.mem_size > GUEST_SPACE_SIZE - header.mem_offset) {
+        fprintf(stderr, "Bad RAM size in the checkpoint\n");
+        close(fd);
+        return -1;
+    }
+    if (header.mem_offset != ctx->mem_offset) {
+        fprintf(stderr, "The checkpoint was taken with RAM at 0x%08x\n", header.mem_offset);
+        close(fd);
+        return -1;
+    }
+
+    size_t table_size = (size_t)header.mapped_pages * sizeof(checkpoint_page);
+    checkpoint_page *table = (checkpoint_page *)malloc(table_size + 1);
+    if (table == NULL || pread(fd, table, table_size, sizeof(header)) != (ssize_t)table_size) {
+        fprintf(stderr, "Error reading the checkpoint page table\n");
+        free(table);
+        close(fd);
+        return -1;
+    }
+    for (uint32_t i = 0; i < header.mapped_pages; i++) {
+        if (table[i].page >= PAGE_COUNT) {
+            fprintf(stderr, "Bad page in the checkpoint page table\n");
+            free(table);
+            close(fd);
+            return -1;
+        }
+    }
+    memset(ctx->page_flags, 0, PAGE_COUNT);
+
+    // consecutive stored pages go in with a single mmap
+    off_t data_offset = (off_t)checkpoint_data_offset(header.mapped_pages);
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    int ok = 1;
+    for (uint32_t i = 0; ok && i <= header.mapped_pages; i++) {
+        int has_data = i < header.mapped_pages && (table[i].flags & CHECKPOINT_HAS_DATA);
+        if (i < header.mapped_pages)
+            ctx->page_flags[table[i].page] = (uint8_t)(table[i].flags & (PAGE_R | PAGE_W | PAGE_X));
+        if (has_data && run_length > 0 && table[i].page == run_start + run_length) {
+            run_length++;
+            continue;
+        }
+        if (run_length > 0) {
+            void *at = ctx->memory + ((size_t)run_start << PAGE_SHIFT);
+            size_t bytes = (size_t)run_length << PAGE_SHIFT;
+            ok = mmap(at, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, data_offset) != MAP_FAILED;
+            data_offset += (off_t)bytes;
+            run_length = 0;
+        }
+        if (has_data) {
+            run_start = table[i].page;
+            run_length = 1;
+        }
+    }
+    free(table);
+    close(fd);
+    if (!ok) {
+        perror("Error mapping checkpoint pages");
+        return -1;
+    }
+
+    ctx->pc = header.pc;
+    memcpy(ctx->registers, header.registers, sizeof(header.registers));
+    ctx->registers[0] = 0;
+    ctx->instret = header.instret;
+    ctx->mem_size = header.mem_size;
+    return 0;
+}
+
+// --- SMP ---
+// the harts of a machine run on their own host threads over the same
+// memory. With a quantum they take turns, each one running exactly that
+// many instructions before handing over to the next, so every run
+// interleaves the same way. Without one they all run at once and only
+// look up now and then to see whether another hart faulted.
+#define MAX_HARTS 64
+#define SMP_FREE_SLICE (1u << 16) // instructions between those looks
+
+struct smp_state {
+    int hart_count;
+    uint64_t quantum;      // instructions per turn, 0 = free running
+    pthread_mutex_t lock;
+    pthread_cond_t turn_changed;
+    int turn;              // hart allowed to run, only with a quantum
+    uint8_t stopped[MAX_HARTS];
+    atomic_int stop_all;   // some hart faulted, everybody stops
+};
+
+int smp_init(smp_state *smp, int hart_count, uint64_t quantum) {
+    memset(smp, 0, sizeof(*smp));
+    smp->hart_count = hart_count;
+    smp->quantum = quantum;
+    atomic_init(&smp->stop_all, 0);
+    if (pthread_mutex_init(&smp->lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&smp->turn_changed, NULL) != 0) {
+        pthread_mutex_destroy(&smp->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void smp_destroy(smp_state *smp) {
+    pthread_cond_destroy(&smp->turn_changed);
+    pthread_mutex_destroy(&smp->lock);
+}
+
+// back to hart 0's turn with every hart runnable
+void smp_reset(smp_state *smp) {
+    smp->turn = 0;
+    memset(smp->stopped, 0, sizeof(smp->stopped));
+    atomic_store(&smp->stop_all, 0);
+}
+
+// stops every hart, waking up the ones waiting for their turn
+static void smp_stop_all(smp_state *smp) {
+    pthread_mutex_lock(&smp->lock);
+    atomic_store(&smp->stop_all, 1);
+    pthread_cond_broadcast(&smp->turn_changed);
+    pthread_mutex_unlock(&smp->lock);
+}
+
+// starts a new quantum once the last one ran out, waiting for the hart's
+// turn first. Returns 0 when the hart has to stop.
+static int smp_begin_slice(exec_context *ctx) {
+    smp_state *smp = ctx->smp;
+    if (ctx->quantum_left == 0) {
+        if (smp->quantum != 0) {
+            pthread_mutex_lock(&smp->lock);
+            while (smp->turn != ctx->hart_id && !atomic_load(&smp->stop_all)) {
+                pthread_cond_wait(&smp->turn_changed, &smp->lock);
+            }
+            pthread_mutex_unlock(&smp->lock);
+        }
+        ctx->quantum_left = smp->quantum ? smp->quantum : SMP_FREE_SLICE;
+    }
+    return !atomic_load_explicit(&smp->stop_all, memory_order_relaxed);
+}
+
+// takes what the slice retired off the quantum, and hands the turn to the
+// next hart still running once it is used up or this hart stopped
+static void smp_end_slice(exec_context *ctx, uint64_t retired, int keep_run) {
+    smp_state *smp = ctx->smp;
+    ctx->quantum_left -= retired;
+    if (keep_run && (ctx->quantum_left != 0 || smp->quantum == 0)) {
+        return;
+    }
+    if (ctx->fault != FAULT_NONE) {
+        smp_stop_all(smp);
+        return;
+    }
+    pthread_mutex_lock(&smp->lock);
+    smp->stopped[ctx->hart_id] = !keep_run;
+    for (int k = 1; k <= smp->hart_count; k++) {
+        int next = (ctx->hart_id + k) % smp->hart_count;
+        if (!smp->stopped[next]) {
+            smp->turn = next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&smp->turn_changed);
+    pthread_mutex_unlock(&smp->lock);
+}
+
+// --- Devices ---
+// a 16550-style UART, the timer registers of a CLINT and a tohost word
+// that ends the run, all of them in PAGE_DEVICE pages. UART output is
+// collected and written out in large blocks, input is read ahead the same
+// way. The simulator has no interrupts, so mtimecmp and msip only hold
+// what software writes there.
+#define UART_BASE 0x10000000u
+#define UART_THR 0 // transmit/receive register
+#define UART_LSR 5 // line status
+#define UART_SCR 7 // scratch
+#define UART_LSR_DATA_READY 0x01
+#define UART_LSR_TX_EMPTY 0x60 // holding register and transmitter both empty
+#define UART_BUFFER_SIZE (1u << 16)
+#define CLINT_BASE 0x02000000u
+#define CLINT_SIZE 0x10000u
+#define CLINT_MSIP 0x0000     // one word per hart
+#define CLINT_MTIMECMP 0x4000 // two words per hart
+#define CLINT_MTIME 0xBFF8
+#define CLINT_TICK_NS 100     // mtime runs at 10 MHz of host time
+#define TOHOST_DEFAULT 0x00100000u
+
+struct device_bus {
+    pthread_mutex_t lock; // harts share the devices
+    uint32_t tohost;      // address of the tohost word
+    int exited;           // tohost was written
+    uint32_t exit_code;
+    int in_fd;            // UART input, -1 = none
+    int out_fd;
+    int close_in;         // opened by us
+    int close_out;
+    uint32_t in_pos;
+    uint32_t in_length;
+    int in_eof;
+    uint32_t out_length;
+    uint8_t scratch;
+    uint32_t msip[MAX_HARTS];
+    uint64_t mtimecmp[MAX_HARTS];
+    int64_t mtime_offset; // what writes to mtime added, in ticks
+    struct timespec start;
+    uint8_t in_buffer[UART_BUFFER_SIZE];
+    uint8_t out_buffer[UART_BUFFER_SIZE];
+};
+
+// hands the collected UART output to the host in one write
+static void device_flush_locked(device_bus *bus) {
+    uint32_t done = 0;
+    while (done < bus->out_length) {
+        ssize_t written = write(bus->out_fd, bus->out_buffer + done, bus->out_length - done);
+        if (written <= 0) {
+            break; // nowhere to put it, the guest doesn't get to know
+        }
+        done += (uint32_t)written;
+    }
+    bus->out_length = 0;
+}
+
+void device_flush(device_bus *bus) {
+    pthread_mutex_lock(&bus->lock);
+    device_flush_locked(bus);
+    pthread_mutex_unlock(&bus->lock);
+}
+
+// 1 when a received byte is waiting, reads ahead as much as the host has
+static int uart_has_input(device_bus *bus) {
+    if (bus->in_pos < bus->in_length) {
+        return 1;
+    }
+    if (bus->in_fd < 0 || bus->in_eof) {
+        return 0;
+    }
+    // whatever the guest printed last is probably a prompt
+    device_flush_locked(bus);
+    ssize_t got = read(bus->in_fd, bus->in_buffer, UART_BUFFER_SIZE);
+    bus->in_pos = 0;
+    bus->in_length = (got > 0) ? (uint32_t)got : 0;
+    bus->in_eof = (got <= 0);
+    return got > 0;
+}
+
+static uint64_t clint_mtime(const device_bus *bus) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ns = (int64_t)(now.tv_sec - bus->start.tv_sec) * 1000000000 + (now.tv_nsec - bus->start.tv_nsec);
+    return (uint64_t)(ns / CLINT_TICK_NS + bus->mtime_offset);
+}
+
+// the CLINT word at offset, an offset that isn't a register reads 0
+static uint32_t clint_read(device_bus *bus, int harts, uint32_t offset) {
+    uint32_t hart = (offset - CLINT_MTIMECMP) / 8;
+    if (offset < CLINT_MSIP + 4 * (uint32_t)harts) {
+        return bus->msip[offset / 4];
+    }
+    if (offset >= CLINT_MTIMECMP && hart < (uint32_t)harts) {
+        return (uint32_t)(bus->mtimecmp[hart] >> ((offset & 4) * 8));
+    }
+    if (offset == CLINT_MTIME || offset == CLINT_MTIME + 4) {
+        return (uint32_t)(clint_mtime(bus) >> ((offset & 4) * 8));
+    }
+    return 0;
+}
+
+static void clint_write(device_bus *bus, int harts, uint32_t offset, uint32_t value) {
+    uint32_t hart = (offset - CLINT_MTIMECMP) / 8;
+    int shift = (offset & 4) * 8;
+    if (offset < CLINT_MSIP + 4 * (uint32_t)harts) {
+        bus->msip[offset / 4] = value & 1;
+    } else if (offset >= CLINT_MTIMECMP && hart < (uint32_t)harts) {
+        bus->mtimecmp[hart] = (bus->mtimecmp[hart] & ~((uint64_t)0xFFFFFFFF << shift)) | ((uint64_t)value << shift);
+    } else if (offset == CLINT_MTIME || offset == CLINT_MTIME + 4) {
+        uint64_t now = clint_mtime(bus);
+        uint64_t wanted = (now & ~((uint64_t)0xFFFFFFFF << shift)) | ((uint64_t)value << shift);
+        bus->mtime_offset += (int64_t)(wanted - now);
+    }
+}
+
+// a load from a device page, size bytes zero extended
+uint32_t device_read(exec_context *ctx, uint32_t address, uint32_t size) {
+    device_bus *bus = ctx->devices;
+    int harts = ctx->smp != NULL ? ctx->smp->hart_count : 1;
+    uint32_t value = 0;
+    pthread_mutex_lock(&bus->lock);
+    if (address - UART_BASE < 8) {
+        // byte registers, a wider access only reads the first one
+        switch (address - UART_BASE) {
+            case UART_THR:
+                if (uart_has_input(bus)) {
+                    value = bus->in_buffer[bus->in_pos++];
+                }
+                break;
+            case UART_LSR:
+                value = UART_LSR_TX_EMPTY | (uart_has_input(bus) ? UART_LSR_DATA_READY : 0);
+                break;
+            case UART_SCR:
+                value = bus->scratch;
+                break;
+        }
+    } else if (address - CLINT_BASE < CLINT_SIZE) {
+        uint32_t offset = address - CLINT_BASE;
+        value = clint_read(bus, harts, offset & ~3u) >> ((offset & 3) * 8);
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return size < 4 ? value & ((1u << (size * 8)) - 1) : value;
+}
+
+// a store to a device page, returns 0 when it ended the run
+int device_write(exec_context *ctx, uint32_t address, uint32_t size, uint32_t value) {
+    device_bus *bus = ctx->devices;
+    int harts = ctx->smp != NULL ? ctx->smp->hart_count : 1;
+    int keep_run = 1;
+    pthread_mutex_lock(&bus->lock);
+    if (address - UART_BASE < 8) {
+        if (address - UART_BASE == UART_THR) {
+            if (bus->out_length == UART_BUFFER_SIZE) {
+                device_flush_locked(bus);
+            }
+            bus->out_buffer[bus->out_length++] = (uint8_t)value;
+        } else if (address - UART_BASE == UART_SCR) {
+            bus->scratch = (uint8_t)value;
+        }
+    } else if (address - CLINT_BASE < CLINT_SIZE) {
+        // smaller stores change their bytes of the word
+        uint32_t offset = address - CLINT_BASE;
+        int shift = (offset & 3) * 8;
+        uint32_t mask = (size < 4 ? (1u << (size * 8)) - 1 : 0xFFFFFFFFu) << shift;
+        uint32_t word = clint_read(bus, harts, offset & ~3u);
+        clint_write(bus, harts, offset & ~3u, (word & ~mask) | ((value << shift) & mask));
+    } else if (address == bus->tohost && (value & 1)) {
+        // the riscv-tests convention: (code << 1) | 1, 0 is a pass
+        bus->exited = 1;
+        bus->exit_code = value >> 1;
+        keep_run = 0;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    if (!keep_run && ctx->smp != NULL) {
+        smp_stop_all(ctx->smp);
+    }
+    return keep_run;
+}
+
+// uart_in may be NULL for no input, uart_out NULL for stdout. Returns NULL
+// when a file can't be opened.
+device_bus *device_bus_create(const char *uart_in, const char *uart_out, uint32_t tohost) {
+    device_bus *bus = (device_bus *)calloc(1, sizeof(device_bus));
+    if (bus == NULL) {
+        fprintf(stderr, "Error allocating the devices\n");
+        return NULL;
+    }
+    bus->tohost = tohost;
+    bus->in_fd = -1;
+    bus->out_fd = STDOUT_FILENO;
+    if (uart_in != NULL) {
+        bus->in_fd = open(uart_in, O_RDONLY);
+        bus->close_in = 1;
+        if (bus->in_fd < 0) {
+            perror("Error opening the UART input");
+            free(bus);
+            return NULL;
+        }
+    }
+    if (uart_out != NULL) {
+        bus->out_fd = open(uart_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bus->close_out = 1;
+        if (bus->out_fd < 0) {
+            perror("Error opening the UART output");
+            if (bus->close_in) {
+                close(bus->in_fd);
+            }
+            free(bus);
+            return NULL;
+        }
+    }
+    if (pthread_mutex_init(&bus->lock, NULL) != 0) {
+        if (bus->close_in) {
+            close(bus->in_fd);
+        }
+        if (bus->close_out) {
+            close(bus->out_fd);
+        }
+        free(bus);
+        return NULL;
+    }
+    device_bus_reset(bus);
+    return bus;
+}
+
+void device_bus_destroy(device_bus *bus) {
+    device_flush(bus);
+    if (bus->close_in) {
+        close(bus->in_fd);
+    }
+    if (bus->close_out) {
+        close(bus->out_fd);
+    }
+    pthread_mutex_destroy(&bus->lock);
+    free(bus);
+}
+
+// registers back to their reset values, the output is flushed and input
+// that was read ahead stays for the next program
+void device_bus_reset(device_bus *bus) {
+    device_flush(bus);
+    bus->exited = 0;
+    bus->exit_code = 0;
+    bus->scratch = 0;
+    memset(bus->msip, 0, sizeof(bus->msip));
+    memset(bus->mtimecmp, 0xFF, sizeof(bus->mtimecmp));
+    bus->mtime_offset = 0;
+    clock_gettime(CLOCK_MONOTONIC, &bus->start);
+}
+
+// turns the device regions into device pages, over whatever was there
+void device_bus_map(const device_bus *bus, uint8_t *page_flags) {
+    map_pages(page_flags, UART_BASE, PAGE_SIZE, PAGE_DEVICE);
+    map_pages(page_flags, CLINT_BASE, CLINT_SIZE, PAGE_DEVICE);
+    map_pages(page_flags, bus->tohost & ~(PAGE_SIZE - 1), PAGE_SIZE, PAGE_DEVICE);
+}
+
+// --- Runner ---
+
+// which part of the run ends up in the trace file
+enum {
+    TRACE_FULL,    // every instruction, the default
+    TRACE_OFF,     // nothing
+    TRACE_RANGE,   // instructions number start up to, not including, end
+    TRACE_FROM_PC  // everything from the first time pc reaches an address
+};
+
+typedef struct {
+    int mode;
+    uint64_t start;
+    uint64_t end;
+    uint32_t pc;
+    int format; // TRACE_TEXT or TRACE_BINARY
+} trace_options;
+
+// when --checkpoint= saves the machine
+enum {
+    CHECKPOINT_NONE,
+    CHECKPOINT_AT_COUNT, // once that many instructions retired
+    CHECKPOINT_AT_EBREAK // when the program stops, pc already past the ebreak
+};
+
+typedef struct {
+    int mode;
+    uint64_t count;
+    const char *path;
+} checkpoint_options;
+
+// parses the value of --trace=, returns 0 on success
+int parse_trace_option(const char *value, trace_options *opts) {
+    char *end = NULL;
+
+    if (strcmp(value, "full") == 0) {
+        opts->mode = TRACE_FULL;
+    } else if (strcmp(value, "off") == 0) {
+        opts->mode = TRACE_OFF;
+    } else if (strncmp(value, "range:", 6) == 0) {
+        opts->mode = TRACE_RANGE;
+        opts->start = strtoull(value + 6, &end, 0);
+        if (end == value + 6 || *end != '-') {
+            return -1;
+        }
+        const char *second = end + 1;
+        opts->end = strtoull(second, &end, 0);
+        if (end == second || *end != '\0' || opts->end < opts->start) {
+            return -1;
+        }
+    } else if (strncmp(value, "pc:", 3) == 0) {
+        opts->mode = TRACE_FROM_PC;
+        opts->pc = (uint32_t)strtoul(value + 3, &end, 16);
+        if (end == value + 3 || *end != '\0' || (opts->pc & 1)) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// parses "<first>-<last>" of --slice= and --pcs=, returns 0 on success
+int parse_number_range(const char *value, int base, uint64_t *first, uint64_t *last) {
+    char *end = NULL;
+    *first = strtoull(value, &end, base);
+    if (end == value || *end != '-') {
+        return -1;
+    }
+    const char *second = end + 1;
+    *last = strtoull(second, &end, base);
+    if (end == second || *end != '\0' || *last < *first) {
+        return -1;
+    }
+    return 0;
+}
+
+// parses --mem-size=, a byte count with an optional K or M suffix that
+// has to be whole pages and fit above the start of RAM
+int parse_mem_size(const char *value, uint32_t mem_offset, uint32_t *size) {
+    char *end = NULL;
+    uint64_t bytes = strtoull(value, &end, 0);
+    if (end == value) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        bytes <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        bytes <<= 20;
+        end++;
+    }
+    if (*end != '\0' || bytes == 0 || (bytes & (PAGE_SIZE - 1)) != 0 || bytes > GUEST_SPACE_SIZE - mem_offset) {
+        return -1;
+    }
+    *size = (uint32_t)bytes;
+    return 0;
+}
+
+// the fast core with fused pairs and loop idioms, for a run that may have
+// to stop at an exact count or pc. A step of the fast loop retires one or
+// two instructions, plus whatever the loop idioms retire within their
+// budget. So it goes in chunks of a quarter of the instructions left with
+// a budget of half of them, which can't overshoot, and the last few run on
+// the exact core. Stopping at a pc has to look at every instruction, those
+// runs use neither.
+static int run_fused(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc) {
+    if (max_steps == UINT64_MAX && stop_pc == NO_STOP_PC) {
+        ctx->idiom_budget = UINT64_MAX;
+        return run_core_fast(ctx, max_steps, stop_pc);
+    }
+    if (stop_pc != NO_STOP_PC) {
+        return run_core_exact(ctx, max_steps, stop_pc);
+    }
+    while (max_steps >= 4) {
+        uint64_t before = ctx->instret;
+        ctx->idiom_budget = max_steps / 2;
+        if (!run_core_fast(ctx, max_steps / 4, NO_STOP_PC)) {
+            return 0;
+        }
+        max_steps -= ctx->instret - before;
+    }
+    return (max_steps != 0) ? run_core_exact(ctx, max_steps, NO_STOP_PC) : 1;
+}
+
+// untraced execution goes through the block engine when it is enabled,
+// unless a timing or pipeline model has to see every instruction
+static int run_untraced(exec_context *ctx, uint64_t max_steps, uint32_t stop_pc) {
+    if (ctx->timing != NULL || ctx->pipeline != NULL) {
+        return run_core_observed(ctx, max_steps, stop_pc);
+    }
+    if (ctx->blocks != NULL) {
+        return run_blocks(ctx, max_steps, stop_pc);
+    }
+    if (ctx->profile != NULL) {
+        return run_core_observed(ctx, max_steps, stop_pc);
+    }
+    return run_fused(ctx, max_steps, stop_pc);
+}
+
+// runs the program until ebreak, using the traced core only inside the
+// requested window and the untraced one everywhere else. The trace window
+// counts from the first instruction of the program, restored runs included.
+// Harts of an SMP machine run in slices that follow the quantum.
+// Returns 0 unless saving the checkpoint failed.
+int run_simulation(exec_context *ctx, const trace_options *opts, const checkpoint_options *cp) {
+    int keep_run = 1;
+    int pc_reached = 0; // TRACE_FROM_PC has seen its address
+    int checkpoint_due = (cp->mode == CHECKPOINT_AT_COUNT);
+
+    while (keep_run) {
+        uint64_t max_steps = UINT64_MAX;
+        uint32_t stop_pc = NO_STOP_PC;
+        int traced = 0;
+
+        switch (opts->mode) {
+            case TRACE_FULL:
+                traced = 1;
+                break;
+            case TRACE_OFF:
+                break;
+            case TRACE_RANGE:
+                if (ctx->instret < opts->start) {
+                    max_steps = opts->start - ctx->instret;
+                } else if (ctx->instret < opts->end) {
+                    traced = 1;
+                    max_steps = opts->end - ctx->instret;
+                }
+                break;
+            case TRACE_FROM_PC:
+                pc_reached |= (ctx->pc == opts->pc);
+                traced = pc_reached;
+                if (!pc_reached) {
+                    stop_pc = opts->pc;
+                }
+                break;
+        }
+
+        if (checkpoint_due) {
+            if (ctx->instret >= cp->count) {
+                checkpoint_due = 0;
+                if (checkpoint_save(cp->path, ctx) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (cp->count - ctx->instret < max_steps) {
+                max_steps = cp->count - ctx->instret;
+            }
+        }
+
+        if (ctx->smp != NULL) {
+            if (!smp_begin_slice(ctx)) {
+                break;
+            }
+            if (ctx->quantum_left < max_steps) {
+                max_steps = ctx->quantum_left;
+            }
+        }
+
+        uint64_t before = ctx->instret;
+        keep_run = traced ? run_core_traced(ctx, max_steps, stop_pc) : run_untraced(ctx, max_steps, stop_pc);
+
+        if (ctx->smp != NULL) {
+            smp_end_slice(ctx, ctx->instret - before, keep_run);
+        }
+    }
+
+    // a faulting run has nothing worth restoring
+    if ((cp->mode == CHECKPOINT_AT_EBREAK || checkpoint_due) && ctx->fault == FAULT_NONE) {
+        return checkpoint_save(cp->path, ctx);
+    }
+    return 0;
+}
+
+// --- Machine ---
+// one simulated machine: its harts and the memory and caches they use. A
+// machine can be reset and reused, which is what the batch runner does
+// with one machine per worker.
+
+typedef struct {
+    uint32_t mem_size;
+    int image_format;
+    int use_blocks;
+    int use_jit;
+    uint64_t jit_threshold;
+    int harts;
+    uint64_t quantum; // instructions per turn with several harts, 0 = free running
+    int profile;      // every hart keeps a guest profile
+    int use_timing;   // every hart runs its own timing model
+    timing_config timing;
+    int use_pipeline; // and its own pipeline model
+    uint32_t mul_cycles;
+    uint32_t div_cycles;
+    int use_devices;      // UART, CLINT and tohost
+    const char *uart_in;  // file the UART reads, NULL for none
+    const char *uart_out; // file the UART writes, NULL for stdout
+    uint32_t tohost;
+} machine_config;
+
+typedef struct {
+    exec_context harts[MAX_HARTS]; // all of them share the memory of harts[0]
+    int hart_count;
+    machine_config config;
+    size_t decode_cache_size; // bytes mapped for each hart's decode cache
+    smp_state smp;
+    device_bus *devices;
+} machine;
+
+// the decode caches get their own mappings so a reset can hand their
+// pages back to the host instead of clearing them. Every hart has its own
+// caches, they only ever see the code it fetched.
+static int machine_alloc_caches(machine *m) {
+    m->decode_cache_size = (size_t)(m->config.mem_size / 4) * sizeof(decoded_instr);
+    for (int i = 0; i < m->hart_count; i++) {
+        exec_context *ctx = &m->harts[i];
+        void *cache = mmap(NULL, m->decode_cache_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (cache == MAP_FAILED) {
+            fprintf(stderr, "Error allocating the decode cache\n");
+            return -1;
+        }
+        ctx->decode_cache = (decoded_instr *)cache;
+        ctx->mem_size = m->config.mem_size;
+
+        if (m->config.use_blocks) {
+            ctx->blocks = block_cache_create(m->config.mem_size);
+            if (ctx->blocks == NULL) {
+                fprintf(stderr, "Error allocating the block cache\n");
+                return -1;
+            }
+            if (m->config.use_jit && !jit_enable(ctx->blocks, m->config.jit_threshold)) {
+                fprintf(stderr, "The JIT needs an x86-64 host with executable memory\n");
+                return -1;
+            }
+        }
+        if (m->config.profile) {
+            ctx->profile = profile_create(m->config.mem_size);
+            if (ctx->profile == NULL) {
+                fprintf(stderr, "Error allocating the profile\n");
+                return -1;
+            }
+        }
+        if (m->config.use_timing) {
+            ctx->timing = timing_create(&m->config.timing);
+            if (ctx->timing == NULL) {
+                fprintf(stderr, "Error allocating the timing model\n");
+                return -1;
+            }
+        }
+        if (m->config.use_pipeline) {
+            ctx->pipeline = pipeline_create(ctx->mem_offset, m->config.mem_size, m->config.mul_cycles, m->config.div_cycles);
+            if (ctx->pipeline == NULL) {
+                fprintf(stderr, "Error allocating the pipeline model\n");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void machine_free_caches(machine *m) {
+    for (int i = 0; i < m->hart_count; i++) {
+        exec_context *ctx = &m->harts[i];
+        if (ctx->decode_cache != NULL) {
+            munmap(ctx->decode_cache, m->decode_cache_size);
+            ctx->decode_cache = NULL;
+        }
+        if (ctx->blocks != NULL) {
+            block_cache_destroy(ctx->blocks);
+            ctx->blocks = NULL;
+        }
+        if (ctx->profile != NULL) {
+            profile_destroy(ctx->profile);
+            ctx->profile = NULL;
+        }
+        if (ctx->timing != NULL) {
+            timing_destroy(ctx->timing);
+            ctx->timing = NULL;
+        }
+        if (ctx->pipeline != NULL) {
+            pipeline_destroy(ctx->pipeline);
+            ctx->pipeline = NULL;
+        }
+    }
+}
+
+void machine_destroy(machine *m) {
+    machine_free_caches(m);
+    free(m->harts[0].page_flags);
+    if (m->harts[0].memory != NULL) {
+        guest_memory_destroy(m->harts[0].memory);
+    }
+    if (m->harts[0].smp != NULL) {
+        smp_destroy(&m->smp);
+    }
+    if (m->devices != NULL) {
+        device_bus_destroy(m->devices);
+    }
+}
+
+// architectural state of hart i right after reset, a0 holds its id
+static void machine_reset_hart(machine *m, int i) {
+    exec_context *ctx = &m->harts[i];
+    memset(ctx->registers, 0, sizeof(ctx->registers));
+    ctx->registers[10] = (uint32_t)i;
+    ctx->pc = ctx->mem_offset;
+    ctx->instret = 0;
+    memset(ctx->fused, 0, sizeof(ctx->fused));
+    memset(ctx->idioms, 0, sizeof(ctx->idioms));
+    ctx->idiom_insns = 0;
+    ctx->fault = FAULT_NONE;
+    ctx->fault_address = 0;
+    ctx->reservation = RESERVATION_NONE;
+    ctx->quantum_left = 0;
+}
+
+// returns 0 on success, the machine starts out empty with nothing mapped
+int machine_init(machine *m, const machine_config *config) {
+    memset(m, 0, sizeof(*m));
+    m->config = *config;
+    m->hart_count = config->harts;
+    exec_context *boot = &m->harts[0];
+    boot->memory = guest_memory_create();
+    boot->page_flags = (uint8_t *)calloc(PAGE_COUNT, 1);
+    if (boot->memory == NULL || boot->page_flags == NULL) {
+        fprintf(stderr, "Error reserving guest memory\n");
+        machine_destroy(m);
+        return -1;
+    }
+    if (m->hart_count > 1 && smp_init(&m->smp, m->hart_count, config->quantum) != 0) {
+        fprintf(stderr, "Error setting up the harts\n");
+        machine_destroy(m);
+        return -1;
+    }
+    if (config->use_devices && (m->devices = device_bus_create(config->uart_in, config->uart_out, config->tohost)) == NULL) {
+        machine_destroy(m);
+        return -1;
+    }
+    for (int i = 0; i < m->hart_count; i++) {
+        exec_context *ctx = &m->harts[i];
+        ctx->memory = boot->memory;
+        ctx->page_flags = boot->page_flags;
+        // memory starts at 0x80000000 for this simulator
+        ctx->mem_offset = 0x80000000;
+        ctx->hart_id = i;
+        ctx->smp = (m->hart_count > 1) ? &m->smp : NULL;
+        ctx->devices = m->devices;
+        machine_reset_hart(m, i);
+    }
+    if (machine_alloc_caches(m) != 0) {
+        machine_destroy(m);
+        return -1;
+    }
+    return 0;
+}
+
+// brings the machine back to its state right after machine_init, keeping
+// the reservations so the next program doesn't pay for them again
+void machine_reset(machine *m) {
+    guest_memory_clear(m->harts[0].memory);
+    memset(m->harts[0].page_flags, 0, PAGE_COUNT);
+    for (int i = 0; i < m->hart_count; i++) {
+        exec_context *ctx = &m->harts[i];
+        madvise(ctx->decode_cache, m->decode_cache_size, MADV_DONTNEED);
+        if (ctx->blocks != NULL) {
+            block_cache_reset(ctx);
+        }
+        if (ctx->profile != NULL) {
+            profile_reset(ctx->profile);
+        }
+        if (ctx->timing != NULL) {
+            timing_reset(ctx->timing);
+        }
+        if (ctx->pipeline != NULL) {
+            pipeline_reset(ctx->pipeline);
+        }
+        machine_reset_hart(m, i);
+    }
+    if (m->hart_count > 1) {
+        smp_reset(&m->smp);
+    }
+    if (m->devices != NULL) {
+        device_bus_reset(m->devices);
+    }
+}
+
+// maps RAM and loads a program file into it, every hart starts at its entry
+int machine_load(machine *m, const char *path) {
+    exec_context *boot = &m->harts[0];
+    map_pages(boot->page_flags, boot->mem_offset, boot->mem_size, PAGE_R | PAGE_W | PAGE_X);
+    if (load_image(path, m->config.image_format, boot->memory, boot->page_flags, boot->mem_offset, &boot->pc) != 0) {
+        return -1;
+    }
+    if (m->devices != NULL) {
+        device_bus_map(m->devices, boot->page_flags);
+    }
+    for (int i = 1; i < m->hart_count; i++) {
+        m->harts[i].pc = boot->pc;
+    }
+    return 0;
+}
+
+// loads a checkpoint, the caches follow the RAM size it was taken with.
+// Checkpoints hold a single hart.
+int machine_restore(machine *m, const char *path) {
+    if (m->hart_count != 1) {
+        fprintf(stderr, "Checkpoints only work with a single hart\n");
+        return -1;
+    }
+    if (checkpoint_restore(path, &m->harts[0]) != 0) {
+        return -1;
+    }
+    if (m->devices != NULL) {
+        device_bus_map(m->devices, m->harts[0].page_flags);
+    }
+    if (m->harts[0].mem_size != m->config.mem_size) {
+        m->config.mem_size = m->harts[0].mem_size;
+        machine_free_caches(m);
+        return machine_alloc_caches(m);
+    }
+    return 0;
+}
+
+// instructions retired by all the harts together
+uint64_t machine_instret(const machine *m) {
+    uint64_t total = 0;
+    for (int i = 0; i < m->hart_count; i++) {
+        total += m->harts[i].instret;
+    }
+    return total;
+}
+
+// one hart's share of machine_run
+typedef struct {
+    exec_context *ctx;
+    char *output_path;
+    const trace_options *trace_opts;
+    const checkpoint_options *checkpoint_opts;
+    int status; // same meaning as the machine_run result
+    pthread_t thread;
+} hart_run;
+
+static void *hart_run_main(void *arg) {
+    hart_run *run = (hart_run *)arg;
+    exec_context *ctx = run->ctx;
+    run->status = -1;
+    FILE *output_file = fopen(run->output_path, "w");
+    if (output_file == NULL) {
+        perror("Error opening output file");
+        if (ctx->smp != NULL) {
+            smp_stop_all(ctx->smp);
+        }
+        return NULL;
+    }
+
+    // the trace is written by its own thread while we simulate
+    trace_writer trace;
+    int tracing = (run->trace_opts->mode != TRACE_OFF);
+    if (tracing && trace_writer_start(&trace, output_file, run->trace_opts->format) != 0) {
+        fprintf(stderr, "Error starting the trace writer\n");
+        fclose(output_file);
+        if (ctx->smp != NULL) {
+            smp_stop_all(ctx->smp);
+        }
+        return NULL;
+    }
+    ctx->trace = tracing ? &trace : NULL;
+    if (ctx->profile != NULL) {
+        profile_start(ctx);
+    }
+
+    int checkpoint_failed = run_simulation(ctx, run->trace_opts, run->checkpoint_opts) != 0;
+
+    if (tracing) {
+        trace_writer_finish(&trace);
+    }
+    ctx->trace = NULL;
+    fclose(output_file);
+
+    if (!checkpoint_failed) {
+        run->status = (ctx->fault != FAULT_NONE) ? 1 : 0;
+    }
+    return NULL;
+}
+
+// runs the loaded program, hart 0 writes its trace to output_path and
+// hart i to "<output_path>.hart<i>". Returns 0 when every hart ended in
+// ebreak, 1 on a memory fault and -1 on host errors.
+int machine_run(machine *m, const char *output_path, const trace_options *trace_opts, const checkpoint_options *checkpoint_opts) {
+    hart_run runs[MAX_HARTS];
+    size_t path_size = strlen(output_path) + 16;
+    int prepared = 0;
+    int status = 0;
+
+    for (int i = 0; i < m->hart_count; i++) {
+        hart_run *run = &runs[i];
+        run->ctx = &m->harts[i];
+        run->output_path = (char *)malloc(path_size);
+        run->trace_opts = trace_opts;
+        run->checkpoint_opts = checkpoint_opts;
+        run->status = -1;
+        if (run->output_path == NULL) {
+            status = -1;
+            break;
+        }
+        if (i == 0) {
+            snprintf(run->output_path, path_size, "%s", output_path);
+        } else {
+            snprintf(run->output_path, path_size, "%s.hart%d", output_path, i);
+        }
+        prepared++;
+    }
+
+    if (status == 0 && m->hart_count == 1) {
+        hart_run_main(&runs[0]);
+    } else if (status == 0) {
+        // one host thread per hart, the ones that never started keep status -1
+        int started = 0;
+        for (; started < m->hart_count; started++) {
+            if (pthread_create(&runs[started].thread, NULL, hart_run_main, &runs[started]) != 0) {
+                fprintf(stderr, "Error starting hart %d\n", started);
+                smp_stop_all(&m->smp);
+                break;
+            }
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(runs[i].thread, NULL);
+        }
+    }
+
+    for (int i = 0; i < prepared; i++) {
+        if (runs[i].status < 0) {
+            status = -1;
+        } else if (status == 0) {
+            status = runs[i].status;
+        }
+        free(runs[i].output_path);
+    }
+    if (m->devices != NULL) {
+        device_flush(m->devices);
+    }
+    return status;
+}
+
+// --- Batch runner ---
+// runs every job of a manifest ("<input> <output>" per line) on a pool of
+// worker threads. Each worker starts with an even slice of the jobs and
+// steals from the back of the others' slices once its own runs out. Every
+// worker keeps one machine and resets it between jobs.
+
+typedef struct {
+    char *input_path;
+    char *output_path;
+    int status;            // machine_run result, -1 also for load errors
+    uint32_t exit_code;    // code written to tohost, 0 when it never exited
+    uint64_t instret;
+    double seconds;
+} batch_job;
+
+// a worker's slice of the job array, head in the low half and tail in the
+// high half so the owner and thieves claim jobs with a single CAS
+typedef struct {
+    _Alignas(64) _Atomic uint64_t range;
+} batch_queue;
+
+typedef struct {
+    batch_job *jobs;
+    batch_queue *queues;
+    int workers;
+    const machine_config *config;
+    const trace_options *trace_opts;
+} batch_pool;
+
+typedef struct {
+    batch_pool *pool;
+    int id;
+} batch_worker;
+
+static int batch_take_own(batch_queue *q, uint32_t *job) {
+    uint64_t range = atomic_load_explicit(&q->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t head = (uint32_t)range;
+        uint32_t tail = (uint32_t)(range >> 32);
+        if (head >= tail) {
+            return 0;
+        }
+        uint64_t next = ((uint64_t)tail << 32) | (head + 1);
+        if (atomic_compare_exchange_weak_explicit(&q->range, &range, next, memory_order_acq_rel, memory_order_relaxed)) {
+            *job = head;
+            return 1;
+        }
+    }
+}
+
+static int batch_steal(batch_queue *q, uint32_t *job) {
+    uint64_t range = atomic_load_explicit(&q->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t head = (uint32_t)range;
+        uint32_t tail = (uint32_t)(range >> 32);
+        if (head >= tail) {
+            return 0;
+        }
+        uint64_t next = ((uint64_t)(tail - 1) << 32) | head;
+        if (atomic_compare_exchange_weak_explicit(&q->range, &range, next, memory_order_acq_rel, memory_order_relaxed)) {
+            *job = tail - 1;
+            return 1;
+        }
+    }
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void *batch_worker_main(void *arg) {
+    batch_worker *w = (batch_worker *)arg;
+    batch_pool *pool = w->pool;
+    const checkpoint_options no_checkpoint = {CHECKPOINT_NONE, 0, NULL};
+    machine m;
+    int used = 0;
+
+    if (machine_init(&m, pool->config) != 0) {
+        // the other workers will steal this one's jobs
+        return NULL;
+    }
+
+    for (;;) {
+        uint32_t index;
+        int found = batch_take_own(&pool->queues[w->id], &index);
+        for (int k = 1; !found && k < pool->workers; k++) {
+            found = batch_steal(&pool->queues[(w->id + k) % pool->workers], &index);
+        }
+        if (!found) {
+            break;
+        }
+
+        batch_job *job = &pool->jobs[index];
+        double start = monotonic_seconds();
+        if (used) {
+            machine_reset(&m);
+        }
+        used = 1;
+        if (machine_load(&m, job->input_path) != 0) {
+            job->status = -1;
+        } else {
+            job->status = machine_run(&m, job->output_path, pool->trace_opts, &no_checkpoint);
+        }
+        job->exit_code = (m.devices != NULL && m.devices->exited) ? m.devices->exit_code : 0;
+        job->instret = machine_instret(&m);
+        job->seconds = monotonic_seconds() - start;
+    }
+
+    machine_destroy(&m);
+    return NULL;
+}
+
+// frees a job list together with the paths of its jobs
+static void free_jobs(batch_job *jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].input_path);
+        free(jobs[i].output_path);
+    }
+    free(jobs);
+}
+
+// reads the manifest, returns the number of jobs or -1 on errors
+static int read_manifest(const char *path, batch_job **jobs_out) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening batch manifest");
+        return -1;
+    }
+    batch_job *jobs = NULL;
+    int count = 0;
+    int capacity = 0;
+    int failed = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int line_number = 0;
+
+    while (getline(&line, &line_capacity, file) != -1) {
+        line_number++;
+        char *input = strtok(line, " \t\r\n");
+        if (input == NULL || input[0] == '#') {
+            continue;
+        }
+        char *output = strtok(NULL, " \t\r\n");
+        if (output == NULL) {
+            fprintf(stderr, "%s:%d: expected an input and an output file\n", path, line_number);
+            failed = 1;
+            break;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            batch_job *grown = (batch_job *)realloc(jobs, (size_t)capacity * sizeof(batch_job));
+            if (grown == NULL) {
+                fprintf(stderr, "Error allocating the job list\n");
+                failed = 1;
+                break;
+            }
+            jobs = grown;
+        }
+        batch_job *job = &jobs[count++];
+        memset(job, 0, sizeof(*job));
+        job->status = -1; // until a worker runs it
+        job->input_path = strdup(input);
+        job->output_path = strdup(output);
+        if (job->input_path == NULL || job->output_path == NULL) {
+            fprintf(stderr, "Error allocating the job list\n");
+            failed = 1;
+            break;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    if (failed) {
+        free_jobs(jobs, count);
+        return -1;
+    }
+    *jobs_out = jobs;
+    return count;
+}
+
+// runs the manifest and prints one summary line per job in manifest
+// order. Returns 0 when every job ended in ebreak or exited with code 0.
+int run_batch(const char *manifest_path, int workers, const machine_config *config, const trace_options *trace_opts) {
+    static const char *const status_label[] = {"error", "ok", "fault"};
+    batch_job *jobs = NULL;
+    int count = read_manifest(manifest_path, &jobs);
+    if (count < 0) {
+        return -1;
+    }
+    if (workers > count) {
+        workers = count > 0 ? count : 1;
+    }
+
+    batch_pool pool = {jobs, NULL, workers, config, trace_opts};
+    pool.queues = (batch_queue *)aligned_alloc(64, (size_t)workers * sizeof(batch_queue));
+    pthread_t *threads = (pthread_t *)malloc((size_t)workers * sizeof(pthread_t));
+    batch_worker *args = (batch_worker *)malloc((size_t)workers * sizeof(batch_worker));
+    if (pool.queues == NULL || threads == NULL || args == NULL) {
+        fprintf(stderr, "Error allocating the worker pool\n");
+        free(args);
+        free(threads);
+        free(pool.queues);
+        free_jobs(jobs, count);
+        return -1;
+    }
+    for (int i = 0; i < workers; i++) {
+        uint64_t head = (uint64_t)count * i / workers;
+        uint64_t tail = (uint64_t)count * (i + 1) / workers;
+        atomic_init(&pool.queues[i].range, (tail << 32) | head);
+    }
+
+    double start = monotonic_seconds();
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        args[i].pool = &pool;
+        args[i].id = i;
+        if (pthread_create(&threads[i], NULL, batch_worker_main, &args[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    // if threads ran out, the running workers steal the rest
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = monotonic_seconds() - start;
+
+    int failed = 0;
+    uint64_t total_instret = 0;
+    printf("# status  exit  instructions  seconds  input\n");
+    for (int i = 0; i < count; i++) {
+        failed += (jobs[i].status != 0 || jobs[i].exit_code != 0);
+        total_instret += jobs[i].instret;
+        printf("%-6s  %4u  %12llu  %8.4f  %s\n", status_label[jobs[i].status + 1], jobs[i].exit_code,
+               (unsigned long long)jobs[i].instret, jobs[i].seconds, jobs[i].input_path);
+    }
+    printf("# %d jobs, %d failed, %llu instructions in %.3f s on %d workers\n", count, failed,
+           (unsigned long long)total_instret, seconds, started);
+
+    free_jobs(jobs, count);
+    free(args);
+    free(threads);
+    free(pool.queues);
+    return failed ? 1 : 0;
+}
+
+// --- Library API ---
+// the rvsim_ functions of riscv_sim.h. A library machine is a machine with
+// one hart. It runs on the untraced engines until a trace callback or a
+// memory watch wants to see instructions, then one instruction at a time
+// on the traced core, whose records go to a ring that is emptied into the
+// callbacks right after every step.
+
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    int access;
+    rvsim_memory_fn fn; // NULL for a free slot
+    void *user;
+} rvsim_watch_slot;
+
+struct rvsim {
+    machine m;
+    trace_writer trace; // only the ring, there is no writer thread
+    rvsim_ebreak_fn on_ebreak;
+    void *ebreak_user;
+    rvsim_trace_fn on_trace;
+    void *trace_user;
+    rvsim_watch_slot watches[RVSIM_MAX_WATCHES];
+    int watch_count;
+};
+
+// same as machine_load for an image already in host memory
+static int machine_load_data(machine *m, const uint8_t *data, size_t length, int format) {
+    exec_context *boot = &m->harts[0];
+    map_pages(boot->page_flags, boot->mem_offset, boot->mem_size, PAGE_R | PAGE_W | PAGE_X);
+    if (load_image_data(data, length, format, boot->memory, boot->page_flags, boot->mem_offset, &boot->pc) != 0) {
+        return -1;
+    }
+    if (m->devices != NULL) {
+        device_bus_map(m->devices, boot->page_flags);
+    }
+    return 0;
+}
+
+void rvsim_default_config(rvsim_config *config) {
+    config->mem_size = 16u << 20;
+    config->engine = RVSIM_ENGINE_INTERP;
+    config->jit_threshold = 16;
+}
+
+rvsim *rvsim_create(const rvsim_config *config) {
+    if (config->mem_size == 0 || (config->mem_size & (PAGE_SIZE - 1)) != 0 || config->mem_size > 0x80000000u ||
+        config->engine < RVSIM_ENGINE_INTERP || config->engine > RVSIM_ENGINE_JIT || config->jit_threshold == 0) {
+        return NULL;
+    }
+    machine_config mc = {config->mem_size, IMAGE_AUTO, config->engine != RVSIM_ENGINE_INTERP, config->engine == RVSIM_ENGINE_JIT,
+                         config->jit_threshold, 1, 0, 0, 0, TIMING_DEFAULT_CONFIG, 0, 3, 20, 0, NULL, NULL, 0};
+    rvsim *sim = (rvsim *)calloc(1, sizeof(rvsim));
+    if (sim == NULL) {
+        return NULL;
+    }
+    if (machine_init(&sim->m, &mc) != 0) {
+        free(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+void rvsim_destroy(rvsim *sim) {
+    if (sim == NULL) {
+        return;
+    }
+    machine_destroy(&sim->m);
+    free(sim->trace.ring);
+    free(sim);
+}
+
+void rvsim_reset(rvsim *sim) {
+    machine_reset(&sim->m);
+}
+
+int rvsim_load(rvsim *sim, const void *image, size_t size, int format) {
+    if (format < RVSIM_IMAGE_AUTO || format > RVSIM_IMAGE_BIN) {
+        return -1;
+    }
+    return machine_load_data(&sim->m, (const uint8_t *)image, size, format);
+}
+
+// calls the watches an access overlaps, returns RVSIM_STOP if one of them did
+static int rvsim_watch_access(rvsim *sim, int access, uint32_t address, uint32_t size, uint32_t value) {
+    int verdict = RVSIM_CONTINUE;
+    if (size < 4) {
+        value &= (1u << (size * 8)) - 1;
+    }
+    for (int i = 0; i < sim->watch_count; i++) {
+        rvsim_watch_slot *w = &sim->watches[i];
+        if (w->fn != NULL && (w->access & access) && (uint64_t)address < (uint64_t)w->address + w->size &&
+            (uint64_t)w->address < (uint64_t)address + size) {
+            verdict |= w->fn(sim, access, address, size, value, w->user);
+        }
+    }
+    return verdict;
+}
+
+// the memory accesses of one record, as its handler traced them
+static int rvsim_watch_record(rvsim *sim, const trace_record *r) {
+    decoded_instr d;
+    decode_instruction(r->raw, &d);
+    switch (d.op) {
+        case OP_LB: case OP_LBU: return rvsim_watch_access(sim, RVSIM_READ, r->address, 1, r->result);
+        case OP_LH: case OP_LHU: return rvsim_watch_access(sim, RVSIM_READ, r->address, 2, r->result);
+        case OP_LW: case OP_LR_W: return rvsim_watch_access(sim, RVSIM_READ, r->address, 4, r->result);
+        case OP_SB: return rvsim_watch_access(sim, RVSIM_WRITE, r->address, 1, r->rs2_val);
+        case OP_SH: return rvsim_watch_access(sim, RVSIM_WRITE, r->address, 2, r->rs2_val);
+        case OP_SW: return rvsim_watch_access(sim, RVSIM_WRITE, r->address, 4, r->rs2_val);
+        case OP_SC_W:
+            // a failed sc.w (result 1) writes nothing
+            return r->result == 0 ? rvsim_watch_access(sim, RVSIM_WRITE, r->address, 4, r->rs2_val) : RVSIM_CONTINUE;
+        default:
+            if (d.op >= OP_AMOSWAP_W && d.op <= OP_AMOMAXU_W) {
+                return rvsim_watch_access(sim, RVSIM_READ, r->address, 4, r->result) |
+                       rvsim_watch_access(sim, RVSIM_WRITE, r->address, 4, amo_result(d.op, r->result, r->rs2_val));
+            }
+            return RVSIM_CONTINUE;
+    }
+}
+
+// hands the queued records to the callbacks, returns RVSIM_STOP if one of
+// them asked for it
+static int rvsim_deliver(rvsim *sim) {
+    trace_writer *tw = &sim->trace;
+    uint32_t head = atomic_load_explicit(&tw->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&tw->tail, memory_order_relaxed);
+    int verdict = RVSIM_CONTINUE;
+    for (; tail != head; tail++) {
+        const trace_record *r = &tw->ring[tail & (TRACE_RING_SIZE - 1)];
+        if (sim->on_trace != NULL) {
+            rvsim_record record = {r->pc, r->raw, r->rs1_val, r->rs2_val, r->result, r->address};
+            verdict |= sim->on_trace(sim, &record, sim->trace_user);
+        }
+        if (sim->watch_count != 0) {
+            verdict |= rvsim_watch_record(sim, r);
+        }
+    }
+    atomic_store_explicit(&tw->tail, tail, memory_order_relaxed);
+    return verdict;
+}
+
+int rvsim_run(rvsim *sim, uint64_t max_instructions) {
+    exec_context *ctx = &sim->m.harts[0];
+    uint64_t end = (max_instructions > UINT64_MAX - ctx->instret) ? UINT64_MAX : ctx->instret + max_instructions;
+    ctx->fault = FAULT_NONE;
+
+    while (ctx->instret < end) {
+        int observed = (sim->on_trace != NULL || sim->watch_count != 0);
+        if (observed && sim->trace.ring == NULL) {
+            sim->trace.ring = (trace_record *)malloc(TRACE_RING_SIZE * sizeof(trace_record));
+            if (sim->trace.ring == NULL) {
+                observed = 0; // nothing to hand them, run as if they weren't there
+            }
+        }
+
+        int keep_run;
+        int verdict = RVSIM_CONTINUE;
+        if (observed) {
+            ctx->trace = &sim->trace;
+            keep_run = run_core_traced(ctx, 1, NO_STOP_PC);
+            ctx->trace = NULL;
+            verdict = rvsim_deliver(sim);
+        } else {
+            keep_run = run_untraced(ctx, end - ctx->instret, NO_STOP_PC);
+        }
+
+        if (!keep_run) {
+            if (ctx->fault != FAULT_NONE) {
+                return RVSIM_FAULT;
+            }
+            if (verdict != RVSIM_CONTINUE || sim->on_ebreak == NULL || sim->on_ebreak(sim, sim->ebreak_user) != RVSIM_CONTINUE) {
+                return RVSIM_EBREAK;
+            }
+        } else if (verdict != RVSIM_CONTINUE) {
+            return RVSIM_STOPPED;
+        }
+    }
+    return RVSIM_LIMIT;
+}
+
+int rvsim_step(rvsim *sim) {
+    return rvsim_run(sim, 1);
+}
+
+uint32_t rvsim_get_reg(const rvsim *sim, int reg) {
+    return (reg >= 0 && reg < 32) ? sim->m.harts[0].registers[reg] : 0;
+}
+
+void rvsim_set_reg(rvsim *sim, int reg, uint32_t value) {
+    if (reg > 0 && reg < 32) {
+        sim->m.harts[0].registers[reg] = value;
+    }
+}
+
+uint32_t rvsim_get_pc(const rvsim *sim) {
+    return sim->m.harts[0].pc;
+}
+
+void rvsim_set_pc(rvsim *sim, uint32_t pc) {
+    sim->m.harts[0].pc = pc;
+}
+
+uint64_t rvsim_instret(const rvsim *sim) {
+    return sim->m.harts[0].instret;
+}
+
+uint32_t rvsim_fault_address(const rvsim *sim) {
+    return sim->m.harts[0].fault_address;
+}
+
+// 1 when every page of the range is mapped and it doesn't wrap around
+static int rvsim_mapped(const rvsim *sim, uint32_t address, size_t size) {
+    if (size > GUEST_SPACE_SIZE - address) {
+        return 0;
+    }
+    const uint8_t *page_flags = sim->m.harts[0].page_flags;
+    for (uint64_t page = address >> PAGE_SHIFT; size != 0 && page <= (address + size - 1) >> PAGE_SHIFT; page++) {
+        if (page_flags[page] == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int rvsim_read_mem(const rvsim *sim, uint32_t address, void *buffer, size_t size) {
+    if (!rvsim_mapped(sim, address, size)) {
+        return -1;
+    }
+    memcpy(buffer, sim->m.harts[0].memory + address, size);
+    return 0;
+}
+
+int rvsim_write_mem(rvsim *sim, uint32_t address, const void *buffer, size_t size) {
+    exec_context *ctx = &sim->m.harts[0];
+    if (size > UINT32_MAX || !rvsim_mapped(sim, address, size)) {
+        return -1;
+    }
+    memcpy(ctx->memory + address, buffer, size);
+    // only code that was decoded gets dropped, data pages stay untouched
+    invalidate_decoded_range(ctx, address, (uint32_t)size);
+    return 0;
+}
+
+void rvsim_map(rvsim *sim, uint32_t address, uint32_t size, int access) {
+    exec_context *ctx = &sim->m.harts[0];
+    map_pages(ctx->page_flags, address, size, (uint8_t)(access & (PAGE_R | PAGE_W | PAGE_X)));
+    // decoded code only had its fetch checked once
+    drop_decoded(ctx);
+}
+
+void rvsim_on_ebreak(rvsim *sim, rvsim_ebreak_fn fn, void *user) {
+    sim->on_ebreak = fn;
+    sim->ebreak_user = user;
+}
+
+void rvsim_on_trace(rvsim *sim, rvsim_trace_fn fn, void *user) {
+    sim->on_trace = fn;
+    sim->trace_user = user;
+}
+
+int rvsim_watch(rvsim *sim, uint32_t address, uint32_t size, int access, rvsim_memory_fn fn, void *user) {
+    if (fn == NULL || size == 0) {
+        return -1;
+    }
+    for (int i = 0; i < RVSIM_MAX_WATCHES; i++) {
+        rvsim_watch_slot *w = &sim->watches[i];
+        if (w->fn == NULL) {
+            *w = (rvsim_watch_slot){address, size, access, fn, user};
+            if (i >= sim->watch_count) {
+                sim->watch_count = i + 1;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+void rvsim_unwatch(rvsim *sim, int id) {
+    if (id < 0 || id >= RVSIM_MAX_WATCHES) {
+        return;
+    }
+    sim->watches[id].fn = NULL;
+    while (sim->watch_count > 0 && sim->watches[sim->watch_count - 1].fn == NULL) {
+        sim->watch_count--;
+    }
+}
+
+size_t rvsim_render_record(const rvsim_record *record, char out[RVSIM_MAX_LINE]) {
+    trace_record r = {record->pc, record->raw, record->rs1_val, record->rs2_val, record->result, record->address};
+    char line[TRACE_MAX_LINE];
+    size_t length = render_trace_record(&r, line);
+    // callers get a C string, trace lines are far shorter than the buffer
+    if (length > RVSIM_MAX_LINE - 1) {
+        length = RVSIM_MAX_LINE - 1;
+    }
+    memcpy(out, line, length);
+    out[length] = '\0';
+    return length;
+}
+
+#ifndef RISCV_SIM_LIBRARY
+int main(int argc, char *argv[]) {
+
+    const char *input_path = NULL;
+    const char *output_path = NULL;
+    trace_options trace_opts = {TRACE_FULL, 0, 0, 0, TRACE_TEXT};
+    machine_config config = {16u << 20, IMAGE_AUTO, 0, 0, 16, 1, 0, 0, 0, TIMING_DEFAULT_CONFIG, 0, 3, 20, 1, NULL, NULL, TOHOST_DEFAULT};
+    int print_stats = 0;
+    checkpoint_options checkpoint_opts = {CHECKPOINT_NONE, 0, NULL};
+    uint64_t checkpoint_count = 0; // 0 = at ebreak
+    const char *restore_path = NULL;
+    const char *batch_path = NULL;
+    const char *profile_prefix = NULL;
+    int engine_set = 0;
+    const char *pipeline_trace_path = NULL;
+    const char *render_path = NULL;
+    uint64_t slice_start = 0;
+    uint64_t slice_end = UINT64_MAX;
+    uint64_t pc_low = 0;
+    uint64_t pc_high = UINT32_MAX;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            if (parse_trace_option(argv[i] + 8, &trace_opts) != 0) {
+                fprintf(stderr, "Invalid trace mode: %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--trace-format=text") == 0) {
+            trace_opts.format = TRACE_TEXT;
+        } else if (strcmp(argv[i], "--trace-format=binary") == 0) {
+            trace_opts.format = TRACE_BINARY;
+        } else if (strncmp(argv[i], "--render=", 9) == 0 && argv[i][9] != '\0') {
+            render_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--slice=", 8) == 0) {
+            if (parse_number_range(argv[i] + 8, 0, &slice_start, &slice_end) != 0) {
+                fprintf(stderr, "Invalid slice: %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--pcs=", 6) == 0) {
+            if (parse_number_range(argv[i] + 6, 16, &pc_low, &pc_high) != 0 || pc_high > UINT32_MAX) {
+                fprintf(stderr, "Invalid pc range: %s\n", argv[i] + 6);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--engine=interp") == 0) {
+            engine_set = 1;
+            config.use_blocks = 0;
+            config.use_jit = 0;
+        } else if (strcmp(argv[i], "--engine=block") == 0) {
+            engine_set = 1;
+            config.use_blocks = 1;
+            config.use_jit = 0;
+        } else if (strcmp(argv[i], "--engine=jit") == 0) {
+            engine_set = 1;
+            config.use_blocks = 1;
+            config.use_jit = 1;
+        } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+            char *end;
+            config.jit_threshold = strtoull(argv[i] + 16, &end, 0);
+            if (*end != '\0' || config.jit_threshold == 0) {
+                fprintf(stderr, "Invalid JIT threshold: %s\n", argv[i] + 16);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--mem-size=", 11) == 0) {
+            if (parse_mem_size(argv[i] + 11, 0x80000000, &config.mem_size) != 0) {
+                fprintf(stderr, "Invalid memory size: %s\n", argv[i] + 11);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--harts=", 8) == 0) {
+            char *end;
+            long harts = strtol(argv[i] + 8, &end, 0);
+            if (*end != '\0' || harts < 1 || harts > MAX_HARTS) {
+                fprintf(stderr, "Invalid hart count: %s (1 to %d)\n", argv[i] + 8, MAX_HARTS);
+                return 1;
+            }
+            config.harts = (int)harts;
+        } else if (strncmp(argv[i], "--quantum=", 10) == 0) {
+            char *end;
+            config.quantum = strtoull(argv[i] + 10, &end, 0);
+            if (*end != '\0' || argv[i][10] == '\0') {
+                fprintf(stderr, "Invalid quantum: %s\n", argv[i] + 10);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--format=hex") == 0) {
+            config.image_format = IMAGE_HEX;
+        } else if (strcmp(argv[i], "--format=elf") == 0) {
+            config.image_format = IMAGE_ELF;
+        } else if (strcmp(argv[i], "--format=bin") == 0) {
+            config.image_format = IMAGE_BIN;
+        } else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+            checkpoint_opts.path = argv[i] + 13;
+        } else if (strncmp(argv[i], "--checkpoint-at=", 16) == 0) {
+            char *end;
+            if (strcmp(argv[i] + 16, "ebreak") == 0) {
+                checkpoint_count = 0;
+            } else if ((checkpoint_count = strtoull(argv[i] + 16, &end, 0)) == 0 || *end != '\0') {
+                fprintf(stderr, "Invalid checkpoint point: %s\n", argv[i] + 16);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--restore=", 10) == 0) {
+            restore_path = argv[i] + 10;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            char *end;
+            jobs = strtol(argv[i] + 7, &end, 0);
+            if (*end != '\0' || jobs <= 0) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[i] + 7);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile_prefix = "profile";
+        } else if (strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10] != '\0') {
+            profile_prefix = argv[i] + 10;
+        } else if (strcmp(argv[i], "--timing") == 0) {
+            config.use_timing = 1;
+        } else if (strncmp(argv[i], "--l1i=", 6) == 0 || strncmp(argv[i], "--l1d=", 6) == 0 || strncmp(argv[i], "--l2=", 5) == 0) {
+            // any of the model options turns it on
+            int l2 = (argv[i][3] == '2');
+            const char *value = strchr(argv[i], '=') + 1;
+            cache_config *cache = l2 ? &config.timing.l2 : (argv[i][4] == 'i') ? &config.timing.l1i : &config.timing.l1d;
+            if (parse_cache_option(value, l2, cache) != 0) {
+                fprintf(stderr, "Invalid cache: %s (<size>[K|M]:<ways>:<line>[:lru|fifo|random[:<hit cycles>]]%s)\n", value, l2 ? " or off" : "");
+                return 1;
+            }
+            config.use_timing = 1;
+        } else if (strncmp(argv[i], "--bpred=", 8) == 0) {
+            if (parse_predictor_option(argv[i] + 8, &config.timing) != 0) {
+                fprintf(stderr, "Invalid branch predictor: %s (static, bimodal or gshare[:<counters>])\n", argv[i] + 8);
+                return 1;
+            }
+            config.use_timing = 1;
+        } else if (strncmp(argv[i], "--btb=", 6) == 0 || strncmp(argv[i], "--ras=", 6) == 0) {
+            char *end;
+            uint64_t entries = strtoull(argv[i] + 6, &end, 0);
+            int btb = (argv[i][2] == 'b');
+            if (*end != '\0' || argv[i][6] == '\0' || entries > (1u << 20) || (btb && !is_power_of_two(entries))) {
+                fprintf(stderr, "Invalid %s size: %s\n", btb ? "BTB" : "RAS", argv[i] + 6);
+                return 1;
+            }
+            *(btb ? &config.timing.btb_entries : &config.timing.ras_entries) = (uint32_t)entries;
+            config.use_timing = 1;
+        } else if (strncmp(argv[i], "--mem-latency=", 14) == 0 || strncmp(argv[i], "--mispredict-penalty=", 21) == 0) {
+            const char *value = strchr(argv[i], '=') + 1;
+            char *end;
+            unsigned long cycles = strtoul(value, &end, 0);
+            if (*end != '\0' || *value == '\0' || cycles > 100000) {
+                fprintf(stderr, "Invalid cycle count: %s\n", value);
+                return 1;
+            }
+            *((argv[i][3] == 'e') ? &config.timing.memory_cycles : &config.timing.mispredict_cycles) = (uint32_t)cycles;
+            config.use_timing = 1;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            config.use_pipeline = 1;
+        } else if (strncmp(argv[i], "--uart-in=", 10) == 0 && argv[i][10] != '\0') {
+            config.uart_in = argv[i] + 10;
+        } else if (strncmp(argv[i], "--uart-out=", 11) == 0 && argv[i][11] != '\0') {
+            config.uart_out = argv[i] + 11;
+        } else if (strncmp(argv[i], "--tohost=", 9) == 0) {
+            char *end;
+            unsigned long address = strtoul(argv[i] + 9, &end, 16);
+            if (end == argv[i] + 9 || *end != '\0' || address > UINT32_MAX || (address & 3)) {
+                fprintf(stderr, "Invalid tohost address: %s\n", argv[i] + 9);
+                return 1;
+            }
+            config.tohost = (uint32_t)address;
+        } else if (strncmp(argv[i], "--pipeline-trace=", 17) == 0 && argv[i][17] != '\0') {
+            pipeline_trace_path = argv[i] + 17;
+            config.use_pipeline = 1;
+        } else if (strncmp(argv[i], "--mul-latency=", 14) == 0 || strncmp(argv[i], "--div-latency=", 14) == 0) {
+            char *end;
+            unsigned long cycles = strtoul(argv[i] + 14, &end, 0);
+            if (*end != '\0' || cycles == 0 || cycles > 1000) {
+                fprintf(stderr, "Invalid latency: %s (1 to 1000 cycles)\n", argv[i] + 14);
+                return 1;
+            }
+            *((argv[i][2] == 'm') ? &config.mul_cycles : &config.div_cycles) = (uint32_t)cycles;
+            config.use_pipeline = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = 1;
+        } else if (input_path == NULL) {
+            input_path = argv[i];
+        } else if (output_path == NULL) {
+            output_path = argv[i];
+        }
+    }
+
+    config.profile = (profile_prefix != NULL);
+    // profiles on the block engine unless an engine was asked for, it
+    // only counts block entries where the interpreter counts every word
+    if (config.profile && !engine_set) {
+        config.use_blocks = 1;
+    }
+
+    // rendering a binary trace back to text doesn't run anything
+    if (render_path != NULL) {
+        if (input_path == NULL || output_path != NULL) {
+            printf("Usage: %s --render=<trace.bin> [--slice=<start>-<end>] [--pcs=<low>-<high>] <output_file.txt>\n", argv[0]);
+            return 1;
+        }
+        return render_binary_trace(render_path, input_path, slice_start, slice_end, (uint32_t)pc_low, (uint32_t)pc_high) == 0 ? 0 : 1;
+    }
+
+    // batch mode takes every input and output from the manifest
+    if (batch_path != NULL) {
+        if (config.profile || config.use_timing || config.use_pipeline) {
+            fprintf(stderr, "Profiling and the timing models don't work in batch mode\n");
+            return 1;
+        }
+        if (config.uart_in != NULL || config.uart_out != NULL) {
+            fprintf(stderr, "In batch mode the UART always writes to stdout and has no input\n");
+            return 1;
+        }
+        return run_batch(batch_path, jobs > 0 ? (int)jobs : 1, &config, &trace_opts) == 0 ? 0 : 1;
+    }
+
+    // a restored run takes its program from the checkpoint
+    if (restore_path != NULL && output_path == NULL) {
+        output_path = input_path;
+        input_path = NULL;
+    }
+    if ((checkpoint_opts.path != NULL || restore_path != NULL) && config.harts != 1) {
+        fprintf(stderr, "Checkpoints only work with a single hart\n");
+        return 1;
+    }
+    if (checkpoint_opts.path != NULL) {
+        checkpoint_opts.mode = checkpoint_count ? CHECKPOINT_AT_COUNT : CHECKPOINT_AT_EBREAK;
+        checkpoint_opts.count = checkpoint_count;
+    }
+
+    // check if user provided input and output files
+    if ((input_path == NULL && restore_path == NULL) || output_path == NULL) {
+        printf("Usage: %s [--trace=full|off|range:<start>-<end>|pc:<addr>] [--trace-format=text|binary] [--engine=interp|block|jit] [--jit-threshold=<n>] [--mem-size=<bytes>[K|M]] [--format=hex|elf|bin] "
+               "[--harts=<n> [--quantum=<n>]] [--checkpoint=<file> [--checkpoint-at=<n>|ebreak]] [--profile[=<prefix>]] "
+               "[--timing] [--l1i=|--l1d=|--l2=<size>:<ways>:<line>[:<policy>[:<hit cycles>]]] [--bpred=static|bimodal|gshare[:<n>]] [--btb=<n>] [--ras=<n>] "
+               "[--mem-latency=<n>] [--mispredict-penalty=<n>] "
+               "[--pipeline [--mul-latency=<n>] [--div-latency=<n>] [--pipeline-trace=<file>]] "
+               "[--uart-in=<file>] [--uart-out=<file>] [--tohost=<addr>] [--stats] <input_file> <output_file.txt>\n"
+               "       %s --restore=<file> [options] <output_file.txt>\n"
+               "       %s --batch=<manifest> [--jobs=<n>] [options]\n"
+               "       %s --render=<trace.bin> [--slice=<start>-<end>] [--pcs=<low>-<high>] <output_file.txt>\n", argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    // --- Hardware Initialization ---
+    machine m;
+    if (machine_init(&m, &config) != 0) {
+        return 1;
+    }
+
+    // loads the file in the simulated memory, or the whole machine
+    int loaded = (restore_path != NULL) ? machine_restore(&m, restore_path) : machine_load(&m, input_path);
+    if (loaded != 0) {
+        machine_destroy(&m);
+        return 1;
+    }
+
+    // the per-cycle pipeline traces, named like the instruction traces
+    for (int i = 0; pipeline_trace_path != NULL && i < m.hart_count; i++) {
+        char path[4096];
+        if (i > 0) {
+            snprintf(path, sizeof(path), "%s.hart%d", pipeline_trace_path, i);
+        } else {
+            snprintf(path, sizeof(path), "%s", pipeline_trace_path);
+        }
+        pipeline_model *pl = m.harts[i].pipeline;
+        pl->trace = fopen(path, "w");
+        if (pl->trace == NULL) {
+            perror("Error opening the pipeline trace");
+            for (int j = 0; j < i; j++) {
+                fclose(m.harts[j].pipeline->trace);
+            }
+            machine_destroy(&m);
+            return 1;
+        }
+        setvbuf(pl->trace, NULL, _IOFBF, TRACE_OUT_BUFFER_SIZE);
+        fprintf(pl->trace, "%10s  %-18s %-18s %-18s %-18s %s\n", "cycle", "IF", "ID", "EX", "MEM", "WB");
+    }
+
+    // main simulation loop
+    int status = machine_run(&m, output_path, &trace_opts, &checkpoint_opts);
+
+    static const char *const fault_kind[] = {
+        [FAULT_FETCH] = "fetch", [FAULT_LOAD] = "load", [FAULT_STORE] = "store"
+    };
+    for (int i = 0; i < m.hart_count; i++) {
+        exec_context *ctx = &m.harts[i];
+        if (ctx->fault == FAULT_NONE) {
+            continue;
+        }
+        if (m.hart_count > 1) {
+            fprintf(stderr, "Hart %d: ", i);
+        }
+        fprintf(stderr, "Memory fault: %s at 0x%08x (pc 0x%08x)\n", fault_kind[ctx->fault], ctx->fault_address, ctx->pc);
+    }
+
+    // a program that ended through tohost passes its exit code on
+    int exit_code = 0;
+    if (m.devices != NULL && m.devices->exited && m.devices->exit_code != 0) {
+        fprintf(stderr, "Program exited with code %u\n", m.devices->exit_code);
+        exit_code = (m.devices->exit_code > 255) ? 255 : (int)m.devices->exit_code;
+    }
+
+    if (print_stats) {
+        fprintf(stderr, "instructions retired: %llu\n", (unsigned long long)machine_instret(&m));
+        for (int i = 0; i < m.hart_count; i++) {
+            exec_context *ctx = &m.harts[i];
+            if (m.hart_count > 1) {
+                fprintf(stderr, "hart %d: %llu instructions\n", i, (unsigned long long)ctx->instret);
+            }
+            if (ctx->blocks != NULL && ctx->timing == NULL) {
+                print_block_stats(ctx, stderr);
+            }
+            print_fusion_stats(ctx, stderr);
+            print_idiom_stats(ctx, stderr);
+        }
+    }
+
+    // the timing model always reports, it has nothing else to show
+    for (int i = 0; i < m.hart_count; i++) {
+        if (m.harts[i].timing != NULL) {
+            if (m.hart_count > 1) {
+                fprintf(stderr, "hart %d ", i);
+            }
+            timing_report(&m.harts[i], stderr);
+        }
+    }
+    for (int i = 0; i < m.hart_count; i++) {
+        pipeline_model *pl = m.harts[i].pipeline;
+        if (pl != NULL) {
+            if (m.hart_count > 1) {
+                fprintf(stderr, "hart %d ", i);
+            }
+            pipeline_report(pl, stderr);
+            if (pl->trace != NULL && fclose(pl->trace) != 0) {
+                perror("Error writing the pipeline trace");
+                status = -1;
+            }
+            pl->trace = NULL;
+        }
+    }
+
+    // like the traces, hart 0 writes <prefix>.txt and .folded and hart i
+    // <prefix>.hart<i>.txt and .folded
+    for (int i = 0; profile_prefix != NULL && i < m.hart_count; i++) {
+        char prefix[4096];
+        if (i > 0) {
+            snprintf(prefix, sizeof(prefix), "%s.hart%d", profile_prefix, i);
+        } else {
+            snprintf(prefix, sizeof(prefix), "%s", profile_prefix);
+        }
+        if (profile_write(&m.harts[i], prefix) != 0) {
+            status = -1;
+        }
+    }
+
+    machine_destroy(&m);
+
+    return (status != 0) ? 1 : exit_code;
 }
+#endif // RISCV_SIM_LIBRARY
@@ -0,0 +1,146 @@
+// The simulator as a library: a small C API to create machines, load
+// programs from memory, run them for a number of instructions or until
+// something happens, look at and change their registers and memory, and
+// get called back on ebreak, on accesses to watched memory and on every
+// executed instruction.
+//
+// Build RiscV.c with -DRISCV_SIM_LIBRARY (it then has no main) and
+// -fvisibility=hidden, so only the rvsim_ functions below are exported:
+//   gcc -std=gnu11 -O2 -fPIC -shared -fvisibility=hidden -DRISCV_SIM_LIBRARY -pthread src/RiscV.c -o libriscvsim.so
+//
+// Every machine has a single hart and owns all of its state, different
+// machines can run at the same time on different threads. A machine
+// itself must only be used by one thread at a time.
+
+#ifndef RISCV_SIM_H
+#define RISCV_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RVSIM_API __attribute__((visibility("default")))
+
+typedef struct rvsim rvsim;
+
+// how the untraced instructions run, same as --engine=
+enum { RVSIM_ENGINE_INTERP, RVSIM_ENGINE_BLOCK, RVSIM_ENGINE_JIT };
+
+// what the program image is, same as --format=. AUTO tells ELF files
+// from hex text, raw images have to be asked for.
+enum { RVSIM_IMAGE_AUTO, RVSIM_IMAGE_HEX, RVSIM_IMAGE_ELF, RVSIM_IMAGE_BIN };
+
+typedef struct {
+    uint32_t mem_size;      // bytes of RAM at 0x80000000, whole 4 KiB pages
+    int engine;             // RVSIM_ENGINE_*
+    uint64_t jit_threshold; // entries before a block gets compiled
+} rvsim_config;
+
+// why rvsim_run returned
+enum {
+    RVSIM_LIMIT,  // the instructions asked for all retired
+    RVSIM_EBREAK, // the program ran ebreak, pc is past it
+    RVSIM_FAULT,  // a fetch, load or store outside the mapped memory, pc is on it
+    RVSIM_STOPPED // a callback asked to stop, right after the instruction it saw
+};
+
+// what a callback returns
+enum { RVSIM_CONTINUE, RVSIM_STOP };
+
+// one executed instruction, the same values the text trace is made of.
+// What rs1_val, rs2_val, result and address hold depends on the
+// instruction, rvsim_render_record shows them the way the trace does.
+typedef struct {
+    uint32_t pc;
+    uint32_t raw; // instruction word
+    uint32_t rs1_val;
+    uint32_t rs2_val;
+    uint32_t result;
+    uint32_t address;
+} rvsim_record;
+
+// size of the buffer rvsim_render_record writes to: the longest line,
+// its newline and the terminating NUL
+#define RVSIM_MAX_LINE 192
+
+// kinds of memory access, watches only report reads and writes
+enum { RVSIM_READ = 1, RVSIM_WRITE = 2, RVSIM_EXEC = 4 };
+
+// called once an instruction that ran ebreak retired. Returning
+// RVSIM_CONTINUE keeps running after it, RVSIM_STOP makes rvsim_run
+// return RVSIM_EBREAK.
+typedef int (*rvsim_ebreak_fn)(rvsim *sim, void *user);
+
+// called after an instruction read or wrote watched memory, value is what
+// was read or written (size bytes, zero extended). Atomics report their
+// read and their write separately.
+typedef int (*rvsim_memory_fn)(rvsim *sim, int access, uint32_t address, uint32_t size, uint32_t value, void *user);
+
+// called after every executed instruction
+typedef int (*rvsim_trace_fn)(rvsim *sim, const rvsim_record *record, void *user);
+
+#define RVSIM_MAX_WATCHES 16
+
+// 16 MiB of RAM on the interpreter
+RVSIM_API void rvsim_default_config(rvsim_config *config);
+
+// NULL when the host runs out of memory or the config is invalid
+RVSIM_API rvsim *rvsim_create(const rvsim_config *config);
+RVSIM_API void rvsim_destroy(rvsim *sim);
+
+// back to the state right after rvsim_create, callbacks and watches are
+// kept. Much cheaper than a new machine.
+RVSIM_API void rvsim_reset(rvsim *sim);
+
+// maps RAM and loads a program image from a buffer, pc goes to its entry.
+// Returns 0 on success.
+RVSIM_API int rvsim_load(rvsim *sim, const void *image, size_t size, int format);
+
+// runs until max_instructions more retired or an event, returns
+// RVSIM_LIMIT, RVSIM_EBREAK, RVSIM_FAULT or RVSIM_STOPPED. A run after a
+// fault tries the faulting instruction again.
+RVSIM_API int rvsim_run(rvsim *sim, uint64_t max_instructions);
+// runs a single instruction
+RVSIM_API int rvsim_step(rvsim *sim);
+
+RVSIM_API uint32_t rvsim_get_reg(const rvsim *sim, int reg);
+// x0 stays 0
+RVSIM_API void rvsim_set_reg(rvsim *sim, int reg, uint32_t value);
+RVSIM_API uint32_t rvsim_get_pc(const rvsim *sim);
+RVSIM_API void rvsim_set_pc(rvsim *sim, uint32_t pc);
+// instructions retired since the program was loaded
+RVSIM_API uint64_t rvsim_instret(const rvsim *sim);
+// address of the last RVSIM_FAULT
+RVSIM_API uint32_t rvsim_fault_address(const rvsim *sim);
+
+// copy guest memory out of or into the machine, every byte has to be
+// mapped. Writes go around the page permissions and drop any code
+// decoded from the bytes they change. Return 0 on success.
+RVSIM_API int rvsim_read_mem(const rvsim *sim, uint32_t address, void *buffer, size_t size);
+RVSIM_API int rvsim_write_mem(rvsim *sim, uint32_t address, const void *buffer, size_t size);
+// gives the pages covering [address, address + size) the accesses in
+// access (RVSIM_READ, RVSIM_WRITE and RVSIM_EXEC), 0 unmaps them
+RVSIM_API void rvsim_map(rvsim *sim, uint32_t address, uint32_t size, int access);
+
+// at most one of each, NULL turns it off
+RVSIM_API void rvsim_on_ebreak(rvsim *sim, rvsim_ebreak_fn fn, void *user);
+RVSIM_API void rvsim_on_trace(rvsim *sim, rvsim_trace_fn fn, void *user);
+
+// watches the accesses of kind access (RVSIM_READ and/or RVSIM_WRITE) to
+// [address, address + size). Returns a watch id, -1 when there are
+// already RVSIM_MAX_WATCHES.
+RVSIM_API int rvsim_watch(rvsim *sim, uint32_t address, uint32_t size, int access, rvsim_memory_fn fn, void *user);
+RVSIM_API void rvsim_unwatch(rvsim *sim, int id);
+
+// writes the trace line of a record into out as a NUL-terminated string,
+// newline included, returns its length without the NUL
+RVSIM_API size_t rvsim_render_record(const rvsim_record *record, char out[RVSIM_MAX_LINE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RISCV_SIM_H